@@ -0,0 +1,849 @@
+#include <stdarg.h>
+
+// unity build, every phase of the compiler is called directly
+#define COMPILER_NO_MAIN
+#include "../compiler/compiler.cpp"
+
+// @generate
+// synthetic modules, each shape repeats one kind of function until the source reaches the requested size
+enum WorkloadShape {
+    WS_Functions,
+    WS_Chains,
+    WS_Ifs,
+    WS_Lets,
+    WS_Mixed,
+    WS_Count,
+};
+
+string generate_workload(Arena *arena, WorkloadShape shape, i64 size, i32 depth);
+
+void generate_function(DynamicArray<u8> *bytes, WorkloadShape shape, i32 id, i32 depth);
+void generate_small_function(DynamicArray<u8> *bytes, i32 id);
+void generate_chain_function(DynamicArray<u8> *bytes, i32 id, i32 depth);
+void generate_if_function(DynamicArray<u8> *bytes, i32 id, i32 depth);
+void generate_let_function(DynamicArray<u8> *bytes, i32 id, i32 depth);
+void generate_text(DynamicArray<u8> *bytes, const char *format, ...);
+void generate_indent(DynamicArray<u8> *bytes, i32 level);
+
+string workload_shape_to_string(WorkloadShape shape);
+
+string generate_workload(Arena *arena, WorkloadShape shape, i64 size, i32 depth) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, size + 4096);
+
+    for (i32 id = 0; bytes.len < size; id++) {
+        generate_function(&bytes, shape, id, depth);
+    }
+
+    return to_slice(&bytes);
+}
+
+// the id-th function of the shape, mixed cycles through the others
+void generate_function(DynamicArray<u8> *bytes, WorkloadShape shape, i32 id, i32 depth) {
+    WorkloadShape kind = shape == WS_Mixed ? (WorkloadShape) (id % WS_Mixed) : shape;
+
+    switch (kind) {
+        case WS_Functions: {
+            generate_small_function(bytes, id);
+        } break;
+        case WS_Chains: {
+            generate_chain_function(bytes, id, depth);
+        } break;
+        case WS_Ifs: {
+            generate_if_function(bytes, id, depth);
+        } break;
+        case WS_Lets: {
+            generate_let_function(bytes, id, depth);
+        } break;
+        default:
+            Unreachable("unsupported shape in generate_function");
+    }
+}
+
+// many tiny functions, mostly per function overhead
+void generate_small_function(DynamicArray<u8> *bytes, i32 id) {
+    generate_text(bytes, "fn f%d (x y z w) {\n", id);
+    generate_text(bytes, "\tlet a = x + %d;\n", id);
+    generate_text(bytes, "\tif a eql y {\n");
+    generate_text(bytes, "\t\tprint 33;\n");
+    generate_text(bytes, "\t\treturn a + z;\n");
+    generate_text(bytes, "\t}\n");
+    generate_text(bytes, "\treturn a + w;\n");
+    generate_text(bytes, "}\n");
+}
+
+// one left leaning expression depth terms long
+void generate_chain_function(DynamicArray<u8> *bytes, i32 id, i32 depth) {
+    static const char *parameters[] = {"x", "y", "z", "w"};
+
+    generate_text(bytes, "fn c%d (x y z w) {\n", id);
+    generate_text(bytes, "\tlet a = x");
+
+    for (i32 i = 0; i < depth; i++) {
+        if (i % 2 == 0) {
+            generate_text(bytes, " + %d", i);
+        } else {
+            generate_text(bytes, " + %s", parameters[i % 4]);
+        }
+    }
+
+    generate_text(bytes, ";\n");
+    generate_text(bytes, "\treturn a + y;\n");
+    generate_text(bytes, "}\n");
+}
+
+// ifs nested depth deep, every level rebinds the outer local so the joins need phis
+void generate_if_function(DynamicArray<u8> *bytes, i32 id, i32 depth) {
+    generate_text(bytes, "fn n%d (x y z w) {\n", id);
+    generate_text(bytes, "\tlet a = x + 1;\n");
+
+    for (i32 i = 0; i < depth; i++) {
+        generate_indent(bytes, i + 1);
+        generate_text(bytes, "if a eql %d {\n", i);
+        generate_indent(bytes, i + 2);
+        generate_text(bytes, "let a = a + y;\n");
+        generate_indent(bytes, i + 2);
+        generate_text(bytes, "print 65;\n");
+    }
+
+    for (i32 i = depth - 1; i >= 0; i--) {
+        generate_indent(bytes, i + 1);
+        generate_text(bytes, "}\n");
+    }
+
+    generate_text(bytes, "\treturn a + w;\n");
+    generate_text(bytes, "}\n");
+}
+
+// depth lets in a row, each one reading the last
+void generate_let_function(DynamicArray<u8> *bytes, i32 id, i32 depth) {
+    generate_text(bytes, "fn l%d (x y z w) {\n", id);
+    generate_text(bytes, "\tlet l0 = x + y;\n");
+
+    for (i32 i = 1; i < depth; i++) {
+        generate_text(bytes, "\tlet l%d = l%d + z + %d;\n", i, i - 1, i);
+    }
+
+    generate_text(bytes, "\treturn l%d + w;\n", depth - 1);
+    generate_text(bytes, "}\n");
+}
+
+// printf style so braces in the generated source need no escaping
+void generate_text(DynamicArray<u8> *bytes, const char *format, ...) {
+    char buffer[512];
+
+    va_list arguments;
+    va_start(arguments, format);
+    i32 length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+    va_end(arguments);
+
+    Assertf(length >= 0 && length < (i32) sizeof(buffer), "generated line too long in generate_text");
+
+    for (i32 i = 0; i < length; i++) {
+        append(bytes, (u8) buffer[i]);
+    }
+}
+
+void generate_indent(DynamicArray<u8> *bytes, i32 level) {
+    for (i32 i = 0; i < level; i++) {
+        append(bytes, (u8) '\t');
+    }
+}
+
+string workload_shape_to_string(WorkloadShape shape) {
+    switch (shape) {
+        case WS_Functions:  return "functions";
+        case WS_Chains:     return "chains";
+        case WS_Ifs:        return "ifs";
+        case WS_Lets:       return "lets";
+        case WS_Mixed:      return "mixed";
+        default:            Unreachable("unsupported shape in workload_shape_to_string");
+    }
+
+    return "";
+}
+
+// @benchmark
+// every phase is timed on its own over the whole module, the functions go through in batches so the
+// per function arena stays small and the clock is only read a few times per batch
+enum BenchmarkPhase {
+    BP_Lex,
+    BP_Parse,
+    BP_StreamParse,
+    BP_IRGen,
+    BP_Optimise,
+    BP_Asmgen,
+
+    // the same optimised stack ir through the tree pattern selector
+    BP_TreeSelect,
+
+    BP_SSAGen,
+    BP_SSAOptimise,
+    BP_RegAlloc,
+    BP_SSAAsmgen,
+    BP_Peephole,
+    BP_AsmText,
+
+    // the same listing through a file writer to the null device, as the compiler writes program/output.asm
+    BP_AsmStream,
+
+    BP_Encode,
+    BP_Count,
+};
+
+const i32 BENCHMARK_BATCH_SIZE = 256;
+
+struct BenchmarkResult {
+    // one total per measured run, warmup runs are dropped
+    array<DynamicArray<u64>, BP_Count> nanoseconds;
+
+    // work done by each phase in a single run, the same every run
+    array<i64, BP_Count> items;
+
+    // most listing bytes in memory at once, the whole module as text against what the writer buffers
+    i64 text_held;
+    i64 stream_held;
+
+    // executable instructions the stack lowering and the tree selector emit for the whole module
+    i64 stack_instructions;
+    i64 tree_instructions;
+
+    // jumps and branches expected to be taken per call of every function, summed over the module,
+    // with the blocks in the order ir_gen leaves them and in the order layout picks
+    f64 taken_in_order;
+    f64 taken_laid_out;
+};
+
+void benchmark_run(Arena *arena, Arena *batch_arena, string source, BenchmarkResult *result, bool record);
+void benchmark_report(Arena *arena, WorkloadShape shape, string source, BenchmarkResult *result);
+u64 benchmark_percentile(slice<u64> sorted, i32 percent);
+i32 benchmark_compare_u64(const void *a, const void *b);
+string benchmark_phase_to_string(BenchmarkPhase phase);
+string benchmark_unit_to_string(BenchmarkPhase phase);
+
+void benchmark_run(Arena *arena, Arena *batch_arena, string source, BenchmarkResult *result, bool record) {
+    array<u64, BP_Count> nanoseconds = {};
+    array<i64, BP_Count> items = {};
+
+    u64 start = time_now_nanoseconds();
+    TokenStream tokens = lex(arena, source);
+    nanoseconds[BP_Lex] += time_now_nanoseconds() - start;
+    items[BP_Lex] = tokens.kinds.len;
+
+    // the generated source always parses and compiles, a failure is a bug in the generator
+    start = time_now_nanoseconds();
+    AST ast = {};
+    if (!parse(arena, &tokens, &ast)) {
+        Unreachable("the benchmark source did not parse");
+    }
+    nanoseconds[BP_Parse] += time_now_nanoseconds() - start;
+    items[BP_Parse] = ast.nodes.len;
+
+    // the same parse pulling its tokens straight from the source, lexing included
+    start = time_now_nanoseconds();
+    AST stream_ast = {};
+    if (!parse_stream(arena, source, &stream_ast)) {
+        Unreachable("the benchmark source did not parse");
+    }
+    nanoseconds[BP_StreamParse] += time_now_nanoseconds() - start;
+    items[BP_StreamParse] = stream_ast.nodes.len;
+
+    slice<NodeIndex> functions = ast_range(&ast, ast.module);
+    slice<i32> slots = ir_symbol_table_create(arena, symbol_count(&tokens.interner));
+
+#if defined(OS_WINDOWS)
+    FILE *null_file = fopen("NUL", "wb");
+#else
+    FILE *null_file = fopen("/dev/null", "wb");
+#endif
+    Assertf(null_file, "failed to open the null device");
+
+    Writer stream = writer_create(arena, null_file);
+    i64 stream_held = 0;
+
+    i64 stack_instructions = 0;
+    i64 tree_instructions = 0;
+
+    f64 taken_in_order = 0.0;
+    f64 taken_laid_out = 0.0;
+
+    start = time_now_nanoseconds();
+    asm_write_header(&stream);
+    nanoseconds[BP_AsmStream] += time_now_nanoseconds() - start;
+
+    for (i64 batch_start = 0; batch_start < functions.len; batch_start += BENCHMARK_BATCH_SIZE) {
+        arena_reset(batch_arena);
+
+        i64 batch_end = batch_start + BENCHMARK_BATCH_SIZE < functions.len ? batch_start + BENCHMARK_BATCH_SIZE : functions.len;
+        i64 count = batch_end - batch_start;
+
+        DynamicArray<IR> irs = dynamic_array_create<IR>(batch_arena, count);
+        DynamicArray<SSAFunction> ssas = dynamic_array_create<SSAFunction>(batch_arena, count);
+        DynamicArray<RegAlloc> allocations = dynamic_array_create<RegAlloc>(batch_arena, count);
+        DynamicArray<slice<AsmInstruction>> codes = dynamic_array_create<slice<AsmInstruction>>(batch_arena, count);
+
+        // stack ir, optimised and lowered by the stack code generator
+        start = time_now_nanoseconds();
+        for (i64 i = batch_start; i < batch_end; i++) {
+            IR ir = {};
+            if (!ir_gen(batch_arena, &ast, functions[i], slots, &ir)) {
+                Unreachable("the benchmark source did not compile");
+            }
+
+            append(&irs, ir);
+        }
+        nanoseconds[BP_IRGen] += time_now_nanoseconds() - start;
+
+        for (IR &ir : irs) {
+            items[BP_IRGen] += ir.instructions.len;
+            taken_in_order += opt_taken_branches(batch_arena, &ir);
+        }
+
+        start = time_now_nanoseconds();
+        for (IR &ir : irs) {
+            opt_run(batch_arena, &ir, 2);
+        }
+        nanoseconds[BP_Optimise] += time_now_nanoseconds() - start;
+
+        for (IR &ir : irs) {
+            items[BP_Optimise] += ir.instructions.len;
+            taken_laid_out += opt_taken_branches(batch_arena, &ir);
+        }
+
+        start = time_now_nanoseconds();
+        for (IR &ir : irs) {
+            append(&codes, asmgen(batch_arena, &ir, &target_sysv));
+        }
+        nanoseconds[BP_Asmgen] += time_now_nanoseconds() - start;
+
+        for (slice<AsmInstruction> &code : codes) {
+            items[BP_Asmgen] += code.len;
+            stack_instructions += asm_instruction_count(code);
+        }
+
+        reset(&codes);
+
+        start = time_now_nanoseconds();
+        for (IR &ir : irs) {
+            append(&codes, asmgen_tree(batch_arena, &ir, &target_sysv));
+        }
+        nanoseconds[BP_TreeSelect] += time_now_nanoseconds() - start;
+
+        for (slice<AsmInstruction> &code : codes) {
+            items[BP_TreeSelect] += code.len;
+            tree_instructions += asm_instruction_count(code);
+        }
+
+        reset(&codes);
+
+        // ssa, optimised, allocated and lowered, this is the code the text and the encoder see
+        start = time_now_nanoseconds();
+        for (i64 i = batch_start; i < batch_end; i++) {
+            SSAFunction ssa = {};
+            if (!ssa_gen(batch_arena, &ast, functions[i], slots, &ssa)) {
+                Unreachable("the benchmark source did not compile");
+            }
+
+            append(&ssas, ssa);
+        }
+        nanoseconds[BP_SSAGen] += time_now_nanoseconds() - start;
+
+        for (SSAFunction &ssa : ssas) {
+            for (SSABlock &block : ssa.blocks) {
+                items[BP_SSAGen] += block.instructions.len;
+            }
+        }
+
+        start = time_now_nanoseconds();
+        for (SSAFunction &ssa : ssas) {
+            opt_run_ssa(batch_arena, &ssa, 2);
+        }
+        nanoseconds[BP_SSAOptimise] += time_now_nanoseconds() - start;
+
+        for (SSAFunction &ssa : ssas) {
+            for (SSABlock &block : ssa.blocks) {
+                items[BP_SSAOptimise] += block.instructions.len;
+            }
+        }
+
+        items[BP_RegAlloc] += items[BP_SSAOptimise];
+
+        start = time_now_nanoseconds();
+        for (SSAFunction &ssa : ssas) {
+            append(&allocations, regalloc_ssa(batch_arena, &ssa, &target_sysv));
+        }
+        nanoseconds[BP_RegAlloc] += time_now_nanoseconds() - start;
+
+        start = time_now_nanoseconds();
+        for (i64 i = 0; i < count; i++) {
+            append(&codes, asmgen_ssa(batch_arena, &ssas[i], &allocations[i]));
+        }
+        nanoseconds[BP_SSAAsmgen] += time_now_nanoseconds() - start;
+
+        for (slice<AsmInstruction> &code : codes) {
+            items[BP_SSAAsmgen] += code.len;
+        }
+
+        start = time_now_nanoseconds();
+        for (slice<AsmInstruction> &code : codes) {
+            peephole(&code);
+        }
+        nanoseconds[BP_Peephole] += time_now_nanoseconds() - start;
+
+        i64 instruction_count = 0;
+        for (slice<AsmInstruction> &code : codes) {
+            instruction_count += code.len;
+        }
+
+        items[BP_Peephole] += instruction_count;
+
+        DynamicArray<AsmInstruction> batch_code = dynamic_array_create<AsmInstruction>(batch_arena, instruction_count + 1);
+        for (slice<AsmInstruction> &code : codes) {
+            for (AsmInstruction &instruction : code) {
+                append(&batch_code, instruction);
+            }
+        }
+
+        start = time_now_nanoseconds();
+        string text = asm_to_string(batch_arena, to_slice(&batch_code));
+        nanoseconds[BP_AsmText] += time_now_nanoseconds() - start;
+        items[BP_AsmText] += text.len;
+
+        start = time_now_nanoseconds();
+        asm_write_code(&stream, to_slice(&batch_code));
+        nanoseconds[BP_AsmStream] += time_now_nanoseconds() - start;
+
+        stream_held = stream.buffer.len > stream_held ? stream.buffer.len : stream_held;
+
+        start = time_now_nanoseconds();
+        MachineCode machine_code = encode(batch_arena, to_slice(&batch_code), {});
+        nanoseconds[BP_Encode] += time_now_nanoseconds() - start;
+        items[BP_Encode] += machine_code.bytes.len;
+    }
+
+    start = time_now_nanoseconds();
+    asm_write_footer(&stream);
+    writer_flush(&stream);
+    nanoseconds[BP_AsmStream] += time_now_nanoseconds() - start;
+
+    items[BP_AsmStream] = stream.written;
+    fclose(null_file);
+
+    if (!record) {
+        return;
+    }
+
+    for (i32 i = 0; i < BP_Count; i++) {
+        append(&result->nanoseconds[i], nanoseconds[i]);
+        result->items[i] = items[i];
+    }
+
+    // the compiler keeps the listing of the whole module when it is not streaming it
+    result->text_held = items[BP_AsmText];
+    result->stream_held = stream_held;
+
+    result->stack_instructions = stack_instructions;
+    result->tree_instructions = tree_instructions;
+
+    result->taken_in_order = taken_in_order;
+    result->taken_laid_out = taken_laid_out;
+}
+
+void benchmark_report(Arena *arena, WorkloadShape shape, string source, BenchmarkResult *result) {
+    string name = workload_shape_to_string(shape);
+
+    printf("%.*s, %lld source bytes, %lld tokens, %lld runs\n", (i32) name.len, name.ptr,
+        (long long) source.len, (long long) result->items[BP_Lex], (long long) result->nanoseconds[BP_Lex].len);
+    printf("  phase          median ms     p95 ms        rate\n");
+
+    for (i32 i = 0; i < BP_Count; i++) {
+        slice<u64> sorted = slice_clone(arena, to_slice(&result->nanoseconds[i]));
+        qsort(sorted.ptr, sorted.len, sizeof(u64), benchmark_compare_u64);
+
+        u64 median = benchmark_percentile(sorted, 50);
+        u64 p95 = benchmark_percentile(sorted, 95);
+        f64 rate = (f64) result->items[i] / ((f64) (median ? median : 1) / 1e9);
+
+        string phase = benchmark_phase_to_string((BenchmarkPhase) i);
+        string unit = benchmark_unit_to_string((BenchmarkPhase) i);
+
+        printf("  %-12.*s %11.3f %10.3f %11.2f M%.*s/s\n", (i32) phase.len, phase.ptr,
+            (f64) median / 1e6, (f64) p95 / 1e6, rate / 1e6, (i32) unit.len, unit.ptr);
+    }
+
+    printf("  listing held  %10lld KB as text %10lld KB streamed\n",
+        (long long) (result->text_held / 1024), (long long) (result->stream_held / 1024));
+
+    f64 saved = 100.0 * (f64) (result->stack_instructions - result->tree_instructions) / (f64) (result->stack_instructions ? result->stack_instructions : 1);
+    printf("  instructions  %10lld stack   %10lld tree     %.1f%% fewer\n",
+        (long long) result->stack_instructions, (long long) result->tree_instructions, saved);
+
+    f64 avoided = 100.0 * (result->taken_in_order - result->taken_laid_out) / (result->taken_in_order > 0.0 ? result->taken_in_order : 1.0);
+    printf("  taken jumps   %10.1f in order %10.1f laid out %.1f%% fewer\n",
+        result->taken_in_order, result->taken_laid_out, avoided);
+    printf("\n");
+}
+
+// nearest rank on samples sorted ascending
+u64 benchmark_percentile(slice<u64> sorted, i32 percent) {
+    if (sorted.len == 0) {
+        return 0;
+    }
+
+    i64 rank = (sorted.len * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+i32 benchmark_compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *) a;
+    u64 y = *(const u64 *) b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+string benchmark_phase_to_string(BenchmarkPhase phase) {
+    switch (phase) {
+        case BP_Lex:            return "lex";
+        case BP_Parse:          return "parse";
+        case BP_StreamParse:    return "stream_parse";
+        case BP_IRGen:          return "ir_gen";
+        case BP_Optimise:       return "optimise";
+        case BP_Asmgen:         return "asmgen";
+        case BP_TreeSelect:     return "tree_select";
+        case BP_SSAGen:         return "ssa_gen";
+        case BP_SSAOptimise:    return "ssa_optimise";
+        case BP_RegAlloc:       return "regalloc";
+        case BP_SSAAsmgen:      return "ssa_asmgen";
+        case BP_Peephole:       return "peephole";
+        case BP_AsmText:        return "asm_text";
+        case BP_AsmStream:      return "asm_stream";
+        case BP_Encode:         return "encode";
+        default:                Unreachable("unsupported phase in benchmark_phase_to_string");
+    }
+
+    return "";
+}
+
+// what the rate of each phase counts, the input for the middle phases and the output for the emitters
+string benchmark_unit_to_string(BenchmarkPhase phase) {
+    switch (phase) {
+        case BP_Lex:            return "tokens";
+        case BP_Parse:          return "nodes";
+        case BP_StreamParse:    return "nodes";
+        case BP_IRGen:          return "ir";
+        case BP_Optimise:       return "ir";
+        case BP_Asmgen:         return "asm";
+        case BP_TreeSelect:     return "asm";
+        case BP_SSAGen:         return "ssa";
+        case BP_SSAOptimise:    return "ssa";
+        case BP_RegAlloc:       return "ssa";
+        case BP_SSAAsmgen:      return "asm";
+        case BP_Peephole:       return "asm";
+        case BP_AsmText:        return "B";
+        case BP_AsmStream:      return "B";
+        case BP_Encode:         return "B";
+        default:                Unreachable("unsupported phase in benchmark_unit_to_string");
+    }
+
+    return "";
+}
+
+// @memory
+// --pipeline promises peak memory that follows the largest function and not the file. the check writes
+// the workload out a function at a time, so the generator holds no more than the compiler should, runs
+// it through pipeline_run and fails when the peak grew past a bound set by the largest function alone
+const char *MEMORY_CHECK_PATH = "benchmark_memory_check.code";
+
+// what a run needs whatever the functions look like, and what it may hold per byte of the largest one
+const i64 MEMORY_CHECK_BASE_BYTES = MB(32);
+const i64 MEMORY_CHECK_BYTES_PER_SOURCE_BYTE = 256;
+
+bool memory_check_run(WorkloadShape shape, i64 size, i32 depth, u64 baseline, i64 *largest);
+
+// the peak never comes back down, so every shape is measured from the same baseline and held to the
+// largest function of any shape checked so far
+bool memory_check_run(WorkloadShape shape, i64 size, i32 depth, u64 baseline, i64 *largest) {
+    string name = workload_shape_to_string(shape);
+
+    FILE *file = fopen(MEMORY_CHECK_PATH, "wb");
+    if (!file) {
+        Err("Failed to create the memory check source");
+        return false;
+    }
+
+    Arena arena = arena_create(MB(16));
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(&arena, 4096);
+
+    i64 written = 0;
+    i64 shape_largest = 0;
+
+    for (i32 id = 0; written < size; id++) {
+        reset(&bytes);
+        generate_function(&bytes, shape, id, depth);
+
+        if (bytes.len > shape_largest) {
+            shape_largest = bytes.len;
+        }
+
+        written += fwrite(bytes.ptr, 1, bytes.len, file);
+    }
+
+    arena_destroy(&arena);
+
+    if (fclose(file) != 0) {
+        Err("Failed to write the memory check source");
+        return false;
+    }
+
+    // everything but the listing is left as the compiler's own --pipeline would run it
+    Options options;
+    char *no_arguments[] = {(char *) "benchmark"};
+    if (!parse_options(&options, 1, no_arguments)) {
+        Unreachable("the default options did not parse");
+    }
+
+    options.pipeline = true;
+
+#if defined(OS_WINDOWS)
+    const char *null_path = "NUL";
+#else
+    const char *null_path = "/dev/null";
+#endif
+
+    if (shape_largest > *largest) {
+        *largest = shape_largest;
+    }
+
+    CompileStats stats = {};
+
+    bool ok = pipeline_run(&options, MEMORY_CHECK_PATH, null_path, &stats);
+    u64 peak = memory_peak_bytes();
+
+    remove(MEMORY_CHECK_PATH);
+
+    if (!ok) {
+        Unreachable("the benchmark source did not compile");
+    }
+
+    i64 grown = peak > baseline ? (i64) (peak - baseline) : 0;
+    i64 bound = MEMORY_CHECK_BASE_BYTES + *largest * MEMORY_CHECK_BYTES_PER_SOURCE_BYTE;
+
+    printf("%.*s, %lld source bytes, largest function %lld bytes\n", (i32) name.len, name.ptr, (long long) written, (long long) shape_largest);
+    printf("  pipeline peak grew %.2f MB, bound %.2f MB\n", (f64) grown / (f64) MB(1), (f64) bound / (f64) MB(1));
+
+    if (peak == 0) {
+        printf("  peak memory is not measured on this platform\n");
+        return true;
+    }
+
+    if (grown > bound) {
+        printf("Shape: '%.*s'\n", (i32) name.len, name.ptr);
+        Err("--pipeline peak memory is above the bound for its largest function");
+        return false;
+    }
+
+    return true;
+}
+
+// @main
+struct BenchmarkOptions {
+    // WS_Count runs every shape
+    WorkloadShape shape;
+
+    // target source size in kilobytes, and how deep the chains, nests and let runs go
+    i32 size_kilobytes;
+    i32 depth;
+
+    i32 runs;
+    i32 warmup;
+
+    // write the generated source here instead of benchmarking, NULL when not requested
+    const char *write_path;
+
+    // generate this many megabytes per shape and check --pipeline's peak memory instead, 0 when not requested
+    i32 memory_check_megabytes;
+};
+
+bool parse_benchmark_options(BenchmarkOptions *options, i32 argc, char **argv);
+
+bool parse_benchmark_options(BenchmarkOptions *options, i32 argc, char **argv) {
+    *options = {
+        .shape = WS_Count,
+        .size_kilobytes = 1024,
+        .depth = 32,
+        .runs = 10,
+        .warmup = 2,
+        .write_path = NULL,
+        .memory_check_megabytes = 0,
+    };
+
+    for (i32 i = 1; i < argc; i++) {
+        string option = string(argv[i]);
+
+        if (option_has_prefix(option, "--shape=")) {
+            string value = slice_range(option, 8, option.len);
+
+            if (slice_memcmp(value, string("all"))) {
+                options->shape = WS_Count;
+                continue;
+            }
+
+            bool found = false;
+            for (i32 k = 0; k < WS_Count; k++) {
+                if (slice_memcmp(value, workload_shape_to_string((WorkloadShape) k))) {
+                    options->shape = (WorkloadShape) k;
+                    found = true;
+                }
+            }
+
+            if (!found) {
+                Err("--shape expects functions, chains, ifs, lets, mixed or all");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--size=")) {
+            options->size_kilobytes = atoi(argv[i] + 7);
+
+            if (options->size_kilobytes <= 0) {
+                Err("--size expects a positive size in kilobytes");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--depth=")) {
+            options->depth = atoi(argv[i] + 8);
+
+            if (options->depth <= 0 || options->depth > 256) {
+                Err("--depth expects a depth between 1 and 256");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--runs=")) {
+            options->runs = atoi(argv[i] + 7);
+
+            if (options->runs <= 0) {
+                Err("--runs expects a positive count");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--warmup=")) {
+            options->warmup = atoi(argv[i] + 9);
+
+            if (options->warmup < 0) {
+                Err("--warmup expects a count of zero or more");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--write=")) {
+            options->write_path = argv[i] + 8;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--memory-check=")) {
+            options->memory_check_megabytes = atoi(argv[i] + 15);
+
+            if (options->memory_check_megabytes <= 0) {
+                Err("--memory-check expects a positive size in megabytes");
+                return false;
+            }
+
+            continue;
+        }
+
+        printf("Option: '%s'\n", argv[i]);
+        Err("Unknown option");
+        return false;
+    }
+
+    if (options->write_path && options->shape == WS_Count) {
+        Err("--write needs a single --shape");
+        return false;
+    }
+
+    if (options->write_path && options->memory_check_megabytes) {
+        Err("--write and --memory-check do not go together");
+        return false;
+    }
+
+    return true;
+}
+
+i32 main(i32 argc, char **argv) {
+    log_set_options(false, false);
+
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(&options, argc, argv)) {
+        return 1;
+    }
+
+    // before the benchmark's own arenas, nothing else should be resident while the pipeline runs
+    if (options.memory_check_megabytes) {
+        u64 baseline = memory_resident_bytes();
+        i64 largest = 0;
+        bool ok = true;
+
+        for (i32 shape = 0; shape < WS_Count; shape++) {
+            if (options.shape == WS_Count || options.shape == shape) {
+                ok = memory_check_run((WorkloadShape) shape, MB(options.memory_check_megabytes), options.depth, baseline, &largest) && ok;
+            }
+        }
+
+        return ok ? 0 : 1;
+    }
+
+    i64 size = (i64) options.size_kilobytes * 1024;
+
+    // the generated source lives here next to the results, it can be larger than a gigabyte on its own
+    Arena arena = arena_create((u64) size + GB(1));
+    Arena run_arena = arena_create(GB(1));
+    Arena batch_arena = arena_create(GB(1));
+
+    if (options.write_path) {
+        string source = generate_workload(&arena, options.shape, size, options.depth);
+        File file = new_file(options.write_path);
+
+        if (!create_file(&file) || !write_file(&file, source)) {
+            Err("Failed to write the generated source");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    for (i32 shape = 0; shape < WS_Count; shape++) {
+        if (options.shape != WS_Count && options.shape != shape) {
+            continue;
+        }
+
+        arena_reset(&arena);
+
+        string source = generate_workload(&arena, (WorkloadShape) shape, size, options.depth);
+
+        BenchmarkResult result = {};
+        for (i32 i = 0; i < BP_Count; i++) {
+            result.nanoseconds[i] = dynamic_array_create<u64>(&arena, options.runs);
+        }
+
+        for (i32 run = 0; run < options.warmup + options.runs; run++) {
+            arena_reset(&run_arena);
+            benchmark_run(&run_arena, &batch_arena, source, &result, run >= options.warmup);
+        }
+
+        benchmark_report(&arena, (WorkloadShape) shape, source, &result);
+    }
+
+    return 0;
+}
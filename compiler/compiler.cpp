@@ -1,1135 +1,9552 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LEXER_SSE2
+#endif
+
+#if defined(COMPILER_MSVC)
+#include <intrin.h>
+#endif
+
+#if defined(OS_LINUX)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 #include "ack/ack.cpp"
 
-// @lexer
-enum TokenType {
-    // words
-    TT_Identifier,
-    TT_Number,
+// windows.h is only included by platform_windows.cpp, its names collide with ours
+#if defined(OS_WINDOWS)
+extern "C" u64 platform_resident_bytes();
+extern "C" u64 platform_peak_bytes();
+extern "C" const u8 *platform_map_file(const char *path, u64 *size);
+extern "C" void platform_unmap_file(const u8 *memory);
+extern "C" bool platform_create_directory(const char *path);
+extern "C" bool platform_replace_file(const char *from, const char *to);
+extern "C" u64 platform_file_time(const char *path);
+#endif
+
+// @time
+u64 time_now_nanoseconds();
+
+u64 time_now_nanoseconds() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (u64) std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
 
-    // keywords
-    TT_Let,
-    TT_Return,
-    TT_Fn,
-    TT_If,
-    TT_Print,
+// @writer
+// buffered text output, dumps and listings are formatted into the buffer and handed to the file in
+// blocks as it fills. a writer without a file keeps everything and the buffer is the finished string
+const i64 WRITER_FLUSH_SIZE = 64 * 1024;
 
-    // singles
-    TT_Colon,
-    TT_Equals,
-    TT_DoubleEquals,
-    TT_Semicolon,
-    TT_Plus,
-    TT_Minus,
-    TT_Asterisk,
-    TT_Paren_Open,
-    TT_Paren_Close,
-    TT_Brace_Open,
-    TT_Brace_Close,
-};
+// pieces per writev call, well under IOV_MAX everywhere
+const i32 WRITER_VECTOR_COUNT = 256;
 
-struct Token {
-    TokenType type;
-    string source;
+struct Writer {
+    FILE *file;
+    DynamicArray<u8> buffer;
+
+    // bytes handed to the file so far
+    i64 written;
 };
 
-bool is_alpha(u8 c);
-bool is_digit(char c);
-bool is_keyword(string s, TokenType *type);
-slice<Token> lex(Arena *arena, string source);
+Writer writer_create(Arena *arena, FILE *file);
+void writer_write(Writer *writer, string s);
+bool writer_write_pieces(Writer *writer, slice<string> pieces);
+void writer_poll(Writer *writer);
+void writer_flush(Writer *writer);
+string writer_to_string(Writer *writer);
 
-string tokens_to_string(Arena *arena, slice<Token> tokens);
-string token_type_to_string(TokenType type);
+void append_string(DynamicArray<u8> *bytes, string s);
+void append_i64(DynamicArray<u8> *bytes, i64 value);
 
-bool is_alpha(u8 c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
-}
+Writer writer_create(Arena *arena, FILE *file) {
+    Writer writer = {
+        .file = file,
+        .buffer = dynamic_array_create<u8>(arena, file ? WRITER_FLUSH_SIZE * 2 : 1024),
+    };
 
-bool is_digit(char c) {
-    return c >= '0' && c <= '9';
+    return writer;
 }
 
-bool is_keyword(string s, TokenType *type) {
-    if (slice_memcmp(s, slice<u8>("let"))) {
-        *type = TT_Let;
-        return true;
-    }
-
-    if (slice_memcmp(s, slice<u8>("return"))) {
-        *type = TT_Return;
-        return true;
-    }
-
-    if (slice_memcmp(s, slice<u8>("fn"))) {
-        *type = TT_Fn;
-        return true;
-    }
-
-    if (slice_memcmp(s, slice<u8>("if"))) {
-        *type = TT_If;
-        return true;
-    }
-
-    if (slice_memcmp(s, slice<u8>("print"))) {
-        *type = TT_Print;
-        return true;
-    }
-
-    if (slice_memcmp(s, slice<u8>("eql"))) {
-        *type = TT_DoubleEquals;
-        return true;
+void writer_write(Writer *writer, string s) {
+    // anything as big as the buffer goes straight through instead of being copied first
+    if (writer->file && s.len >= WRITER_FLUSH_SIZE) {
+        writer_flush(writer);
+        writer->written += fwrite(s.ptr, 1, s.len, writer->file);
+        return;
     }
 
-    return false;
+    append_string(&writer->buffer, s);
+    writer_poll(writer);
 }
 
-slice<Token> lex(Arena *arena, string source) {
-    DynamicArray<Token> tokens = dynamic_array_create<Token>(arena, source.len);
-
-    i32 i = 0;
-
-    while (i < source.len) {
-        u8 c = source[i];
-
-        switch (c) {
-            case '\n':
-            case '\t':
-            case '\r':
-            case ' ':
-                i++;
-                continue;
-            case ':': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Colon, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case '=': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Equals, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case ';': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Semicolon, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case '+': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Plus, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case '-': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Minus, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case '*': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Asterisk, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case '(': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Paren_Open, .source = s};
-
-                append(&tokens, token);
-
-                i++;
-                continue;
-            } break;
-            case ')': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Paren_Close, .source = s};
-
-                append(&tokens, token);
+// many finished strings in order, on linux they go to the file with writev from where they already are
+// instead of being copied through the buffer
+bool writer_write_pieces(Writer *writer, slice<string> pieces) {
+#if defined(OS_LINUX)
+    if (writer->file) {
+        writer_flush(writer);
 
-                i++;
-                continue;
-            } break;
-            case '{': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Brace_Open, .source = s};
+        if (fflush(writer->file) != 0) {
+            return false;
+        }
 
-                append(&tokens, token);
+        i32 fd = fileno(writer->file);
 
-                i++;
-                continue;
-            } break;
-            case '}': {
-                string s = slice_range(source, i, i + 1);
-                Token token = {.type = TT_Brace_Close, .source = s};
+        // the piece and the offset into it that the next write starts at, writev may stop anywhere
+        i64 piece = 0;
+        i64 offset = 0;
 
-                append(&tokens, token);
+        while (piece < pieces.len) {
+            iovec vectors[WRITER_VECTOR_COUNT];
+            i32 count = 0;
 
-                i++;
-                continue;
-            } break;
-        }
+            for (i64 i = piece; i < pieces.len && count < WRITER_VECTOR_COUNT; i++) {
+                i64 skip = i == piece ? offset : 0;
 
-        if (is_digit(c)) {
-            i32 start = i;
+                if (pieces[i].len > skip) {
+                    vectors[count++] = {.iov_base = pieces[i].ptr + skip, .iov_len = (u64) (pieces[i].len - skip)};
+                }
+            }
 
-            while (i < source.len && is_digit(source[i])) {
-                i++;
+            if (count == 0) {
+                break;
             }
 
-            string s = slice_range(source, start, i);
-            Token token = {.type = TT_Number, .source = s};
+            ssize_t written = writev(fd, vectors, count);
 
-            append(&tokens, token);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
 
-            continue;
-        }
+                return false;
+            }
 
-        if (is_alpha(c)) {
-            i32 start = i;
+            writer->written += written;
 
-            while (i < source.len && (is_alpha(source[i]) || is_digit(source[i]))) {
-                i++;
-            }
+            for (i64 left = written; left > 0;) {
+                i64 rest = pieces[piece].len - offset;
 
-            string s = slice_range(source, start, i);
+                if (left < rest) {
+                    offset += left;
+                    break;
+                }
 
-            TokenType type;
-            if (is_keyword(s, &type)) {
-                Token token = {.type = type, .source = s};
-                append(&tokens, token);
-            } else {
-                Token token = {.type = TT_Identifier, .source = s};
-                append(&tokens, token);
+                left -= rest;
+                piece++;
+                offset = 0;
             }
-
-            continue;
         }
 
-        printf("Char: '%c'\n", c);
-        Unreachable("Lexer failed with above character");
+        return true;
+    }
+#endif
+
+    for (string s : pieces) {
+        writer_write(writer, s);
     }
 
-    return to_slice(&tokens);
+    return true;
 }
 
-string tokens_to_string(Arena *arena, slice<Token> tokens) {
-    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+// called by the formatters after every line or so, cheap unless the buffer is full
+void writer_poll(Writer *writer) {
+    if (writer->file && writer->buffer.len >= WRITER_FLUSH_SIZE) {
+        writer_flush(writer);
+    }
+}
 
-    for (i32 i = 0; i < tokens.len; i++) {
-        Token token = tokens[i];
-        fmt(&bytes, "{}: '{}'\n", token_type_to_string(token.type), token.source);
+void writer_flush(Writer *writer) {
+    if (!writer->file) {
+        return;
     }
 
-    return to_slice(&bytes);
+    writer->written += fwrite(writer->buffer.ptr, 1, writer->buffer.len, writer->file);
+    reset(&writer->buffer);
 }
 
-string token_type_to_string(TokenType type) {
-    switch (type) {
-        case TT_Identifier: return "Identifier";
-        case TT_Number:     return "Number";
-        case TT_Let:        return "Let";
-        case TT_Return:     return "Return";
-        case TT_Fn:         return "Fn";
-        case TT_If:         return "If";
-        case TT_Print:      return "Print";
-        case TT_Colon:      return "Colon";
-        case TT_Equals:     return "Equals";
-        case TT_DoubleEquals:return "DoubleEquals";
-        case TT_Semicolon:  return "Semicolon";
-        case TT_Plus:       return "Plus";
-        case TT_Minus:      return "Minus";
-        case TT_Asterisk:   return "Asterisk";
-        case TT_Paren_Open: return "Paren_Open";
-        case TT_Paren_Close:return "Paren_Close";
-        case TT_Brace_Open: return "Brace_Open";
-        case TT_Brace_Close:return "Brace_Close";
-        default:            Unreachable("unsupported token type in token_type_to_string");
-    }
+string writer_to_string(Writer *writer) {
+    Assertf(!writer->file, "writer_to_string on a writer that flushes to a file");
+    return to_slice(&writer->buffer);
+}
 
-    return "";
+// the listing is mostly short names and small numbers, these skip parsing a format string for them
+
+void append_string(DynamicArray<u8> *bytes, string s) {
+    for (u8 c : s) {
+        append(bytes, c);
+    }
 }
 
-// @parser
-struct ASTNode;
+void append_i64(DynamicArray<u8> *bytes, i64 value) {
+    static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
 
-struct NumberLiteralASTNode {
-    Token value;
-};
+    // filled from the end two digits at a time
+    u8 digits[20];
+    i32 start = sizeof(digits);
 
-struct IdentifierASTNode {
-    Token name;
-};
+    u64 magnitude = value < 0 ? 0 - (u64) value : (u64) value;
 
-struct BinaryASTNode {
-    ASTNode *left;
-    Token op;
-    ASTNode *right;
-};
+    while (magnitude >= 100) {
+        u64 pair = (magnitude % 100) * 2;
+        magnitude /= 100;
 
-struct FunctionASTNode {
-    Token name;
-    array<Token, 4> parameters;
-    slice<string> locals;
-    slice<ASTNode *> body;
-};
+        digits[--start] = digit_pairs[pair + 1];
+        digits[--start] = digit_pairs[pair];
+    }
 
-struct LetASTNode {
-    Token name;
-    ASTNode * expression;
-};
+    if (magnitude >= 10) {
+        digits[--start] = digit_pairs[magnitude * 2 + 1];
+        digits[--start] = digit_pairs[magnitude * 2];
+    } else {
+        digits[--start] = (u8) ('0' + magnitude);
+    }
 
-struct ReturnASTNode {
-    ASTNode *node;
-};
+    if (value < 0) {
+        append(bytes, (u8) '-');
+    }
 
-struct IfASTNode {
-    ASTNode *condition;
-    slice<ASTNode *> body;
-};
+    for (i32 i = start; i < (i32) sizeof(digits); i++) {
+        append(bytes, digits[i]);
+    }
+}
 
-struct PrintASTNode {
-    ASTNode *node;
-};
+// @intern
+// identifiers are interned once by the lexer, everything after compares and indexes by symbol
+typedef u32 Symbol;
 
-enum ASTNodeType {
-    // expressions
-    NT_NumberLiteral,
-    NT_Identifier,
-    NT_Binary,
+struct Interner {
+    Arena *arena;
 
-    // statements
-    NT_Function,
-    NT_Let,
-    NT_Return,
-    NT_If,
-    NT_Print,
+    // indexed by symbol
+    DynamicArray<string> strings;
+    DynamicArray<u32> hashes;
+
+    // open addressing with linear probing, 0 is empty and anything else is symbol + 1
+    slice<u32> table;
 };
 
-struct ASTNode {
-    ASTNodeType type;
+Interner interner_create(Arena *arena, i64 capacity);
+Symbol intern(Interner *interner, string s);
+string symbol_to_string(Interner *interner, Symbol symbol);
+i64 symbol_count(Interner *interner);
+void interner_grow(Interner *interner);
+slice<u32> interner_table_create(Arena *arena, i64 size);
+u32 hash_string(string s);
+
+Interner interner_create(Arena *arena, i64 capacity) {
+    i64 table_size = 16;
+    while (table_size < capacity * 2) {
+        table_size *= 2;
+    }
 
-    union {
-        // expressions
-        NumberLiteralASTNode number_literal;
-        IdentifierASTNode identifier;
-        BinaryASTNode binary;
-
-        // statements
-        FunctionASTNode function;
-        LetASTNode let;
-        ReturnASTNode ret;
-        IfASTNode iff;
-        PrintASTNode print;
+    Interner interner = {
+        .arena = arena,
+        .strings = dynamic_array_create<string>(arena, capacity),
+        .hashes = dynamic_array_create<u32>(arena, capacity),
+        .table = interner_table_create(arena, table_size),
     };
-};
 
-struct AST {
-    ASTNode *root;
-};
+    return interner;
+}
 
-struct Parser {
-    Arena *arena;
+Symbol intern(Interner *interner, string s) {
+    u32 hash = hash_string(s);
+    u32 mask = (u32) interner->table.len - 1;
 
-    i64 position;
-    slice<Token> tokens;
-    DynamicArray<string> locals;
-};
+    for (u32 slot = hash & mask;; slot = (slot + 1) & mask) {
+        u32 entry = interner->table[slot];
 
-AST parse(Arena *arena, slice<Token> tokens);
+        if (entry == 0) {
+            Symbol symbol = (Symbol) interner->strings.len;
 
-ASTNode *parse_node(Parser *parser);
-ASTNode *parse_function(Parser *parser);
-ASTNode *parse_let(Parser *parser);
-ASTNode *parse_return(Parser *parser);
-ASTNode *parse_if(Parser *parser);
-ASTNode *parse_print(Parser *parser);
+            append(&interner->strings, s);
+            append(&interner->hashes, hash);
+            interner->table[slot] = symbol + 1;
 
-ASTNode *parse_expression(Parser *parser);
-ASTNode *parse_binary_2(Parser *parser);
-ASTNode *parse_binary_1(Parser *parser);
-ASTNode *parse_literal(Parser *parser);
-Token parser_next(Parser *parser);
-bool parser_is_next(Parser *parser, TokenType type);
+            // keep the load factor at or under a half so probes stay short
+            if (interner->strings.len * 2 > interner->table.len) {
+                interner_grow(interner);
+            }
 
-string ast_to_string(Arena *arena, AST *ast);
-string node_to_string(DynamicArray<u8> *bytes, ASTNode *node, i32 indent_level);
+            return symbol;
+        }
 
-AST parse(Arena *arena, slice<Token> tokens) {
-    Parser parser = {
-        .arena = arena,
-        .position = 0,
-        .tokens = tokens,
-        .locals = dynamic_array_create<string>(arena, 16),
-    };
+        Symbol symbol = entry - 1;
+        if (interner->hashes[symbol] == hash && slice_memcmp(interner->strings[symbol], s)) {
+            return symbol;
+        }
+    }
+}
 
-    ASTNode *root = parse_node(&parser);
-    Assert(root);
-    Assert(root->type == NT_Function);
+string symbol_to_string(Interner *interner, Symbol symbol) {
+    return interner->strings[symbol];
+}
 
-    AST ast = {
-        .root = root,
-    };
+i64 symbol_count(Interner *interner) {
+    return interner->strings.len;
+}
 
-    return ast;
+void interner_grow(Interner *interner) {
+    slice<u32> table = interner_table_create(interner->arena, interner->table.len * 2);
+    u32 mask = (u32) table.len - 1;
 
-}
+    for (Symbol symbol = 0; symbol < interner->strings.len; symbol++) {
+        u32 slot = interner->hashes[symbol] & mask;
+        while (table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
 
-ASTNode *parse_node(Parser *parser) {
-    if (parser_is_next(parser, TT_Fn)) {
-        return parse_function(parser);
+        table[slot] = symbol + 1;
     }
 
-    if (parser_is_next(parser, TT_Let)) {
-        return parse_let(parser);
-    }
+    interner->table = table;
+}
 
-    if (parser_is_next(parser, TT_Return)) {
-        return parse_return(parser);
-    }
+slice<u32> interner_table_create(Arena *arena, i64 size) {
+    DynamicArray<u32> table = dynamic_array_create<u32>(arena, size);
 
-    if (parser_is_next(parser, TT_If)) {
-        return parse_if(parser);
+    for (i64 i = 0; i < size; i++) {
+        append(&table, 0u);
     }
 
-    if (parser_is_next(parser, TT_Print)) {
-        return parse_print(parser);
+    return to_slice(&table);
+}
+
+// fnv-1a
+u32 hash_string(string s) {
+    u32 hash = 2166136261u;
+
+    for (u8 c : s) {
+        hash ^= c;
+        hash *= 16777619u;
     }
 
-    Unreachable("unexpected token in parse_node");
-    return NULL;
+    return hash;
 }
 
-ASTNode *parse_function(Parser *parser) {
-    ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-    DynamicArray<ASTNode *> body = dynamic_array_create<ASTNode *>(parser->arena, 0);
+// @pool
+// runs a batch of independent tasks on a fixed number of threads, the calling thread is worker 0.
+// every worker starts with an even contiguous share of the indices and takes from its front, once it
+// runs dry it steals single indices from the back of the others. no task is ever added while a batch
+// runs, so a worker that finds every share empty is done
+const i32 POOL_MAX_THREADS = 64;
 
-    Token fn = parser_next(parser);
-    Assert(fn.type == TT_Fn);
+typedef void (*PoolTask)(void *context, i32 worker, i64 index);
 
-    Token name = parser_next(parser);
-    Assert(name.type == TT_Identifier);
+struct PoolShare {
+    // next index in the low 32 bits, one past the last in the high 32 bits, both ends move with a
+    // single compare exchange so the owner and a thief can never take the same index
+    alignas(64) std::atomic<u64> range;
+};
 
-    Token paren_open = parser_next(parser);
-    Assert(paren_open.type == TT_Paren_Open);
+struct ThreadPool {
+    i32 thread_count;
+    array<PoolShare, POOL_MAX_THREADS> shares;
 
-    Token param0 = parser_next(parser);
-    Assert(param0.type == TT_Identifier);
+    PoolTask task;
+    void *context;
+};
 
-    Token param1 = parser_next(parser);
-    Assert(param1.type == TT_Identifier);
+void pool_run(ThreadPool *pool, i64 task_count, PoolTask task, void *context);
+void pool_worker(ThreadPool *pool, i32 worker);
+bool pool_take_front(PoolShare *share, i64 *index);
+bool pool_take_back(PoolShare *share, i64 *index);
+i32 pool_default_thread_count();
 
-    Token param2 = parser_next(parser);
-    Assert(param2.type == TT_Identifier);
+void pool_run(ThreadPool *pool, i64 task_count, PoolTask task, void *context) {
+    Assertf(pool->thread_count >= 1 && pool->thread_count <= POOL_MAX_THREADS, "bad thread count in pool_run");
+    Assertf(task_count <= UINT32_MAX, "too many tasks in pool_run");
 
-    Token param3 = parser_next(parser);
-    Assert(param3.type == TT_Identifier);
+    pool->task = task;
+    pool->context = context;
 
-    Token paren_close = parser_next(parser);
-    Assert(paren_close.type == TT_Paren_Close);
+    i64 per_worker = task_count / pool->thread_count;
+    i64 remainder = task_count % pool->thread_count;
+    i64 start = 0;
 
-    Token brace_open = parser_next(parser);
-    Assert(brace_open.type == TT_Brace_Open);
+    for (i32 i = 0; i < pool->thread_count; i++) {
+        i64 end = start + per_worker + (i < remainder ? 1 : 0);
+        pool->shares[i].range.store((u64) start | ((u64) end << 32), std::memory_order_relaxed);
+        start = end;
+    }
 
-    while (!parser_is_next(parser, TT_Brace_Close)) {
-        ASTNode *body_node = parse_node(parser);
-        Assert(body_node);
+    // a single worker or a single task is not worth a thread
+    if (pool->thread_count == 1 || task_count <= 1) {
+        for (i64 i = 0; i < task_count; i++) {
+            task(context, 0, i);
+        }
 
-        append(&body, body_node);
+        return;
     }
 
-    Token brace_close = parser_next(parser);
-    Assert(brace_close.type == TT_Brace_Close);
-
-    slice<string> locals = {};
+    array<std::thread, POOL_MAX_THREADS> threads;
 
-    if (parser->locals.len > 0) {
-        // clone to function and reset parser locals 
-        locals = slice_clone(parser->arena, to_slice(&parser->locals));
-        reset(&parser->locals);
+    for (i32 i = 1; i < pool->thread_count; i++) {
+        threads[i] = std::thread(pool_worker, pool, i);
     }
 
-    node->type = NT_Function;
-    node->function.name = name;
-    node->function.parameters[0] = param0;
-    node->function.parameters[1] = param1;
-    node->function.parameters[2] = param2;
-    node->function.parameters[3] = param3;
-    node->function.locals = locals;
-    node->function.body = to_slice(&body);
+    pool_worker(pool, 0);
 
-    return node; 
+    for (i32 i = 1; i < pool->thread_count; i++) {
+        threads[i].join();
+    }
 }
 
-ASTNode *parse_let(Parser *parser) {
-    ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-
-    Token let = parser_next(parser);
-    Assert(let.type == TT_Let);
-
-    Token name = parser_next(parser);
-    Assert(name.type == TT_Identifier);
-
-    Token equals = parser_next(parser);
-    Assert(equals.type == TT_Equals);
+void pool_worker(ThreadPool *pool, i32 worker) {
+    i64 index = 0;
 
-    ASTNode *expression = parse_expression(parser);
-    Assert(expression);
+    while (true) {
+        if (pool_take_front(&pool->shares[worker], &index)) {
+            pool->task(pool->context, worker, index);
+            continue;
+        }
 
-    Token semi_colon = parser_next(parser);
-    Assert(semi_colon.type == TT_Semicolon);
+        bool stole = false;
 
-    node->type = NT_Let;
-    node->let.name = name;
-    node->let.expression = expression;
+        for (i32 k = 1; k < pool->thread_count && !stole; k++) {
+            PoolShare *victim = &pool->shares[(worker + k) % pool->thread_count];
 
-    append(&parser->locals, name.source);
+            if (pool_take_back(victim, &index)) {
+                pool->task(pool->context, worker, index);
+                stole = true;
+            }
+        }
 
-    return node; 
+        if (!stole) {
+            return;
+        }
+    }
 }
 
-ASTNode *parse_return(Parser *parser) {
-    Token token = parser_next(parser);
-    Assert(token.type == TT_Return);
-
-    ASTNode *node = parse_expression(parser);
-    Assert(node);
+bool pool_take_front(PoolShare *share, i64 *index) {
+    u64 range = share->range.load(std::memory_order_acquire);
 
-    ASTNode *return_node = arena_alloc<ASTNode>(parser->arena);
-    return_node->type = NT_Return;
-    return_node->ret.node = node;
+    while (true) {
+        u32 front = (u32) range;
+        u32 back = (u32) (range >> 32);
 
-    Token semi_colon = parser_next(parser);
-    Assert(semi_colon.type == TT_Semicolon);
+        if (front >= back) {
+            return false;
+        }
 
-    return return_node;
+        u64 next = (u64) (front + 1) | ((u64) back << 32);
+        if (share->range.compare_exchange_weak(range, next, std::memory_order_acq_rel)) {
+            *index = front;
+            return true;
+        }
+    }
 }
 
-ASTNode *parse_if(Parser *parser) {
-    ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-    DynamicArray<ASTNode *> body = dynamic_array_create<ASTNode *>(parser->arena, 0);
+bool pool_take_back(PoolShare *share, i64 *index) {
+    u64 range = share->range.load(std::memory_order_acquire);
 
-    Token token = parser_next(parser);
-    Assert(token.type == TT_If);
-
-    ASTNode *condition = parse_expression(parser);
-    Assert(condition);
-
-    Token brace_open = parser_next(parser);
-    Assert(brace_open.type == TT_Brace_Open);
+    while (true) {
+        u32 front = (u32) range;
+        u32 back = (u32) (range >> 32);
 
-    while (!parser_is_next(parser, TT_Brace_Close)) {
-        ASTNode *body_node = parse_node(parser);
-        Assert(body_node);
+        if (front >= back) {
+            return false;
+        }
 
-        append(&body, body_node);
+        u64 next = (u64) front | ((u64) (back - 1) << 32);
+        if (share->range.compare_exchange_weak(range, next, std::memory_order_acq_rel)) {
+            *index = back - 1;
+            return true;
+        }
     }
+}
 
-    Token brace_close = parser_next(parser);
-    Assert(brace_close.type == TT_Brace_Close);
+i32 pool_default_thread_count() {
+    i32 count = (i32) std::thread::hardware_concurrency();
 
-    node->type = NT_If;
-    node->iff.condition = condition;
-    node->iff.body = to_slice(&body);
+    if (count < 1) {
+        return 1;
+    }
 
-    return node;
+    return count < POOL_MAX_THREADS ? count : POOL_MAX_THREADS;
 }
 
-ASTNode *parse_print(Parser *parser) {
-    Token token = parser_next(parser);
-    Assert(token.type == TT_Print);
-
-    ASTNode *expression = parse_expression(parser);
-    Assert(expression);
+// @lexer
+enum TokenType {
+    // words
+    TT_Identifier,
+    TT_Number,
 
-    ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-    node->type = NT_Print;
-    node->print.node = expression;
+    // keywords
+    TT_Let,
+    TT_Return,
+    TT_Fn,
+    TT_If,
+    TT_Print,
 
-    Token semi_colon = parser_next(parser);
-    Assert(semi_colon.type == TT_Semicolon);
+    // singles
+    TT_Colon,
+    TT_Equals,
+    TT_DoubleEquals,
+    TT_Semicolon,
+    TT_Plus,
+    TT_Minus,
+    TT_Asterisk,
+    TT_Paren_Open,
+    TT_Paren_Close,
+    TT_Brace_Open,
+    TT_Brace_Close,
 
-    return node;
-}
+    // a byte no token starts with, left for the parser to report
+    TT_Invalid,
+};
 
-ASTNode *parse_expression(Parser *parser) {
-    return parse_binary_2(parser);
-}
+// one token as the parser sees it, built from the stream on demand
+struct Token {
+    TokenType type;
+    string source;
 
-ASTNode *parse_binary_2(Parser *parser) {
-    ASTNode *expression = parse_binary_1(parser);
+    // value of a TT_Number token
+    u64 number;
 
-    while (parser_is_next(parser, TT_DoubleEquals)) {
-        Token op = parser_next(parser);
-        ASTNode *right = parse_binary_1(parser);
+    // interned name of a TT_Identifier token
+    Symbol symbol;
 
-        ASTNode *binary = arena_alloc<ASTNode>(parser->arena);
-        binary->type = NT_Binary;
-        binary->binary.left = expression;
-        binary->binary.op = op;
-        binary->binary.right = right;
+    // position in the stream and offset of the first byte in the source
+    u32 index;
+    u32 start;
+};
 
-        expression = binary;
-    }
+// structure of arrays with one entry per token in kinds, starts and lengths
+struct TokenStream {
+    string source;
 
-    return expression;
-}
+    slice<u8> kinds;
+    slice<u32> starts;
+    slice<u32> lengths;
 
-ASTNode *parse_binary_1(Parser *parser) {
-    ASTNode *expression = parse_literal(parser);
+    // value of every TT_Number token in source order, parsed once by the lexer
+    slice<u64> numbers;
 
-    while (parser_is_next(parser, TT_Plus) || parser_is_next(parser, TT_Minus)) {
-        Token op = parser_next(parser);
-        ASTNode *right = parse_literal(parser);
+    // symbol of every TT_Identifier token in source order
+    slice<Symbol> symbols;
+    Interner interner;
+};
 
-        ASTNode *binary = arena_alloc<ASTNode>(parser->arena);
-        binary->type = NT_Binary;
-        binary->binary.left = expression;
-        binary->binary.op = op;
-        binary->binary.right = right;
+// how the parser gets its tokens, LM_Batch lexes the whole source into a TokenStream first and
+// LM_Stream pulls them from a LexCursor as it goes so the token arrays never exist
+enum LexMode {
+    LM_Batch,
+    LM_Stream,
+};
 
-        expression = binary;
-    }
+struct LexCursor {
+    string source;
+    i32 position;
 
-    return expression;
-}
+    // tokens produced so far, the index of the next one
+    u32 count;
+    Interner *interner;
+};
 
-ASTNode *parse_literal(Parser *parser) {
-    if (parser_is_next(parser, TT_Number)) {
-        Token token = parser_next(parser);
+enum CharClass : u8 {
+    CC_Invalid,
+    CC_Whitespace,
+    CC_Alpha,
+    CC_Digit,
+    CC_Single,
+};
 
-        ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-        node->type = NT_NumberLiteral;
-        node->number_literal.value = token;
+struct CharTable {
+    array<CharClass, 256> classes;
 
-        return node;
-    }
+    // token type of every CC_Single byte
+    array<TokenType, 256> singles;
+};
 
-    if (parser_is_next(parser, TT_Identifier)) {
-        Token token = parser_next(parser);
+struct Keyword {
+    const char *name;
+    i64 len;
+    TokenType type;
+};
 
-        ASTNode *node = arena_alloc<ASTNode>(parser->arena);
-        node->type = NT_Identifier;
-        node->identifier.name = token;
+const u32 KEYWORD_TABLE_SIZE = 8;
 
-        return node;
-    }
+// the parallel lexer cuts the source on whitespace, which no token spans, so every chunk lexes on its
+// own. the chunks are stitched back in order with their symbols renumbered, which gives exactly the
+// TokenStream lex would have
+const i64 LEX_CHUNK_MIN_SIZE = MB(1);
 
-    Unreachable("unexpected token in parse_literal");
-    return NULL;
-}
+struct LexChunk {
+    string source;
+    u32 offset;
+    TokenStream tokens;
 
-Token parser_next(Parser *parser) {
-    Token token = parser->tokens[parser->position];
-    parser->position += 1;
+    // sized from this chunk alone, released once its tokens are stitched
+    Arena arena;
 
-    return token;
-}
+    // where the chunk's tokens, numbers and symbols start in the stitched stream
+    i64 token_start;
+    i64 number_start;
+    i64 symbol_start;
 
-bool parser_is_next(Parser *parser, TokenType type) {
-    if (parser->position >= parser->tokens.len) {
-        return false;
-    }
+    // chunk symbol to stream symbol
+    slice<Symbol> symbols;
+};
 
-    return parser->tokens[parser->position].type == type;
-}
+struct LexJob {
+    slice<LexChunk> chunks;
+    TokenStream *result;
+};
 
-string ast_to_string(Arena *arena, AST *ast) {
-    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+constexpr CharTable char_table_create();
+constexpr u32 keyword_hash(u8 first, i64 len);
+constexpr array<Keyword, KEYWORD_TABLE_SIZE> keyword_table_create();
+constexpr bool keyword_hash_is_perfect();
 
-    node_to_string(&bytes, ast->root, 0);
+bool is_keyword(string s, TokenType *type);
+i32 lex_skip_whitespace(string source, i32 i);
+i32 lex_scan_identifier(string source, i32 i);
+i32 lex_scan_number(string source, i32 i);
+u64 lex_number_value(string source, i32 start, i32 end);
+u32 count_trailing_zeros(u32 value);
+TokenStream lex(Arena *arena, string source);
+TokenStream lex_parallel(Arena *arena, string source, i32 thread_count);
+void lex_chunk_task(void *context, i32 worker, i64 index);
+void lex_stitch_task(void *context, i32 worker, i64 index);
+bool tokens_equal(TokenStream *a, TokenStream *b);
+LexCursor lex_cursor_create(string source, Interner *interner);
+bool lex_next(LexCursor *cursor, Token *token);
+void lex_benchmark(string source, i32 megabytes, i32 thread_count);
+
+void tokens_write(Writer *writer, TokenStream *tokens);
+string token_type_to_string(TokenType type);
 
-    return to_slice(&bytes);
-}
+constexpr array<Keyword, 6> keywords = {{
+    {"let",    3, TT_Let},
+    {"return", 6, TT_Return},
+    {"fn",     2, TT_Fn},
+    {"if",     2, TT_If},
+    {"print",  5, TT_Print},
+    {"eql",    3, TT_DoubleEquals},
+}};
 
-string node_to_string(DynamicArray<u8> *bytes, ASTNode *node, i32 indent_level) {
-    static const auto indent = [](DynamicArray<u8> *bytes, i32 level) {
-        for (i32 i = 0; i < level; i++) {
-            if (i == level - 1) {
-                fmt(bytes, "+ ");
-            } else {
-                fmt(bytes, "| ");
-            }
-        }
-    };
+constexpr CharTable char_table_create() {
+    CharTable table = {};
 
-    switch (node->type) {
-        case NT_NumberLiteral: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Number Literal: {}\n", node->number_literal.value.source);
-        } break;
-        case NT_Identifier: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Identifier: {}\n", node->identifier.name.source);
-        } break;
-        case NT_Binary: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Binary:\n");
+    for (i32 c = 0; c < 256; c++) {
+        table.classes[c] = CC_Invalid;
+        table.singles[c] = TT_Identifier;
 
-            node_to_string(bytes, node->binary.left, indent_level + 1);
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
+            table.classes[c] = CC_Alpha;
+        }
 
-            indent(bytes, indent_level + 1);
-            fmt(bytes, "Op: {}\n", node->binary.op.source);
+        if (c >= '0' && c <= '9') {
+            table.classes[c] = CC_Digit;
+        }
+    }
 
-            node_to_string(bytes, node->binary.right, indent_level + 1);
-        } break;
-        case NT_Function: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Fn {}:\n", node->function.name.source);
+    table.classes['\n'] = CC_Whitespace;
+    table.classes['\t'] = CC_Whitespace;
+    table.classes['\r'] = CC_Whitespace;
+    table.classes[' '] = CC_Whitespace;
+
+    struct Single { u8 c; TokenType type; };
+
+    Single singles[] = {
+        {':', TT_Colon},
+        {'=', TT_Equals},
+        {';', TT_Semicolon},
+        {'+', TT_Plus},
+        {'-', TT_Minus},
+        {'*', TT_Asterisk},
+        {'(', TT_Paren_Open},
+        {')', TT_Paren_Close},
+        {'{', TT_Brace_Open},
+        {'}', TT_Brace_Close},
+    };
 
-            indent(bytes, indent_level + 1);
+    for (Single single : singles) {
+        table.classes[single.c] = CC_Single;
+        table.singles[single.c] = single.type;
+    }
 
-            fmt(bytes, "Parameters:");
-            for (i32 i = 0; i < node->function.parameters.size(); i++) {
-                fmt(bytes, " {}", node->function.parameters[i].source);
-            }
+    return table;
+}
 
-            fmt(bytes, "\n");
+// the first byte and the length are enough to tell the keywords apart
+constexpr u32 keyword_hash(u8 first, i64 len) {
+    return ((u32) first * 6 + (u32) len) & (KEYWORD_TABLE_SIZE - 1);
+}
 
-            indent(bytes, indent_level + 1);
+constexpr array<Keyword, KEYWORD_TABLE_SIZE> keyword_table_create() {
+    array<Keyword, KEYWORD_TABLE_SIZE> table = {};
 
-            fmt(bytes, "Locals:");
-            for (i32 i = 0; i < node->function.locals.len; i++) {
-                fmt(bytes, " {}", node->function.locals[i]);
-            }
+    for (Keyword keyword : keywords) {
+        table[keyword_hash(keyword.name[0], keyword.len)] = keyword;
+    }
 
-            fmt(bytes, "\n");
+    return table;
+}
 
-            for (ASTNode *statement : node->function.body) {
-                node_to_string(bytes, statement, indent_level + 1);
+constexpr bool keyword_hash_is_perfect() {
+    for (i32 i = 0; i < (i32) keywords.size(); i++) {
+        for (i32 k = i + 1; k < (i32) keywords.size(); k++) {
+            if (keyword_hash(keywords[i].name[0], keywords[i].len) == keyword_hash(keywords[k].name[0], keywords[k].len)) {
+                return false;
             }
-        } break;
-        case NT_Let: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Let: {}\n", node->let.name.source);
+        }
+    }
 
-            node_to_string(bytes, node->let.expression, indent_level + 1);
-        } break;
-        case NT_Return: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Return:\n");
+    return true;
+}
 
-            node_to_string(bytes, node->ret.node, indent_level + 1);
-        } break;
-        case NT_If: {
-            indent(bytes, indent_level);
-            fmt(bytes, "If:\n");
+static_assert(keyword_hash_is_perfect(), "keyword_hash has a collision, change the multiplier or the table size");
 
-            indent(bytes, indent_level + 1);
-            fmt(bytes, "Condition:\n");
-            node_to_string(bytes, node->iff.condition, indent_level + 2);
+constexpr CharTable char_table = char_table_create();
+constexpr array<Keyword, KEYWORD_TABLE_SIZE> keyword_table = keyword_table_create();
 
-            indent(bytes, indent_level + 1);
-            fmt(bytes, "Body:\n");
-            for (ASTNode *statement : node->iff.body) {
-                node_to_string(bytes, statement, indent_level + 2);
-            }
-        } break;
-        case NT_Print: {
-            indent(bytes, indent_level);
-            fmt(bytes, "Print:\n");
+bool is_keyword(string s, TokenType *type) {
+    // empty slots have a length of 0 which never matches an identifier
+    const Keyword &keyword = keyword_table[keyword_hash(s[0], s.len)];
 
-            node_to_string(bytes, node->print.node, indent_level + 1);
-        } break;
-        default:
-            Unreachable("unsupported expression type in ast_to_string");
+    if (keyword.len != s.len || memcmp(keyword.name, s.ptr, s.len) != 0) {
+        return false;
     }
 
-    return to_slice(bytes);
+    *type = keyword.type;
+    return true;
 }
 
-// @ir
-enum InstructionType {
-    IT_StartFunction,
-    IT_EndFunction,
-    IT_Push,
-    IT_Add,
-    IT_Local,
-    IT_Return,
-    IT_IfZero,
-    IT_Label,
-    IT_CompareEqual,
-    IT_Print,
-};
+// the scanners below check 16 bytes per step while a full block is left and finish with the table,
+// sse2 is always there on x86_64 so no runtime detection is needed. most runs are a byte or two long
+// so the byte after the first one is checked before paying for a block
 
-struct Instruction {
-    InstructionType type;
-    i32 value;
-    string string;
-};
+i32 lex_skip_whitespace(string source, i32 i) {
+    if (i >= source.len || char_table.classes[source[i]] != CC_Whitespace) {
+        return i;
+    }
 
-struct IR {
-    array<Token, 4> parameters;
-    DynamicArray<Instruction> instructions;
-};
+#if defined(LEXER_SSE2)
+    while (i + 16 <= source.len) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (source.ptr + i));
 
-IR ir_gen(Arena *arena, AST *ast);
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')))
+        );
 
-void ir_gen_node(IR *ir, ASTNode *node);
+        u32 mask = ~(u32) _mm_movemask_epi8(space) & 0xFFFF;
+        if (mask) {
+            return i + (i32) count_trailing_zeros(mask);
+        }
 
-void ir_gen_number_literal(IR *ir, ASTNode *node);
-void ir_gen_identifier(IR *ir, ASTNode *node);
-void ir_gen_binary(IR *ir, ASTNode *node);
+        i += 16;
+    }
+#endif
 
-void ir_gen_function(IR *ir, ASTNode *node);
-void ir_gen_return(IR *ir, ASTNode *node);
-void ir_gen_if(IR *ir, ASTNode *node);
-void ir_gen_print(IR *ir, ASTNode *node);
+    while (i < source.len && char_table.classes[source[i]] == CC_Whitespace) {
+        i++;
+    }
 
-i32 ir_get_parameter_index(IR *ir, string name);
+    return i;
+}
 
-string ir_to_string(Arena *arena, slice<Instruction> instructions);
+i32 lex_scan_identifier(string source, i32 i) {
+    if (i >= source.len || (char_table.classes[source[i]] != CC_Alpha && char_table.classes[source[i]] != CC_Digit)) {
+        return i;
+    }
 
-IR ir_gen(Arena *arena, AST *ast) {
-    Assertf(ast->root->type == NT_Function, "ir_gen only supports function root nodes");
+#if defined(LEXER_SSE2)
+    while (i + 16 <= source.len) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (source.ptr + i));
 
-    IR ir = {
-        .parameters = ast->root->function.parameters,
-        .instructions = dynamic_array_create<Instruction>(arena, 1024),
-    };
+        // setting 0x20 folds upper case onto lower case, bytes above 0x7f are negative and fail both ranges
+        __m128i lower = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        __m128i underscore = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_'));
 
-    ir_gen_node(&ir, ast->root);
+        __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit), underscore);
 
-    return ir;
-}
+        u32 mask = ~(u32) _mm_movemask_epi8(word) & 0xFFFF;
+        if (mask) {
+            return i + (i32) count_trailing_zeros(mask);
+        }
 
-void ir_gen_node(IR *ir, ASTNode *node) {
-    switch (node->type) {
-        case NT_NumberLiteral: {
-            ir_gen_number_literal(ir, node);
-        } break;
-        case NT_Identifier: {
-            ir_gen_identifier(ir, node);
-        } break;
-        case NT_Binary: {
-            ir_gen_binary(ir, node);
-        } break;
-        case NT_Function: {
-            ir_gen_function(ir, node);
-        } break;
-        case NT_Return: {
-            ir_gen_return(ir, node);
-        } break;
-        case NT_If: {
-            ir_gen_if(ir, node);
-        } break;
-        case NT_Print: {
-            ir_gen_print(ir, node);
-        } break;
-        default:
-            Unreachable("unsupported expression type in ir_gen_node");
+        i += 16;
     }
-}
+#endif
 
-void ir_gen_number_literal(IR *ir, ASTNode *node) {
-    i32 value = atoi((const char *) node->number_literal.value.source.ptr);
+    while (i < source.len && (char_table.classes[source[i]] == CC_Alpha || char_table.classes[source[i]] == CC_Digit)) {
+        i++;
+    }
 
-    Instruction instruction = {.type = IT_Push, .value = value};
-    append(&ir->instructions, instruction);
+    return i;
 }
 
-void ir_gen_identifier(IR *ir, ASTNode *node) {
-    i32 index = ir_get_parameter_index(ir, node->identifier.name.source);
-    if (index == -1) {
-        Unreachable("unknown identifier in ir_gen_identifier");
+i32 lex_scan_number(string source, i32 i) {
+    if (i >= source.len || char_table.classes[source[i]] != CC_Digit) {
+        return i;
     }
 
-    Instruction instruction = {.type = IT_Local, .value = index};
-    append(&ir->instructions, instruction);
-}
+#if defined(LEXER_SSE2)
+    while (i + 16 <= source.len) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (source.ptr + i));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
 
-void ir_gen_binary(IR *ir, ASTNode *node) {
-    ir_gen_node(ir, node->binary.left);
-    ir_gen_node(ir, node->binary.right);
+        u32 mask = ~(u32) _mm_movemask_epi8(digit) & 0xFFFF;
+        if (mask) {
+            return i + (i32) count_trailing_zeros(mask);
+        }
 
-    switch (node->binary.op.type) {
-        case TT_Plus: {
-            Instruction instruction = {.type = IT_Add};
-            append(&ir->instructions, instruction); 
-        } break;
-        case TT_DoubleEquals: {
-            Instruction instruction = {.type = IT_CompareEqual};
-            append(&ir->instructions, instruction); 
-        } break;
-        default:
-            Unreachable("unsupported binary operator in ir_gen_binary");
+        i += 16;
     }
+#endif
+
+    while (i < source.len && char_table.classes[source[i]] == CC_Digit) {
+        i++;
+    }
+
+    return i;
 }
 
-void ir_gen_function(IR *ir, ASTNode *node) {
-    append(&ir->instructions, {.type = IT_StartFunction, .string = node->function.name.source});
+// stops one past INT32_MAX so a long run of digits cannot wrap into a value that fits, the parser
+// rejects anything that large
+u64 lex_number_value(string source, i32 start, i32 end) {
+    u64 number = 0;
 
-    for (ASTNode *statement : node->function.body) {
-        ir_gen_node(ir, statement);
+    for (i32 k = start; k < end && number <= INT32_MAX; k++) {
+        number = number * 10 + (source[k] - '0');
     }
 
-    append(&ir->instructions, {.type = IT_EndFunction, .string = node->function.name.source});
+    return number <= INT32_MAX ? number : (u64) INT32_MAX + 1;
 }
 
-void ir_gen_return(IR *ir, ASTNode *node) {
-    ir_gen_node(ir, node->ret.node);
+u32 count_trailing_zeros(u32 value) {
+    Assert(value != 0);
 
-    Instruction instruction = {.type = IT_Return};
-    append(&ir->instructions, instruction);
+#if defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (u32) index;
+#else
+    return (u32) __builtin_ctz(value);
+#endif
 }
 
-void ir_gen_if(IR *ir, ASTNode *node) {
-    ir_gen_node(ir, node->iff.condition);
+TokenStream lex(Arena *arena, string source) {
+    Assertf(source.len <= INT32_MAX, "source is too large for the 32 bit scan index");
 
-    append(&ir->instructions, Instruction{.type = IT_IfZero, .string = "label_if"});
-    
-    for (auto n : node->iff.body) {
-        ir_gen_node(ir, n);
-    }
+    // real code averages well over two bytes per token once whitespace is counted, so this rarely grows
+    i64 capacity = source.len / 2 + 16;
 
-    append(&ir->instructions, Instruction{.type = IT_Label, .string = "label_if"});
-}
+    DynamicArray<u8> kinds = dynamic_array_create<u8>(arena, capacity);
+    DynamicArray<u32> starts = dynamic_array_create<u32>(arena, capacity);
+    DynamicArray<u32> lengths = dynamic_array_create<u32>(arena, capacity);
+    DynamicArray<u64> numbers = dynamic_array_create<u64>(arena, capacity / 8 + 16);
+    DynamicArray<Symbol> symbols = dynamic_array_create<Symbol>(arena, capacity / 4 + 16);
 
-void ir_gen_print(IR *ir, ASTNode *node) {
-    ir_gen_node(ir, node->print.node);
+    Interner interner = interner_create(arena, 64);
 
-    append(&ir->instructions, Instruction{.type = IT_Print});
-}
+    i32 i = 0;
+
+    while (i < source.len) {
+        u8 c = source[i];
+
+        switch (char_table.classes[c]) {
+            case CC_Whitespace: {
+                i = lex_skip_whitespace(source, i + 1);
+            } break;
+            case CC_Single: {
+                append(&kinds, (u8) char_table.singles[c]);
+                append(&starts, (u32) i);
+                append(&lengths, (u32) 1);
+
+                i++;
+            } break;
+            case CC_Digit: {
+                i32 start = i;
+                i = lex_scan_number(source, i + 1);
+
+                append(&kinds, (u8) TT_Number);
+                append(&starts, (u32) start);
+                append(&lengths, (u32) (i - start));
+                append(&numbers, lex_number_value(source, start, i));
+            } break;
+            case CC_Alpha: {
+                i32 start = i;
+                i = lex_scan_identifier(source, i + 1);
+
+                string s = slice_range(source, start, i);
+
+                TokenType type = TT_Identifier;
+                if (!is_keyword(s, &type)) {
+                    append(&symbols, intern(&interner, s));
+                }
 
-i32 ir_get_parameter_index(IR *ir, string name) {
-    for (i32 i = 0; i < ir->parameters.size(); i++) {
-        if (slice_memcmp(ir->parameters[i].source, name)) {
-            return i;
+                append(&kinds, (u8) type);
+                append(&starts, (u32) start);
+                append(&lengths, (u32) (i - start));
+            } break;
+            default: {
+                append(&kinds, (u8) TT_Invalid);
+                append(&starts, (u32) i);
+                append(&lengths, (u32) 1);
+
+                i++;
+            }
         }
     }
 
-    return -1;
+    return TokenStream{
+        .source = source,
+        .kinds = to_slice(&kinds),
+        .starts = to_slice(&starts),
+        .lengths = to_slice(&lengths),
+        .numbers = to_slice(&numbers),
+        .symbols = to_slice(&symbols),
+        .interner = interner,
+    };
 }
 
-string ir_to_string(Arena *arena, IR *ir) {
-    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+TokenStream lex_parallel(Arena *arena, string source, i32 thread_count) {
+    Assertf(source.len <= INT32_MAX, "source is too large for the 32 bit scan index");
 
-    for (i32 i = 0; i < ir->instructions.len; i++) {
-        Instruction instruction = ir->instructions[i];
+    // a few chunks per thread so a slow one can be balanced out by stealing
+    i64 chunk_count = (i64) thread_count * 4;
+    if (source.len / chunk_count < LEX_CHUNK_MIN_SIZE) {
+        chunk_count = source.len / LEX_CHUNK_MIN_SIZE;
+    }
 
-        fmt(&bytes, "[{}] ", i);
+    if (thread_count < 2 || chunk_count < 2) {
+        return lex(arena, source);
+    }
+
+    DynamicArray<LexChunk> chunks = dynamic_array_create<LexChunk>(arena, chunk_count);
+
+    i64 start = 0;
+
+    for (i64 k = 1; k < chunk_count; k++) {
+        i64 end = source.len * k / chunk_count;
+        if (end <= start) {
+            continue;
+        }
+
+        // walk the cut forward onto whitespace, a long token can push it into the next chunk's share
+        while (end < source.len && char_table.classes[source[end]] != CC_Whitespace) {
+            end += 1;
+        }
+
+        if (end >= source.len) {
+            break;
+        }
+
+        append(&chunks, LexChunk{.source = slice_range(source, start, end), .offset = (u32) start});
+        start = end;
+    }
+
+    append(&chunks, LexChunk{.source = slice_range(source, start, source.len), .offset = (u32) start});
+
+    TokenStream result = {.source = source, .interner = interner_create(arena, 64)};
+
+    LexJob job = {.chunks = to_slice(&chunks), .result = &result};
+    ThreadPool pool = {.thread_count = thread_count};
+
+    pool_run(&pool, chunks.len, lex_chunk_task, &job);
+
+    // symbols are numbered by first use, so interning every chunk's symbols in chunk order numbers them
+    // the way a single pass would
+    i64 token_count = 0;
+    i64 number_count = 0;
+    i64 symbol_count = 0;
+
+    for (LexChunk &chunk : chunks) {
+        chunk.token_start = token_count;
+        chunk.number_start = number_count;
+        chunk.symbol_start = symbol_count;
+
+        token_count += chunk.tokens.kinds.len;
+        number_count += chunk.tokens.numbers.len;
+        symbol_count += chunk.tokens.symbols.len;
+
+        Interner *interner = &chunk.tokens.interner;
+
+        DynamicArray<Symbol> symbols = dynamic_array_create<Symbol>(arena, interner->strings.len + 1);
+        for (string name : interner->strings) {
+            append(&symbols, intern(&result.interner, name));
+        }
+
+        chunk.symbols = to_slice(&symbols);
+    }
+
+    DynamicArray<u8> kinds = dynamic_array_create<u8>(arena, token_count + 1);
+    DynamicArray<u32> starts = dynamic_array_create<u32>(arena, token_count + 1);
+    DynamicArray<u32> lengths = dynamic_array_create<u32>(arena, token_count + 1);
+    DynamicArray<u64> numbers = dynamic_array_create<u64>(arena, number_count + 1);
+    DynamicArray<Symbol> symbols = dynamic_array_create<Symbol>(arena, symbol_count + 1);
+
+    // every chunk fills its own range, so the copy runs on the pool as well
+    kinds.len = token_count;
+    starts.len = token_count;
+    lengths.len = token_count;
+    numbers.len = number_count;
+    symbols.len = symbol_count;
+
+    result.kinds = to_slice(&kinds);
+    result.starts = to_slice(&starts);
+    result.lengths = to_slice(&lengths);
+    result.numbers = to_slice(&numbers);
+    result.symbols = to_slice(&symbols);
+
+    pool_run(&pool, chunks.len, lex_stitch_task, &job);
+
+    for (LexChunk &chunk : chunks) {
+        arena_destroy(&chunk.arena);
+    }
+
+    return result;
+}
+
+void lex_chunk_task(void *context, i32, i64 index) {
+    LexJob *job = (LexJob *) context;
+    LexChunk *chunk = &job->chunks[index];
+
+    // the tokens of a chunk are smaller than this, whichever worker picks it up
+    chunk->arena = arena_create((u64) chunk->source.len * 8 + MB(1));
+    chunk->tokens = lex(&chunk->arena, chunk->source);
+}
+
+void lex_stitch_task(void *context, i32, i64 index) {
+    LexJob *job = (LexJob *) context;
+    LexChunk *chunk = &job->chunks[index];
+    TokenStream *tokens = &chunk->tokens;
+    TokenStream *result = job->result;
+
+    i64 count = tokens->kinds.len;
+
+    memcpy(result->kinds.ptr + chunk->token_start, tokens->kinds.ptr, count * sizeof(u8));
+    memcpy(result->lengths.ptr + chunk->token_start, tokens->lengths.ptr, count * sizeof(u32));
+    memcpy(result->numbers.ptr + chunk->number_start, tokens->numbers.ptr, tokens->numbers.len * sizeof(u64));
+
+    for (i64 i = 0; i < count; i++) {
+        result->starts[chunk->token_start + i] = tokens->starts[i] + chunk->offset;
+    }
+
+    for (i64 i = 0; i < tokens->symbols.len; i++) {
+        result->symbols[chunk->symbol_start + i] = chunk->symbols[tokens->symbols[i]];
+    }
+}
+
+bool tokens_equal(TokenStream *a, TokenStream *b) {
+    if (a->kinds.len != b->kinds.len || a->numbers.len != b->numbers.len || a->symbols.len != b->symbols.len) {
+        return false;
+    }
+
+    if (symbol_count(&a->interner) != symbol_count(&b->interner)) {
+        return false;
+    }
+
+    for (i64 i = 0; i < symbol_count(&a->interner); i++) {
+        if (!slice_memcmp(symbol_to_string(&a->interner, (Symbol) i), symbol_to_string(&b->interner, (Symbol) i))) {
+            return false;
+        }
+    }
+
+    return memcmp(a->kinds.ptr, b->kinds.ptr, a->kinds.len * sizeof(u8)) == 0
+        && memcmp(a->starts.ptr, b->starts.ptr, a->starts.len * sizeof(u32)) == 0
+        && memcmp(a->lengths.ptr, b->lengths.ptr, a->lengths.len * sizeof(u32)) == 0
+        && memcmp(a->numbers.ptr, b->numbers.ptr, a->numbers.len * sizeof(u64)) == 0
+        && memcmp(a->symbols.ptr, b->symbols.ptr, a->symbols.len * sizeof(Symbol)) == 0;
+}
+
+LexCursor lex_cursor_create(string source, Interner *interner) {
+    Assertf(source.len <= INT32_MAX, "source is too large for the 32 bit scan index");
+
+    return LexCursor{.source = source, .position = 0, .count = 0, .interner = interner};
+}
+
+// the same scan as lex, one token per call, false once only whitespace is left
+bool lex_next(LexCursor *cursor, Token *token) {
+    string source = cursor->source;
+    i32 i = lex_skip_whitespace(source, cursor->position);
+
+    if (i >= source.len) {
+        cursor->position = i;
+        return false;
+    }
+
+    u8 c = source[i];
+    i32 start = i;
+
+    *token = {.type = TT_Identifier, .number = 0, .symbol = 0, .index = cursor->count, .start = (u32) start};
+
+    switch (char_table.classes[c]) {
+        case CC_Single: {
+            token->type = char_table.singles[c];
+            i++;
+        } break;
+        case CC_Digit: {
+            i = lex_scan_number(source, i + 1);
+
+            token->type = TT_Number;
+            token->number = lex_number_value(source, start, i);
+        } break;
+        case CC_Alpha: {
+            i = lex_scan_identifier(source, i + 1);
+
+            string s = slice_range(source, start, i);
+
+            if (!is_keyword(s, &token->type)) {
+                token->symbol = intern(cursor->interner, s);
+            }
+        } break;
+        default: {
+            token->type = TT_Invalid;
+            i++;
+        }
+    }
+
+    token->source = slice_range(source, start, i);
+
+    cursor->position = i;
+    cursor->count += 1;
+
+    return true;
+}
+
+void lex_benchmark(string source, i32 megabytes, i32 thread_count) {
+    Arena input_arena = arena_create(MB(megabytes) + MB(1));
+    Arena token_arena = arena_create((u64) MB(megabytes) * 8 + MB(1));
+
+    // repeat the program until it is big enough that the timer is not the thing being measured
+    i64 copies = MB(megabytes) / (source.len + 1) + 1;
+    DynamicArray<u8> input = dynamic_array_create<u8>(&input_arena, copies * (source.len + 1));
+
+    for (i64 i = 0; i < copies; i++) {
+        for (u8 c : source) {
+            append(&input, c);
+        }
+
+        append(&input, (u8) '\n');
+    }
+
+    string big_source = to_slice(&input);
+
+    i32 runs = 5;
+    u64 best = UINT64_MAX;
+    i64 token_count = 0;
+    i64 token_bytes = 0;
+
+    TokenStream tokens = {};
+
+    for (i32 run = 0; run < runs; run++) {
+        arena_reset(&token_arena);
+
+        u64 start = time_now_nanoseconds();
+        tokens = lex(&token_arena, big_source);
+        u64 elapsed = time_now_nanoseconds() - start;
+
+        token_count = tokens.kinds.len;
+        token_bytes = tokens.kinds.len * (sizeof(u8) + sizeof(u32) + sizeof(u32)) + tokens.numbers.len * sizeof(u64) + tokens.symbols.len * sizeof(Symbol);
+
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    f64 seconds = (f64) best / 1e9;
+    f64 mb = (f64) big_source.len / (f64) MB(1);
+
+    printf("lexer benchmark, %.2f MB, %lld tokens, best of %d\n", mb, (long long) token_count, runs);
+    printf("  %8.2f ms  %8.2f MB/s  %8.2f Mtokens/s\n", seconds * 1e3, mb / seconds, (f64) token_count / seconds / 1e6);
+    printf("  %8.2f MB of tokens, %.2f bytes per token\n", (f64) token_bytes / (f64) MB(1), (f64) token_bytes / (f64) (token_count ? token_count : 1));
+
+    // the same input through the parallel lexer, every run is checked against the serial tokens
+    if (thread_count > 1) {
+        Arena parallel_arena = arena_create((u64) MB(megabytes) * 8 + MB(1));
+
+        u64 parallel_best = UINT64_MAX;
+        bool same = true;
+
+        for (i32 run = 0; run < runs; run++) {
+            arena_reset(&parallel_arena);
+
+            u64 start = time_now_nanoseconds();
+            TokenStream parallel = lex_parallel(&parallel_arena, big_source, thread_count);
+            u64 elapsed = time_now_nanoseconds() - start;
+
+            same = same && tokens_equal(&tokens, &parallel);
+
+            if (elapsed < parallel_best) {
+                parallel_best = elapsed;
+            }
+        }
+
+        f64 parallel_seconds = (f64) parallel_best / 1e9;
+
+        printf("  parallel on %d threads, %.2fx\n", thread_count, seconds / parallel_seconds);
+        printf("  %8.2f ms  %8.2f MB/s  %8.2f Mtokens/s\n", parallel_seconds * 1e3, mb / parallel_seconds, (f64) token_count / parallel_seconds / 1e6);
+
+        Assertf(same, "lex_parallel and lex disagree");
+
+        arena_destroy(&parallel_arena);
+    }
+
+    arena_destroy(&token_arena);
+    arena_destroy(&input_arena);
+}
+
+void tokens_write(Writer *writer, TokenStream *tokens) {
+    for (i32 i = 0; i < tokens->kinds.len; i++) {
+        string source = slice_range(tokens->source, tokens->starts[i], tokens->starts[i] + tokens->lengths[i]);
+        fmt(&writer->buffer, "{}: '{}'\n", token_type_to_string((TokenType) tokens->kinds[i]), source);
+
+        writer_poll(writer);
+    }
+}
+
+string token_type_to_string(TokenType type) {
+    switch (type) {
+        case TT_Identifier: return "Identifier";
+        case TT_Number:     return "Number";
+        case TT_Let:        return "Let";
+        case TT_Return:     return "Return";
+        case TT_Fn:         return "Fn";
+        case TT_If:         return "If";
+        case TT_Print:      return "Print";
+        case TT_Colon:      return "Colon";
+        case TT_Equals:     return "Equals";
+        case TT_DoubleEquals:return "DoubleEquals";
+        case TT_Semicolon:  return "Semicolon";
+        case TT_Plus:       return "Plus";
+        case TT_Minus:      return "Minus";
+        case TT_Asterisk:   return "Asterisk";
+        case TT_Paren_Open: return "Paren_Open";
+        case TT_Paren_Close:return "Paren_Close";
+        case TT_Brace_Open: return "Brace_Open";
+        case TT_Brace_Close:return "Brace_Close";
+        case TT_Invalid:    return "Invalid";
+        default:            Unreachable("unsupported token type in token_type_to_string");
+    }
+
+    return "";
+}
+
+// @parser
+
+// index of a node in AST.nodes
+typedef u32 NodeIndex;
+
+// a run of u32s in AST.extra, node indices for bodies and symbols for locals
+struct ASTRange {
+    u32 start;
+    u32 count;
+};
+
+// names are symbols, literals keep where they are in the source so dumps print them as written.
+// nothing refers back to the token arrays, so a streaming parse never needs them
+
+struct NumberLiteralASTNode {
+    u64 value;
+    u32 start;
+    u32 length;
+};
+
+struct BinaryASTNode {
+    NodeIndex left;
+    NodeIndex right;
+    TokenType op;
+};
+
+struct FunctionASTNode {
+    Symbol name;
+    array<Symbol, 4> parameters;
+    ASTRange locals;
+    ASTRange body;
+
+    // nodes the body was parsed into, sizes the ir before it is generated
+    u32 node_count;
+};
+
+struct LetASTNode {
+    Symbol name;
+    NodeIndex expression;
+};
+
+struct IfASTNode {
+    NodeIndex condition;
+    ASTRange body;
+};
+
+enum ASTNodeType : u8 {
+    // expressions
+    NT_NumberLiteral,
+    NT_Identifier,
+    NT_Binary,
+
+    // statements
+    NT_Function,
+    NT_Let,
+    NT_Return,
+    NT_If,
+    NT_Print,
+};
+
+// what data holds depends on the type
+//   NT_NumberLiteral   index into number_literals
+//   NT_Identifier      symbol of the name
+//   NT_Binary          index into binaries
+//   NT_Function        index into functions
+//   NT_Let             index into lets
+//   NT_Return          node index of the value
+//   NT_If              index into ifs
+//   NT_Print           node index of the value
+struct ASTNode {
+    ASTNodeType type;
+    u32 data;
+};
+
+struct AST {
+    string source;
+    Interner *interner;
+
+    // tokens the parser consumed, counted as it goes since a streaming parse keeps none of them
+    i64 token_count;
+
+    // the top level function nodes in source order
+    ASTRange module;
+
+    slice<ASTNode> nodes;
+    slice<NumberLiteralASTNode> number_literals;
+    slice<BinaryASTNode> binaries;
+    slice<FunctionASTNode> functions;
+    slice<LetASTNode> lets;
+    slice<IfASTNode> ifs;
+    slice<u32> extra;
+};
+
+// the tokens of one top level function, found by matching braces without parsing
+struct FunctionSpan {
+    u32 token_start;
+    u32 token_end;
+
+    // index of the span's first entry in tokens->numbers and tokens->symbols
+    u32 number_start;
+    u32 symbol_start;
+
+    string name;
+};
+
+const u32 PARSER_LOOKAHEAD = 4;
+
+struct Parser {
+    Arena *arena;
+    LexMode mode;
+
+    string source;
+    Interner *interner;
+
+    // LM_Batch, position is the index of the next token
+    i64 position;
+    TokenStream *tokens;
+
+    // index into tokens->numbers of the next TT_Number token, and tokens->symbols of the next TT_Identifier
+    i64 number_position;
+    i64 symbol_position;
+
+    // LM_Stream, tokens pulled from the cursor but not consumed yet wait in a ring
+    LexCursor cursor;
+    array<Token, PARSER_LOOKAHEAD> lookahead;
+    u32 lookahead_start;
+    u32 lookahead_count;
+
+    DynamicArray<ASTNode> nodes;
+    DynamicArray<NumberLiteralASTNode> number_literals;
+    DynamicArray<BinaryASTNode> binaries;
+    DynamicArray<FunctionASTNode> functions;
+    DynamicArray<LetASTNode> lets;
+    DynamicArray<IfASTNode> ifs;
+    DynamicArray<u32> extra;
+
+    // child lists are collected here while nested lists are still being parsed, then copied into extra
+    DynamicArray<u32> scratch;
+    DynamicArray<u32> locals;
+
+    // the first syntax error and the source offset it was found at, NULL while the source parses. once
+    // it is set nothing more is consumed and the parse functions unwind with whatever they have
+    const char *error;
+    i64 error_offset;
+};
+
+// the parse functions print the first syntax error and return false, the ast is not usable then
+bool parse(Arena *arena, TokenStream *tokens, AST *ast);
+bool parse_stream(Arena *arena, string source, AST *ast);
+bool parse_spans(Arena *arena, TokenStream *tokens, slice<FunctionSpan> spans, AST *ast);
+bool module_split(Arena *arena, TokenStream *tokens, slice<FunctionSpan> *spans);
+Parser parser_create(Arena *arena, LexMode mode, string source, i64 capacity);
+bool parse_module(Parser *parser, AST *ast);
+AST parser_finish(Parser *parser);
+
+NodeIndex parse_node(Parser *parser);
+NodeIndex parse_function(Parser *parser);
+NodeIndex parse_let(Parser *parser);
+NodeIndex parse_return(Parser *parser);
+NodeIndex parse_if(Parser *parser);
+NodeIndex parse_print(Parser *parser);
+ASTRange parse_body(Parser *parser);
+
+NodeIndex parse_expression(Parser *parser);
+NodeIndex parse_binary_2(Parser *parser);
+NodeIndex parse_binary_1(Parser *parser);
+NodeIndex parse_literal(Parser *parser);
+NodeIndex parser_add_node(Parser *parser, ASTNodeType type, u32 data);
+ASTRange parser_add_range(Parser *parser, slice<u32> values);
+Token parser_next(Parser *parser);
+Token parser_expect(Parser *parser, TokenType type, const char *message);
+bool parser_is_next(Parser *parser, TokenType type);
+bool parser_at_end(Parser *parser);
+Token *parser_peek(Parser *parser, u32 ahead);
+void parser_fail(Parser *parser, const char *message);
+i64 parser_offset(Parser *parser);
+void parser_report(string source, i64 offset, const char *message);
+
+string ast_symbol(AST *ast, Symbol symbol);
+string binary_op_to_string(TokenType op);
+slice<u32> ast_range(AST *ast, ASTRange range);
+FunctionASTNode *ast_function(AST *ast, NodeIndex index);
+
+void ast_write(Writer *writer, AST *ast);
+string node_to_string(DynamicArray<u8> *bytes, AST *ast, NodeIndex index, i32 indent_level);
+
+bool parse(Arena *arena, TokenStream *tokens, AST *ast) {
+    // roughly one node per token is an upper bound, the payload arrays are much smaller
+    Parser parser = parser_create(arena, LM_Batch, tokens->source, tokens->kinds.len + 16);
+
+    parser.tokens = tokens;
+    parser.interner = &tokens->interner;
+
+    return parse_module(&parser, ast);
+}
+
+// lexes as it parses, the tokens go through the lookahead ring and are gone once consumed
+bool parse_stream(Arena *arena, string source, AST *ast) {
+    // the token count is not known up front, real code has well over two bytes per token
+    Parser parser = parser_create(arena, LM_Stream, source, source.len / 4 + 16);
+
+    parser.interner = arena_alloc<Interner>(arena);
+    *parser.interner = interner_create(arena, 64);
+    parser.cursor = lex_cursor_create(source, parser.interner);
+
+    return parse_module(&parser, ast);
+}
+
+// parses only the given functions, the module holds them in the order they are passed
+bool parse_spans(Arena *arena, TokenStream *tokens, slice<FunctionSpan> spans, AST *ast) {
+    i64 capacity = 16;
+    for (FunctionSpan &span : spans) {
+        capacity += span.token_end - span.token_start;
+    }
+
+    Parser parser = parser_create(arena, LM_Batch, tokens->source, capacity);
+
+    parser.tokens = tokens;
+    parser.interner = &tokens->interner;
+
+    for (FunctionSpan &span : spans) {
+        parser.position = span.token_start;
+        parser.number_position = span.number_start;
+        parser.symbol_position = span.symbol_start;
+
+        append(&parser.scratch, parse_function(&parser));
+
+        if (parser.error) {
+            parser_report(parser.source, parser.error_offset, parser.error);
+            return false;
+        }
+
+        Assertf(parser.position == span.token_end, "parse_function did not end where module_split did");
+    }
+
+    *ast = parser_finish(&parser);
+    ast->token_count = tokens->kinds.len;
+
+    return true;
+}
+
+bool module_split(Arena *arena, TokenStream *tokens, slice<FunctionSpan> *spans) {
+    DynamicArray<FunctionSpan> found = dynamic_array_create<FunctionSpan>(arena, 16);
+
+    i64 numbers = 0;
+    i64 symbols = 0;
+    i64 i = 0;
+
+    while (i < tokens->kinds.len) {
+        if (tokens->kinds[i] != TT_Fn) {
+            parser_report(tokens->source, tokens->starts[i], "only functions are allowed at the top level");
+            return false;
+        }
+
+        if (i + 1 >= tokens->kinds.len || tokens->kinds[i + 1] != TT_Identifier) {
+            parser_report(tokens->source, tokens->starts[i], "expected a function name");
+            return false;
+        }
+
+        u32 name_start = tokens->starts[i + 1];
+
+        FunctionSpan span = {
+            .token_start = (u32) i,
+            .number_start = (u32) numbers,
+            .symbol_start = (u32) symbols,
+            .name = slice_range(tokens->source, name_start, name_start + tokens->lengths[i + 1]),
+        };
+
+        // the function ends where its first brace is closed
+        i32 depth = 0;
+        bool opened = false;
+
+        for (; i < tokens->kinds.len && !(opened && depth == 0); i++) {
+            switch (tokens->kinds[i]) {
+                case TT_Number:      numbers += 1; break;
+                case TT_Identifier:  symbols += 1; break;
+                case TT_Brace_Open:  depth += 1; opened = true; break;
+                case TT_Brace_Close: depth -= 1; break;
+                default:             break;
+            }
+        }
+
+        if (!opened || depth != 0) {
+            parser_report(tokens->source, tokens->starts[span.token_start], "unterminated function body");
+            return false;
+        }
+
+        span.token_end = (u32) i;
+        append(&found, span);
+    }
+
+    if (found.len == 0) {
+        parser_report(tokens->source, tokens->source.len, "a module needs at least one function");
+        return false;
+    }
+
+    *spans = to_slice(&found);
+
+    return true;
+}
+
+Parser parser_create(Arena *arena, LexMode mode, string source, i64 capacity) {
+    Parser parser = {
+        .arena = arena,
+        .mode = mode,
+        .source = source,
+        .interner = NULL,
+        .position = 0,
+        .tokens = NULL,
+        .number_position = 0,
+        .symbol_position = 0,
+        .cursor = {},
+        .lookahead = {},
+        .lookahead_start = 0,
+        .lookahead_count = 0,
+        .nodes = dynamic_array_create<ASTNode>(arena, capacity),
+        .number_literals = dynamic_array_create<NumberLiteralASTNode>(arena, capacity / 8 + 16),
+        .binaries = dynamic_array_create<BinaryASTNode>(arena, capacity / 4 + 16),
+        .functions = dynamic_array_create<FunctionASTNode>(arena, 16),
+        .lets = dynamic_array_create<LetASTNode>(arena, 16),
+        .ifs = dynamic_array_create<IfASTNode>(arena, 16),
+        .extra = dynamic_array_create<u32>(arena, capacity / 8 + 16),
+        .scratch = dynamic_array_create<u32>(arena, 64),
+        .locals = dynamic_array_create<u32>(arena, 16),
+        .error = NULL,
+        .error_offset = 0,
+    };
+
+    return parser;
+}
+
+bool parse_module(Parser *parser, AST *ast) {
+    // a module is any number of functions back to back
+    while (!parser->error && !parser_at_end(parser)) {
+        if (!parser_is_next(parser, TT_Fn)) {
+            parser_fail(parser, "only functions are allowed at the top level");
+            break;
+        }
+
+        append(&parser->scratch, parse_function(parser));
+    }
+
+    if (!parser->error && parser->scratch.len == 0) {
+        parser_fail(parser, "a module needs at least one function");
+    }
+
+    if (parser->error) {
+        parser_report(parser->source, parser->error_offset, parser->error);
+        return false;
+    }
+
+    *ast = parser_finish(parser);
+
+    return true;
+}
+
+// the function nodes collected in scratch become the module
+AST parser_finish(Parser *parser) {
+    ASTRange module = parser_add_range(parser, to_slice(&parser->scratch));
+    reset(&parser->scratch);
+
+    AST ast = {
+        .source = parser->source,
+        .interner = parser->interner,
+        .token_count = parser->mode == LM_Stream ? (i64) parser->cursor.count : parser->position,
+        .module = module,
+        .nodes = to_slice(&parser->nodes),
+        .number_literals = to_slice(&parser->number_literals),
+        .binaries = to_slice(&parser->binaries),
+        .functions = to_slice(&parser->functions),
+        .lets = to_slice(&parser->lets),
+        .ifs = to_slice(&parser->ifs),
+        .extra = to_slice(&parser->extra),
+    };
+
+    return ast;
+}
+
+NodeIndex parse_node(Parser *parser) {
+    // functions only live at the top level, nothing after the parser handles one inside a body
+    if (parser_is_next(parser, TT_Fn)) {
+        parser_fail(parser, "functions cannot be nested");
+        return 0;
+    }
+
+    if (parser_is_next(parser, TT_Let)) {
+        return parse_let(parser);
+    }
+
+    if (parser_is_next(parser, TT_Return)) {
+        return parse_return(parser);
+    }
+
+    if (parser_is_next(parser, TT_If)) {
+        return parse_if(parser);
+    }
+
+    if (parser_is_next(parser, TT_Print)) {
+        return parse_print(parser);
+    }
+
+    parser_fail(parser, "expected a statement");
+    return 0;
+}
+
+NodeIndex parse_function(Parser *parser) {
+    Token fn = parser_next(parser);
+    Assert(fn.type == TT_Fn);
+
+    Token name = parser_expect(parser, TT_Identifier, "expected a function name");
+    parser_expect(parser, TT_Paren_Open, "expected '(' after the function name");
+
+    Token param0 = parser_expect(parser, TT_Identifier, "a function takes four parameters");
+    Token param1 = parser_expect(parser, TT_Identifier, "a function takes four parameters");
+    Token param2 = parser_expect(parser, TT_Identifier, "a function takes four parameters");
+    Token param3 = parser_expect(parser, TT_Identifier, "a function takes four parameters");
+
+    parser_expect(parser, TT_Paren_Close, "expected ')' after the parameters");
+
+    i64 node_start = parser->nodes.len;
+    ASTRange body = parse_body(parser);
+
+    // locals of this function were collected by parse_let, move them out and reset for the next one
+    ASTRange locals = parser_add_range(parser, to_slice(&parser->locals));
+    reset(&parser->locals);
+
+    FunctionASTNode function = {
+        .name = name.symbol,
+        .parameters = {param0.symbol, param1.symbol, param2.symbol, param3.symbol},
+        .locals = locals,
+        .body = body,
+        .node_count = (u32) (parser->nodes.len - node_start),
+    };
+
+    append(&parser->functions, function);
+
+    return parser_add_node(parser, NT_Function, (u32) (parser->functions.len - 1));
+}
+
+NodeIndex parse_let(Parser *parser) {
+    Token let = parser_next(parser);
+    Assert(let.type == TT_Let);
+
+    Token name = parser_expect(parser, TT_Identifier, "expected a name after let");
+    parser_expect(parser, TT_Equals, "expected '=' after the name of a let");
+
+    NodeIndex expression = parse_expression(parser);
+    parser_expect(parser, TT_Semicolon, "expected ';' after a let");
+
+    append(&parser->lets, LetASTNode{.name = name.symbol, .expression = expression});
+    append(&parser->locals, name.symbol);
+
+    return parser_add_node(parser, NT_Let, (u32) (parser->lets.len - 1));
+}
+
+NodeIndex parse_return(Parser *parser) {
+    Token token = parser_next(parser);
+    Assert(token.type == TT_Return);
+
+    NodeIndex node = parse_expression(parser);
+    parser_expect(parser, TT_Semicolon, "expected ';' after a return");
+
+    return parser_add_node(parser, NT_Return, node);
+}
+
+NodeIndex parse_if(Parser *parser) {
+    Token token = parser_next(parser);
+    Assert(token.type == TT_If);
+
+    NodeIndex condition = parse_expression(parser);
+    ASTRange body = parse_body(parser);
+
+    append(&parser->ifs, IfASTNode{.condition = condition, .body = body});
+
+    return parser_add_node(parser, NT_If, (u32) (parser->ifs.len - 1));
+}
+
+NodeIndex parse_print(Parser *parser) {
+    Token token = parser_next(parser);
+    Assert(token.type == TT_Print);
+
+    NodeIndex expression = parse_expression(parser);
+    parser_expect(parser, TT_Semicolon, "expected ';' after a print");
+
+    return parser_add_node(parser, NT_Print, expression);
+}
+
+ASTRange parse_body(Parser *parser) {
+    parser_expect(parser, TT_Brace_Open, "expected '{'");
+
+    i64 scratch_start = parser->scratch.len;
+
+    while (!parser->error && !parser_is_next(parser, TT_Brace_Close)) {
+        if (parser_at_end(parser)) {
+            parser_fail(parser, "expected '}' before the end of the source");
+            break;
+        }
+
+        NodeIndex statement = parse_node(parser);
+        append(&parser->scratch, statement);
+    }
+
+    parser_expect(parser, TT_Brace_Close, "expected '}'");
+
+    // nested bodies have already been copied out and popped, so only this body's statements are left
+    ASTRange body = parser_add_range(parser, slice_range(to_slice(&parser->scratch), scratch_start, parser->scratch.len));
+    parser->scratch.len = scratch_start;
+
+    return body;
+}
+
+NodeIndex parse_expression(Parser *parser) {
+    return parse_binary_2(parser);
+}
+
+NodeIndex parse_binary_2(Parser *parser) {
+    NodeIndex expression = parse_binary_1(parser);
+
+    while (!parser->error && parser_is_next(parser, TT_DoubleEquals)) {
+        Token op = parser_next(parser);
+        NodeIndex right = parse_binary_1(parser);
+
+        append(&parser->binaries, BinaryASTNode{.left = expression, .right = right, .op = op.type});
+        expression = parser_add_node(parser, NT_Binary, (u32) (parser->binaries.len - 1));
+    }
+
+    return expression;
+}
+
+NodeIndex parse_binary_1(Parser *parser) {
+    NodeIndex expression = parse_literal(parser);
+
+    while (!parser->error && (parser_is_next(parser, TT_Plus) || parser_is_next(parser, TT_Minus))) {
+        Token op = parser_next(parser);
+        NodeIndex right = parse_literal(parser);
+
+        append(&parser->binaries, BinaryASTNode{.left = expression, .right = right, .op = op.type});
+        expression = parser_add_node(parser, NT_Binary, (u32) (parser->binaries.len - 1));
+    }
+
+    return expression;
+}
+
+NodeIndex parse_literal(Parser *parser) {
+    if (parser_is_next(parser, TT_Number)) {
+        Token token = parser_next(parser);
+
+        // every value is lowered as a 32 bit immediate
+        if (token.number > INT32_MAX && !parser->error) {
+            parser->error = "number literal does not fit in 32 bits";
+            parser->error_offset = token.start;
+        }
+
+        append(&parser->number_literals, NumberLiteralASTNode{.value = token.number, .start = token.start, .length = (u32) token.source.len});
+        return parser_add_node(parser, NT_NumberLiteral, (u32) (parser->number_literals.len - 1));
+    }
+
+    if (parser_is_next(parser, TT_Identifier)) {
+        Token token = parser_next(parser);
+
+        return parser_add_node(parser, NT_Identifier, token.symbol);
+    }
+
+    parser_fail(parser, "expected a number or a name");
+    return 0;
+}
+
+NodeIndex parser_add_node(Parser *parser, ASTNodeType type, u32 data) {
+    append(&parser->nodes, ASTNode{.type = type, .data = data});
+    return (NodeIndex) (parser->nodes.len - 1);
+}
+
+ASTRange parser_add_range(Parser *parser, slice<u32> values) {
+    ASTRange range = {.start = (u32) parser->extra.len, .count = (u32) values.len};
+
+    for (u32 value : values) {
+        append(&parser->extra, value);
+    }
+
+    return range;
+}
+
+// past the end of the source this is a TT_Invalid token that starts at the end and nothing is consumed
+Token parser_next(Parser *parser) {
+    if (parser->mode == LM_Stream) {
+        Token *next = parser_peek(parser, 0);
+        if (!next) {
+            return Token{.type = TT_Invalid, .start = (u32) parser->source.len};
+        }
+
+        Token token = *next;
+
+        parser->lookahead_start = (parser->lookahead_start + 1) % PARSER_LOOKAHEAD;
+        parser->lookahead_count -= 1;
+
+        return token;
+    }
+
+    TokenStream *tokens = parser->tokens;
+    i64 i = parser->position;
+
+    if (i >= tokens->kinds.len) {
+        return Token{.type = TT_Invalid, .start = (u32) tokens->source.len};
+    }
+
+    u32 start = tokens->starts[i];
+
+    Token token = {
+        .type = (TokenType) tokens->kinds[i],
+        .source = slice_range(tokens->source, start, start + tokens->lengths[i]),
+        .number = 0,
+        .symbol = 0,
+        .index = (u32) i,
+        .start = start,
+    };
+
+    // tokens are consumed in order so the numbers and symbols are too
+    if (token.type == TT_Number) {
+        token.number = tokens->numbers[parser->number_position];
+        parser->number_position += 1;
+    }
+
+    if (token.type == TT_Identifier) {
+        token.symbol = tokens->symbols[parser->symbol_position];
+        parser->symbol_position += 1;
+    }
+
+    parser->position += 1;
+
+    return token;
+}
+
+// the next token, the parse fails with message where it starts unless it has the given type
+Token parser_expect(Parser *parser, TokenType type, const char *message) {
+    Token token = parser_next(parser);
+
+    if (token.type != type && !parser->error) {
+        parser->error = message;
+        parser->error_offset = token.start;
+    }
+
+    return token;
+}
+
+bool parser_is_next(Parser *parser, TokenType type) {
+    if (parser->mode == LM_Stream) {
+        Token *token = parser_peek(parser, 0);
+        return token && token->type == type;
+    }
+
+    if (parser->position >= parser->tokens->kinds.len) {
+        return false;
+    }
+
+    return parser->tokens->kinds[parser->position] == type;
+}
+
+bool parser_at_end(Parser *parser) {
+    if (parser->mode == LM_Stream) {
+        return parser_peek(parser, 0) == NULL;
+    }
+
+    return parser->position >= parser->tokens->kinds.len;
+}
+
+// an unconsumed token of a streaming parse, lexed into the ring on first look, NULL past the end.
+// the grammar only ever looks one token ahead
+Token *parser_peek(Parser *parser, u32 ahead) {
+    Assertf(ahead < PARSER_LOOKAHEAD, "parser_peek looked further ahead than the ring holds");
+
+    while (parser->lookahead_count <= ahead) {
+        u32 slot = (parser->lookahead_start + parser->lookahead_count) % PARSER_LOOKAHEAD;
+
+        if (!lex_next(&parser->cursor, &parser->lookahead[slot])) {
+            return NULL;
+        }
+
+        parser->lookahead_count += 1;
+    }
+
+    return &parser->lookahead[(parser->lookahead_start + ahead) % PARSER_LOOKAHEAD];
+}
+
+// only the first error is kept, everything after it is usually a consequence
+void parser_fail(Parser *parser, const char *message) {
+    if (parser->error) {
+        return;
+    }
+
+    parser->error = message;
+    parser->error_offset = parser_offset(parser);
+}
+
+// source offset of the next token, the end of the source when there is none
+i64 parser_offset(Parser *parser) {
+    if (parser->mode == LM_Stream) {
+        Token *token = parser_peek(parser, 0);
+        return token ? (i64) token->start : parser->source.len;
+    }
+
+    if (parser->position >= parser->tokens->kinds.len) {
+        return parser->source.len;
+    }
+
+    return parser->tokens->starts[parser->position];
+}
+
+void parser_report(string source, i64 offset, const char *message) {
+    i64 line = 1;
+    i64 line_start = 0;
+
+    for (i64 i = 0; i < offset && i < source.len; i++) {
+        if (source[i] == '\n') {
+            line += 1;
+            line_start = i + 1;
+        }
+    }
+
+    i64 line_end = line_start;
+    while (line_end < source.len && source[line_end] != '\n' && source[line_end] != '\r') {
+        line_end += 1;
+    }
+
+    printf("Line %lld: '%.*s'\n", (long long) line, (int) (line_end - line_start), (const char *) source.ptr + line_start);
+    Err(message);
+}
+
+string ast_symbol(AST *ast, Symbol symbol) {
+    return symbol_to_string(ast->interner, symbol);
+}
+
+string binary_op_to_string(TokenType op) {
+    switch (op) {
+        case TT_Plus:         return "+";
+        case TT_Minus:        return "-";
+        case TT_DoubleEquals: return "eql";
+        default:              Unreachable("unsupported operator in binary_op_to_string");
+    }
+
+    return "";
+}
+
+slice<u32> ast_range(AST *ast, ASTRange range) {
+    return slice_range(ast->extra, range.start, range.start + range.count);
+}
+
+FunctionASTNode *ast_function(AST *ast, NodeIndex index) {
+    ASTNode node = ast->nodes[index];
+    Assertf(node.type == NT_Function, "expected a function node in ast_function");
+
+    return &ast->functions[node.data];
+}
+
+void ast_write(Writer *writer, AST *ast) {
+    for (NodeIndex function : ast_range(ast, ast->module)) {
+        node_to_string(&writer->buffer, ast, function, 0);
+        writer_poll(writer);
+    }
+}
+
+string node_to_string(DynamicArray<u8> *bytes, AST *ast, NodeIndex index, i32 indent_level) {
+    static const auto indent = [](DynamicArray<u8> *bytes, i32 level) {
+        for (i32 i = 0; i < level; i++) {
+            if (i == level - 1) {
+                fmt(bytes, "+ ");
+            } else {
+                fmt(bytes, "| ");
+            }
+        }
+    };
+
+    ASTNode node = ast->nodes[index];
+
+    switch (node.type) {
+        case NT_NumberLiteral: {
+            NumberLiteralASTNode literal = ast->number_literals[node.data];
+
+            indent(bytes, indent_level);
+            fmt(bytes, "Number Literal: {}\n", slice_range(ast->source, literal.start, literal.start + literal.length));
+        } break;
+        case NT_Identifier: {
+            indent(bytes, indent_level);
+            fmt(bytes, "Identifier: {}\n", ast_symbol(ast, node.data));
+        } break;
+        case NT_Binary: {
+            BinaryASTNode binary = ast->binaries[node.data];
+
+            indent(bytes, indent_level);
+            fmt(bytes, "Binary:\n");
+
+            node_to_string(bytes, ast, binary.left, indent_level + 1);
+
+            indent(bytes, indent_level + 1);
+            fmt(bytes, "Op: {}\n", binary_op_to_string(binary.op));
+
+            node_to_string(bytes, ast, binary.right, indent_level + 1);
+        } break;
+        case NT_Function: {
+            FunctionASTNode function = ast->functions[node.data];
+
+            indent(bytes, indent_level);
+            fmt(bytes, "Fn {}:\n", ast_symbol(ast, function.name));
+
+            indent(bytes, indent_level + 1);
+
+            fmt(bytes, "Parameters:");
+            for (i32 i = 0; i < (i32) function.parameters.size(); i++) {
+                fmt(bytes, " {}", ast_symbol(ast, function.parameters[i]));
+            }
+
+            fmt(bytes, "\n");
+
+            indent(bytes, indent_level + 1);
+
+            fmt(bytes, "Locals:");
+            for (Symbol local : ast_range(ast, function.locals)) {
+                fmt(bytes, " {}", ast_symbol(ast, local));
+            }
+
+            fmt(bytes, "\n");
+
+            for (NodeIndex statement : ast_range(ast, function.body)) {
+                node_to_string(bytes, ast, statement, indent_level + 1);
+            }
+        } break;
+        case NT_Let: {
+            LetASTNode let = ast->lets[node.data];
+
+            indent(bytes, indent_level);
+            fmt(bytes, "Let: {}\n", ast_symbol(ast, let.name));
+
+            node_to_string(bytes, ast, let.expression, indent_level + 1);
+        } break;
+        case NT_Return: {
+            indent(bytes, indent_level);
+            fmt(bytes, "Return:\n");
+
+            node_to_string(bytes, ast, node.data, indent_level + 1);
+        } break;
+        case NT_If: {
+            IfASTNode iff = ast->ifs[node.data];
+
+            indent(bytes, indent_level);
+            fmt(bytes, "If:\n");
+
+            indent(bytes, indent_level + 1);
+            fmt(bytes, "Condition:\n");
+            node_to_string(bytes, ast, iff.condition, indent_level + 2);
+
+            indent(bytes, indent_level + 1);
+            fmt(bytes, "Body:\n");
+            for (NodeIndex statement : ast_range(ast, iff.body)) {
+                node_to_string(bytes, ast, statement, indent_level + 2);
+            }
+        } break;
+        case NT_Print: {
+            indent(bytes, indent_level);
+            fmt(bytes, "Print:\n");
+
+            node_to_string(bytes, ast, node.data, indent_level + 1);
+        } break;
+        default:
+            Unreachable("unsupported expression type in node_to_string");
+    }
+
+    return to_slice(bytes);
+}
+
+// @ir
+enum InstructionType {
+    IT_StartFunction,
+    IT_EndFunction,
+    IT_Push,
+    IT_Add,
+    IT_Local,
+    IT_Store,
+    IT_Return,
+    IT_IfZero,
+    IT_IfNotZero,
+    IT_Jump,
+    IT_Label,
+    IT_CompareEqual,
+    IT_Print,
+};
+
+// labels, jumps and branches carry a block id in value
+struct Instruction {
+    InstructionType type;
+    i32 value;
+    string string;
+};
+
+struct IR {
+    AST *ast;
+    DynamicArray<Instruction> instructions;
+
+    // frame slots, the parameters are 0 to 3 and every let of a new name takes the next one
+    i32 local_count;
+
+    // scoped symbol table used while generating, the slot of every symbol in scope or -1, and the
+    // lets that were bound in order so an if body can drop its own on the way out
+    slice<i32> slots;
+    DynamicArray<Symbol> scope;
+
+    // block ids handed out so far, the entry block is 0 and has no label
+    i32 block_count;
+
+    // NULL unless ir_gen rejected the function, generation runs to the end anyway so slots is left clean
+    const char *error;
+};
+
+struct IRBlock {
+    // the label id of the block, -1 when it does not start with a label
+    i32 label;
+
+    // instructions [start, end), the last one is the return, jump or branch that ends the block if any
+    i32 start;
+    i32 end;
+
+    // indices into the blocks of the cfg, a branch falls through to successors[0] and jumps to successors[1]
+    DynamicArray<i32> successors;
+    DynamicArray<i32> predecessors;
+};
+
+struct CFG {
+    // in instruction order and the entry first, the EndFunction that closes the ir is in none of them
+    DynamicArray<IRBlock> blocks;
+};
+
+bool ir_gen(Arena *arena, AST *ast, NodeIndex function, slice<i32> slots, IR *ir);
+
+void ir_gen_node(IR *ir, NodeIndex index);
+
+void ir_gen_number_literal(IR *ir, ASTNode node);
+void ir_gen_identifier(IR *ir, ASTNode node);
+void ir_gen_binary(IR *ir, ASTNode node);
+
+void ir_gen_function(IR *ir, ASTNode node);
+void ir_gen_let(IR *ir, ASTNode node);
+void ir_gen_return(IR *ir, ASTNode node);
+void ir_gen_if(IR *ir, ASTNode node);
+void ir_gen_print(IR *ir, ASTNode node);
+
+slice<i32> ir_symbol_table_create(Arena *arena, i64 symbol_count);
+
+CFG ir_build_cfg(Arena *arena, IR *ir);
+void ir_add_edge(CFG *cfg, i32 from, i32 to);
+bool ir_is_terminator(InstructionType type);
+bool ir_is_branch(InstructionType type);
+bool ir_falls_off_end(slice<Instruction> instructions, i64 end);
+
+string ir_to_string(Arena *arena, slice<Instruction> instructions);
+string cfg_to_string(Arena *arena, CFG *cfg);
+
+// slots is a symbol table from ir_symbol_table_create, it is left all -1 again so the next function
+// generated on the same thread can reuse it. false with ir->error set when the function is rejected
+bool ir_gen(Arena *arena, AST *ast, NodeIndex function, slice<i32> slots, IR *ir) {
+    FunctionASTNode *node = ast_function(ast, function);
+
+    *ir = {
+        .ast = ast,
+        .instructions = dynamic_array_create<Instruction>(arena, node->node_count * 2 + 16),
+        .local_count = (i32) node->parameters.size(),
+        .slots = slots,
+        .scope = dynamic_array_create<Symbol>(arena, 16),
+        .block_count = 1,
+        .error = NULL,
+    };
+
+    // a repeated parameter name refers to the first one
+    for (i32 i = (i32) node->parameters.size() - 1; i >= 0; i--) {
+        ir->slots[node->parameters[i]] = i;
+    }
+
+    ir_gen_node(ir, function);
+
+    for (Symbol parameter : node->parameters) {
+        ir->slots[parameter] = -1;
+    }
+
+    for (Symbol local : ir->scope) {
+        ir->slots[local] = -1;
+    }
+
+    return ir->error == NULL;
+}
+
+void ir_gen_node(IR *ir, NodeIndex index) {
+    ASTNode node = ir->ast->nodes[index];
+
+    switch (node.type) {
+        case NT_NumberLiteral: {
+            ir_gen_number_literal(ir, node);
+        } break;
+        case NT_Identifier: {
+            ir_gen_identifier(ir, node);
+        } break;
+        case NT_Binary: {
+            ir_gen_binary(ir, node);
+        } break;
+        case NT_Function: {
+            ir_gen_function(ir, node);
+        } break;
+        case NT_Let: {
+            ir_gen_let(ir, node);
+        } break;
+        case NT_Return: {
+            ir_gen_return(ir, node);
+        } break;
+        case NT_If: {
+            ir_gen_if(ir, node);
+        } break;
+        case NT_Print: {
+            ir_gen_print(ir, node);
+        } break;
+        default:
+            Unreachable("unsupported expression type in ir_gen_node");
+    }
+}
+
+void ir_gen_number_literal(IR *ir, ASTNode node) {
+    i32 value = (i32) ir->ast->number_literals[node.data].value;
+
+    Instruction instruction = {.type = IT_Push, .value = value};
+    append(&ir->instructions, instruction);
+}
+
+void ir_gen_identifier(IR *ir, ASTNode node) {
+    i32 slot = ir->slots[node.data];
+    if (slot == -1) {
+        if (!ir->error) {
+            ir->error = "unknown identifier";
+        }
+
+        return;
+    }
+
+    Instruction instruction = {.type = IT_Local, .value = slot};
+    append(&ir->instructions, instruction);
+}
+
+void ir_gen_binary(IR *ir, ASTNode node) {
+    BinaryASTNode binary = ir->ast->binaries[node.data];
+
+    ir_gen_node(ir, binary.left);
+    ir_gen_node(ir, binary.right);
+
+    switch (binary.op) {
+        case TT_Plus: {
+            Instruction instruction = {.type = IT_Add};
+            append(&ir->instructions, instruction); 
+        } break;
+        case TT_DoubleEquals: {
+            Instruction instruction = {.type = IT_CompareEqual};
+            append(&ir->instructions, instruction); 
+        } break;
+        default: {
+            if (!ir->error) {
+                ir->error = "unsupported binary operator";
+            }
+        } break;
+    }
+}
+
+void ir_gen_function(IR *ir, ASTNode node) {
+    FunctionASTNode function = ir->ast->functions[node.data];
+    string name = ast_symbol(ir->ast, function.name);
+
+    append(&ir->instructions, {.type = IT_StartFunction, .string = name});
+
+    for (NodeIndex statement : ast_range(ir->ast, function.body)) {
+        ir_gen_node(ir, statement);
+    }
+
+    append(&ir->instructions, {.type = IT_EndFunction, .string = name});
+}
+
+void ir_gen_let(IR *ir, ASTNode node) {
+    LetASTNode let = ir->ast->lets[node.data];
+
+    ir_gen_node(ir, let.expression);
+
+    // a let of a name already in scope stores over it, a new name gets the next frame slot
+    i32 slot = ir->slots[let.name];
+
+    if (slot == -1) {
+        slot = ir->local_count;
+        ir->local_count += 1;
+
+        ir->slots[let.name] = slot;
+        append(&ir->scope, let.name);
+    }
+
+    append(&ir->instructions, Instruction{.type = IT_Store, .value = slot});
+}
+
+void ir_gen_return(IR *ir, ASTNode node) {
+    ir_gen_node(ir, node.data);
+
+    Instruction instruction = {.type = IT_Return};
+    append(&ir->instructions, instruction);
+}
+
+void ir_gen_if(IR *ir, ASTNode node) {
+    IfASTNode iff = ir->ast->ifs[node.data];
+
+    ir_gen_node(ir, iff.condition);
+
+    // the body falls through from the branch, the block after it is where a false condition lands
+    i32 join = ir->block_count;
+    ir->block_count += 1;
+
+    append(&ir->instructions, Instruction{.type = IT_IfZero, .value = join});
+
+    i64 scope_start = ir->scope.len;
+    
+    for (NodeIndex statement : ast_range(ir->ast, iff.body)) {
+        ir_gen_node(ir, statement);
+    }
+
+    // names first bound in the body go out of scope, their slots are not reused
+    for (i64 i = scope_start; i < ir->scope.len; i++) {
+        ir->slots[ir->scope[i]] = -1;
+    }
+
+    ir->scope.len = scope_start;
+
+    append(&ir->instructions, Instruction{.type = IT_Label, .value = join});
+}
+
+void ir_gen_print(IR *ir, ASTNode node) {
+    ir_gen_node(ir, node.data);
+
+    append(&ir->instructions, Instruction{.type = IT_Print});
+}
+
+slice<i32> ir_symbol_table_create(Arena *arena, i64 symbol_count) {
+    DynamicArray<i32> table = dynamic_array_create<i32>(arena, symbol_count);
+
+    for (i64 i = 0; i < symbol_count; i++) {
+        append(&table, -1);
+    }
+
+    return to_slice(&table);
+}
+
+// a block starts at the first instruction, at every label and after every return, jump and branch
+CFG ir_build_cfg(Arena *arena, IR *ir) {
+    CFG cfg = {
+        .blocks = dynamic_array_create<IRBlock>(arena, 16),
+    };
+
+    i32 end = (i32) ir->instructions.len - 1;
+    Assertf(end >= 0 && ir->instructions[end].type == IT_EndFunction, "ir does not end with EndFunction in ir_build_cfg");
+
+    DynamicArray<i32> block_of_label = dynamic_array_create<i32>(arena, ir->block_count);
+    for (i32 i = 0; i < ir->block_count; i++) {
+        append(&block_of_label, -1);
+    }
+
+    for (i32 i = 0; i < end; i++) {
+        Instruction instruction = ir->instructions[i];
+
+        if (i == 0 || instruction.type == IT_Label || ir_is_terminator(ir->instructions[i - 1].type)) {
+            IRBlock block = {
+                .label = -1,
+                .start = i,
+                .successors = dynamic_array_create<i32>(arena, 2),
+                .predecessors = dynamic_array_create<i32>(arena, 2),
+            };
+
+            if (instruction.type == IT_Label) {
+                block.label = instruction.value;
+                block_of_label[instruction.value] = (i32) cfg.blocks.len;
+            }
+
+            append(&cfg.blocks, block);
+        }
+
+        cfg.blocks[cfg.blocks.len - 1].end = i + 1;
+    }
+
+    for (i32 b = 0; b < cfg.blocks.len; b++) {
+        Instruction last = ir->instructions[cfg.blocks[b].end - 1];
+        bool has_next = b + 1 < cfg.blocks.len;
+
+        if (last.type == IT_Return) {
+            continue;
+        }
+
+        if (last.type == IT_Jump || ir_is_branch(last.type)) {
+            i32 target = block_of_label[last.value];
+            Assertf(target != -1, "jump to a label that is not in the ir in ir_build_cfg");
+
+            if (ir_is_branch(last.type)) {
+                Assertf(has_next, "branch without a block after it in ir_build_cfg");
+                ir_add_edge(&cfg, b, b + 1);
+            }
+
+            ir_add_edge(&cfg, b, target);
+            continue;
+        }
+
+        // the last block runs off the end of the function when it does not return
+        if (has_next) {
+            ir_add_edge(&cfg, b, b + 1);
+        }
+    }
+
+    return cfg;
+}
+
+void ir_add_edge(CFG *cfg, i32 from, i32 to) {
+    append(&cfg->blocks[from].successors, to);
+    append(&cfg->blocks[to].predecessors, from);
+}
+
+bool ir_is_terminator(InstructionType type) {
+    return type == IT_Return || type == IT_Jump || ir_is_branch(type);
+}
+
+bool ir_is_branch(InstructionType type) {
+    return type == IT_IfZero || type == IT_IfNotZero;
+}
+
+// whether control can reach the EndFunction at end, a body without a trailing return returns 0 there
+bool ir_falls_off_end(slice<Instruction> instructions, i64 end) {
+    InstructionType type = instructions[end - 1].type;
+    return type != IT_Return && type != IT_Jump;
+}
+
+string ir_to_string(Arena *arena, IR *ir) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+
+    for (i32 i = 0; i < ir->instructions.len; i++) {
+        Instruction instruction = ir->instructions[i];
+
+        fmt(&bytes, "[{}] ", i);
+
+        switch (instruction.type) {
+            case IT_StartFunction: {
+                fmt(&bytes, "StartFunction '{}'\n", instruction.string);
+            } break;
+            case IT_EndFunction: {
+                fmt(&bytes, "EndFunction '{}'\n", instruction.string);
+            } break;
+            case IT_Push: {
+                fmt(&bytes, "Push {}\n", instruction.value);
+            } break;
+            case IT_Add: {
+                fmt(&bytes, "Add\n");
+            } break;
+            case IT_Local: {
+                fmt(&bytes, "Local {}\n", instruction.value);
+            } break;
+            case IT_Store: {
+                fmt(&bytes, "Store {}\n", instruction.value);
+            } break;
+            case IT_Return: {
+                fmt(&bytes, "Return\n");
+            } break;
+            case IT_IfZero: {
+                fmt(&bytes, "IfZero block_{}\n", instruction.value);
+            } break;
+            case IT_IfNotZero: {
+                fmt(&bytes, "IfNotZero block_{}\n", instruction.value);
+            } break;
+            case IT_Jump: {
+                fmt(&bytes, "Jump block_{}\n", instruction.value);
+            } break;
+            case IT_Label: {
+                fmt(&bytes, "Label block_{}\n", instruction.value);
+            } break;
+            case IT_CompareEqual: {
+                fmt(&bytes, "CompareEqual\n");
+            } break;
+            case IT_Print: {
+                fmt(&bytes, "Print\n");
+            } break;
+            default:
+                Unreachable("unsupported instruction type in ir_to_string");
+        }
+    }
+
+    return to_slice(&bytes);
+}
+
+string cfg_to_string(Arena *arena, CFG *cfg) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 256);
+
+    for (i32 b = 0; b < cfg->blocks.len; b++) {
+        IRBlock &block = cfg->blocks[b];
+
+        fmt(&bytes, "block {} [{}, {})", b, block.start, block.end);
+
+        if (block.label != -1) {
+            fmt(&bytes, " label block_{}", block.label);
+        }
+
+        fmt(&bytes, " successors");
+        for (i32 successor : block.successors) {
+            fmt(&bytes, " {}", successor);
+        }
+
+        fmt(&bytes, " predecessors");
+        for (i32 predecessor : block.predecessors) {
+            fmt(&bytes, " {}", predecessor);
+        }
+
+        fmt(&bytes, "\n");
+    }
+
+    return to_slice(&bytes);
+}
+
+// @ssa
+enum IRKind {
+    IK_Stack,
+    IK_SSA,
+};
+
+enum SSAInstructionType {
+    SI_Parameter,
+    SI_Constant,
+    SI_Add,
+    SI_CompareEqual,
+    SI_Phi,
+    SI_Print,
+    SI_Return,
+    SI_Branch,
+    SI_Jump,
+};
+
+struct SSAInstruction {
+    SSAInstructionType type;
+    i32 def;
+    i32 value;
+    array<i32, 2> operands;
+
+    // branch targets, or the incoming block of each phi operand
+    array<i32, 2> blocks;
+};
+
+struct SSABlock {
+    i32 id;
+    DynamicArray<SSAInstruction> instructions;
+    DynamicArray<i32> predecessors;
+};
+
+struct SSAFunction {
+    string name;
+    DynamicArray<SSABlock> blocks;
+    i32 vreg_count;
+
+    // NULL unless ssa_gen rejected the function, the same way ir_gen does
+    const char *error;
+};
+
+struct SSABinding {
+    Symbol symbol;
+    i32 vreg;
+};
+
+struct SSABuilder {
+    Arena *arena;
+    AST *ast;
+    SSAFunction *function;
+    i32 block;
+    DynamicArray<SSABinding> bindings;
+
+    // index into bindings of every symbol in scope, -1 otherwise
+    slice<i32> binding_of_symbol;
+};
+
+bool ssa_gen(Arena *arena, AST *ast, NodeIndex index, slice<i32> binding_of_symbol, SSAFunction *function);
+
+void ssa_gen_statement(SSABuilder *builder, NodeIndex index);
+void ssa_gen_if(SSABuilder *builder, IfASTNode iff);
+i32 ssa_gen_expression(SSABuilder *builder, NodeIndex index);
+
+void ssa_bind(SSABuilder *builder, Symbol symbol, i32 vreg);
+i32 ssa_new_block(SSABuilder *builder);
+i32 ssa_emit(SSABuilder *builder, SSAInstruction instruction);
+void ssa_add_predecessor(SSABuilder *builder, i32 block, i32 predecessor);
+bool ssa_is_terminated(SSABlock *block);
+bool ssa_has_def(SSAInstructionType type);
+i32 ssa_operand_count(SSAInstructionType type);
+DynamicArray<i32> ssa_use_counts(Arena *arena, SSAFunction *function);
+void ssa_remove_unused_parameters(Arena *arena, SSAFunction *function);
+
+string ssa_to_string(Arena *arena, SSAFunction *function);
+
+// binding_of_symbol is reused the same way as the slots of ir_gen
+bool ssa_gen(Arena *arena, AST *ast, NodeIndex index, slice<i32> binding_of_symbol, SSAFunction *function) {
+    FunctionASTNode *node = ast_function(ast, index);
+
+    *function = {
+        .name = ast_symbol(ast, node->name),
+        .blocks = dynamic_array_create<SSABlock>(arena, 16),
+        .error = NULL,
+    };
+
+    SSABuilder builder = {
+        .arena = arena,
+        .ast = ast,
+        .function = function,
+        .bindings = dynamic_array_create<SSABinding>(arena, 16),
+        .binding_of_symbol = binding_of_symbol,
+    };
+
+    builder.block = ssa_new_block(&builder);
+
+    for (i32 i = 0; i < (i32) node->parameters.size(); i++) {
+        i32 vreg = ssa_emit(&builder, {.type = SI_Parameter, .value = i});
+        ssa_bind(&builder, node->parameters[i], vreg);
+    }
+
+    for (NodeIndex statement : ast_range(ast, node->body)) {
+        ssa_gen_statement(&builder, statement);
+    }
+
+    for (SSABinding &binding : builder.bindings) {
+        builder.binding_of_symbol[binding.symbol] = -1;
+    }
+
+    if (function->error) {
+        return false;
+    }
+
+    ssa_remove_unused_parameters(arena, function);
+
+    return true;
+}
+
+void ssa_gen_statement(SSABuilder *builder, NodeIndex index) {
+    AST *ast = builder->ast;
+    ASTNode node = ast->nodes[index];
+
+    // anything after a return is unreachable but still gets a block of its own
+    if (ssa_is_terminated(&builder->function->blocks[builder->block])) {
+        builder->block = ssa_new_block(builder);
+    }
+
+    switch (node.type) {
+        case NT_Let: {
+            LetASTNode let = ast->lets[node.data];
+
+            i32 vreg = ssa_gen_expression(builder, let.expression);
+
+            // a let of a name already in scope rebinds it, which is what needs phis at joins
+            i32 binding = builder->binding_of_symbol[let.name];
+
+            if (binding != -1) {
+                builder->bindings[binding].vreg = vreg;
+                return;
+            }
+
+            ssa_bind(builder, let.name, vreg);
+        } break;
+        case NT_Return: {
+            i32 vreg = ssa_gen_expression(builder, node.data);
+            ssa_emit(builder, {.type = SI_Return, .operands = {vreg, -1}});
+        } break;
+        case NT_If: {
+            ssa_gen_if(builder, ast->ifs[node.data]);
+        } break;
+        case NT_Print: {
+            i32 vreg = ssa_gen_expression(builder, node.data);
+            ssa_emit(builder, {.type = SI_Print, .operands = {vreg, -1}});
+        } break;
+        default:
+            Unreachable("unsupported statement type in ssa_gen_statement");
+    }
+}
+
+void ssa_gen_if(SSABuilder *builder, IfASTNode iff) {
+    i32 condition = ssa_gen_expression(builder, iff.condition);
+
+    i32 branch_block = builder->block;
+    i32 branch_index = (i32) builder->function->blocks[branch_block].instructions.len;
+    ssa_emit(builder, {.type = SI_Branch, .operands = {condition, -1}, .blocks = {-1, -1}});
+
+    slice<SSABinding> before = slice_clone(builder->arena, to_slice(&builder->bindings));
+
+    i32 body_block = ssa_new_block(builder);
+    ssa_add_predecessor(builder, body_block, branch_block);
+    builder->block = body_block;
+
+    for (NodeIndex statement : ast_range(builder->ast, iff.body)) {
+        ssa_gen_statement(builder, statement);
+    }
+
+    i32 body_end = builder->block;
+    bool falls_through = !ssa_is_terminated(&builder->function->blocks[body_end]);
+
+    i32 join_block = ssa_new_block(builder);
+
+    if (falls_through) {
+        ssa_emit(builder, {.type = SI_Jump, .blocks = {join_block, -1}});
+    }
+
+    SSAInstruction *branch = &builder->function->blocks[branch_block].instructions[branch_index];
+    branch->blocks[0] = body_block;
+    branch->blocks[1] = join_block;
+
+    ssa_add_predecessor(builder, join_block, branch_block);
+    if (falls_through) {
+        ssa_add_predecessor(builder, join_block, body_end);
+    }
+
+    builder->block = join_block;
+
+    // names first bound inside the body go out of scope, rebound names meet in a phi
+    for (i64 i = 0; i < before.len; i++) {
+        i32 after = builder->bindings[i].vreg;
+
+        if (!falls_through || after == before[i].vreg) {
+            builder->bindings[i].vreg = before[i].vreg;
+            continue;
+        }
+
+        builder->bindings[i].vreg = ssa_emit(builder, {
+            .type = SI_Phi,
+            .operands = {before[i].vreg, after},
+            .blocks = {branch_block, body_end},
+        });
+    }
+
+    for (i64 i = before.len; i < builder->bindings.len; i++) {
+        builder->binding_of_symbol[builder->bindings[i].symbol] = -1;
+    }
+
+    builder->bindings.len = before.len;
+}
+
+i32 ssa_gen_expression(SSABuilder *builder, NodeIndex index) {
+    AST *ast = builder->ast;
+    ASTNode node = ast->nodes[index];
+
+    switch (node.type) {
+        case NT_NumberLiteral: {
+            i32 value = (i32) ast->number_literals[node.data].value;
+            return ssa_emit(builder, {.type = SI_Constant, .value = value});
+        } break;
+        case NT_Identifier: {
+            i32 binding = builder->binding_of_symbol[node.data];
+
+            // any vreg keeps generation going, the function is thrown away
+            if (binding == -1) {
+                if (!builder->function->error) {
+                    builder->function->error = "unknown identifier";
+                }
+
+                return 0;
+            }
+
+            return builder->bindings[binding].vreg;
+        } break;
+        case NT_Binary: {
+            BinaryASTNode binary = ast->binaries[node.data];
+
+            i32 left = ssa_gen_expression(builder, binary.left);
+            i32 right = ssa_gen_expression(builder, binary.right);
+
+            switch (binary.op) {
+                case TT_Plus:
+                    return ssa_emit(builder, {.type = SI_Add, .operands = {left, right}});
+                case TT_DoubleEquals:
+                    return ssa_emit(builder, {.type = SI_CompareEqual, .operands = {left, right}});
+                default: {
+                    if (!builder->function->error) {
+                        builder->function->error = "unsupported binary operator";
+                    }
+
+                    return left;
+                }
+            }
+        } break;
+        default:
+            Unreachable("unsupported expression type in ssa_gen_expression");
+    }
+
+    return -1;
+}
+
+void ssa_bind(SSABuilder *builder, Symbol symbol, i32 vreg) {
+    builder->binding_of_symbol[symbol] = (i32) builder->bindings.len;
+    append(&builder->bindings, SSABinding{.symbol = symbol, .vreg = vreg});
+}
+
+i32 ssa_new_block(SSABuilder *builder) {
+    i32 id = (i32) builder->function->blocks.len;
+
+    append(&builder->function->blocks, SSABlock{
+        .id = id,
+        .instructions = dynamic_array_create<SSAInstruction>(builder->arena, 16),
+        .predecessors = dynamic_array_create<i32>(builder->arena, 2),
+    });
+
+    return id;
+}
+
+i32 ssa_emit(SSABuilder *builder, SSAInstruction instruction) {
+    instruction.def = -1;
+
+    if (ssa_has_def(instruction.type)) {
+        instruction.def = builder->function->vreg_count;
+        builder->function->vreg_count += 1;
+    }
+
+    append(&builder->function->blocks[builder->block].instructions, instruction);
+
+    return instruction.def;
+}
+
+void ssa_add_predecessor(SSABuilder *builder, i32 block, i32 predecessor) {
+    append(&builder->function->blocks[block].predecessors, predecessor);
+}
+
+bool ssa_is_terminated(SSABlock *block) {
+    if (block->instructions.len == 0) {
+        return false;
+    }
+
+    SSAInstructionType type = block->instructions[block->instructions.len - 1].type;
+    return type == SI_Return || type == SI_Branch || type == SI_Jump;
+}
+
+bool ssa_has_def(SSAInstructionType type) {
+    switch (type) {
+        case SI_Parameter:
+        case SI_Constant:
+        case SI_Add:
+        case SI_CompareEqual:
+        case SI_Phi:
+            return true;
+        default:
+            return false;
+    }
+}
+
+i32 ssa_operand_count(SSAInstructionType type) {
+    switch (type) {
+        case SI_Add:
+        case SI_CompareEqual:
+        case SI_Phi:
+            return 2;
+        case SI_Print:
+        case SI_Return:
+        case SI_Branch:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// how many operands read each vreg, phis included
+DynamicArray<i32> ssa_use_counts(Arena *arena, SSAFunction *function) {
+    DynamicArray<i32> use_counts = dynamic_array_create<i32>(arena, function->vreg_count);
+    for (i32 i = 0; i < function->vreg_count; i++) {
+        append(&use_counts, 0);
+    }
+
+    for (SSABlock &block : function->blocks) {
+        for (SSAInstruction &instruction : block.instructions) {
+            for (i32 k = 0; k < ssa_operand_count(instruction.type); k++) {
+                use_counts[instruction.operands[k]] += 1;
+            }
+        }
+    }
+
+    return use_counts;
+}
+
+void ssa_remove_unused_parameters(Arena *arena, SSAFunction *function) {
+    DynamicArray<i32> use_counts = ssa_use_counts(arena, function);
+
+    DynamicArray<SSAInstruction> *entry = &function->blocks[0].instructions;
+
+    i64 kept = 0;
+    for (i64 i = 0; i < entry->len; i++) {
+        SSAInstruction instruction = (*entry)[i];
+
+        if (instruction.type == SI_Parameter && use_counts[instruction.def] == 0) {
+            continue;
+        }
+
+        (*entry)[kept] = instruction;
+        kept++;
+    }
+
+    entry->len = kept;
+}
+
+string ssa_to_string(Arena *arena, SSAFunction *function) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+
+    fmt(&bytes, "Function '{}'\n", function->name);
+
+    for (SSABlock &block : function->blocks) {
+        fmt(&bytes, "block_{}:", block.id);
+
+        if (block.predecessors.len > 0) {
+            fmt(&bytes, " ; preds");
+            for (i32 predecessor : block.predecessors) {
+                fmt(&bytes, " block_{}", predecessor);
+            }
+        }
+
+        fmt(&bytes, "\n");
+
+        for (SSAInstruction &instruction : block.instructions) {
+            fmt(&bytes, "    ");
+
+            if (instruction.def != -1) {
+                fmt(&bytes, "v{} = ", instruction.def);
+            }
+
+            switch (instruction.type) {
+                case SI_Parameter: {
+                    fmt(&bytes, "Parameter {}\n", instruction.value);
+                } break;
+                case SI_Constant: {
+                    fmt(&bytes, "Constant {}\n", instruction.value);
+                } break;
+                case SI_Add: {
+                    fmt(&bytes, "Add v{} v{}\n", instruction.operands[0], instruction.operands[1]);
+                } break;
+                case SI_CompareEqual: {
+                    fmt(&bytes, "CompareEqual v{} v{}\n", instruction.operands[0], instruction.operands[1]);
+                } break;
+                case SI_Phi: {
+                    fmt(&bytes, "Phi [block_{} v{}] [block_{} v{}]\n",
+                        instruction.blocks[0], instruction.operands[0],
+                        instruction.blocks[1], instruction.operands[1]);
+                } break;
+                case SI_Print: {
+                    fmt(&bytes, "Print v{}\n", instruction.operands[0]);
+                } break;
+                case SI_Return: {
+                    fmt(&bytes, "Return v{}\n", instruction.operands[0]);
+                } break;
+                case SI_Branch: {
+                    fmt(&bytes, "Branch v{} block_{} block_{}\n",
+                        instruction.operands[0], instruction.blocks[0], instruction.blocks[1]);
+                } break;
+                case SI_Jump: {
+                    fmt(&bytes, "Jump block_{}\n", instruction.blocks[0]);
+                } break;
+                default:
+                    Unreachable("unsupported instruction type in ssa_to_string");
+            }
+        }
+    }
+
+    return to_slice(&bytes);
+}
+
+// @opt
+struct OptPassResult {
+    string name;
+    i64 removed;
+};
+
+struct OptStats {
+    DynamicArray<OptPassResult> passes;
+};
+
+OptStats opt_run(Arena *arena, IR *ir, i32 level);
+OptStats opt_run_ssa(Arena *arena, SSAFunction *function, i32 level);
+
+i64 opt_forward_stores(Arena *arena, IR *ir);
+i64 opt_fold_constants(Arena *arena, IR *ir);
+i64 opt_remove_unreachable(Arena *arena, IR *ir);
+bool opt_may_be_unreachable(Arena *arena, IR *ir);
+i64 opt_layout_blocks(Arena *arena, IR *ir);
+DynamicArray<f64> opt_block_frequencies(Arena *arena, IR *ir, CFG *cfg);
+f64 opt_edge_probability(IR *ir, CFG *cfg, i32 block, i32 successor);
+f64 opt_taken_branches(Arena *arena, IR *ir);
+
+i64 opt_ssa_fold_constants(Arena *arena, SSAFunction *function);
+i64 opt_ssa_remove_dead_code(Arena *arena, SSAFunction *function);
+void opt_ssa_remove_edge(SSAFunction *function, i32 from, i32 to);
+i64 opt_ssa_instruction_count(SSAFunction *function);
+
+bool opt_fits_i32(i64 value);
+void opt_record(OptStats *stats, string name, i64 removed);
+string opt_stats_to_string(Arena *arena, OptStats *stats);
+
+OptStats opt_run(Arena *arena, IR *ir, i32 level) {
+    OptStats stats = {
+        .passes = dynamic_array_create<OptPassResult>(arena, 4),
+    };
+
+    // -O1 runs every pass once, -O2 keeps going until nothing changes
+    i32 iterations = level >= 2 ? 8 : 1;
+
+    for (i32 i = 0; i < iterations; i++) {
+        i64 removed = 0;
+
+        // runs first so the constants it forwards fold in the same iteration
+        i64 forwarded = opt_forward_stores(arena, ir);
+        opt_record(&stats, "forward_stores", forwarded);
+        removed += forwarded;
+
+        i64 folded = opt_fold_constants(arena, ir);
+        opt_record(&stats, "fold_constants", folded);
+        removed += folded;
+
+        i64 unreachable = opt_remove_unreachable(arena, ir);
+        opt_record(&stats, "remove_unreachable", unreachable);
+        removed += unreachable;
+
+        if (removed == 0) {
+            break;
+        }
+    }
+
+    // the order of the blocks only matters once they are final
+    opt_record(&stats, "layout_blocks", opt_layout_blocks(arena, ir));
+
+    return stats;
+}
+
+OptStats opt_run_ssa(Arena *arena, SSAFunction *function, i32 level) {
+    OptStats stats = {
+        .passes = dynamic_array_create<OptPassResult>(arena, 4),
+    };
+
+    i32 iterations = level >= 2 ? 8 : 1;
+
+    for (i32 i = 0; i < iterations; i++) {
+        i64 removed = 0;
+
+        i64 folded = opt_ssa_fold_constants(arena, function);
+        opt_record(&stats, "ssa_fold_constants", folded);
+        removed += folded;
+
+        i64 dead = opt_ssa_remove_dead_code(arena, function);
+        opt_record(&stats, "ssa_remove_dead_code", dead);
+        removed += dead;
+
+        if (removed == 0) {
+            break;
+        }
+    }
+
+    return stats;
+}
+
+// a load of a slot whose last store in the same block was a constant becomes a push of that constant,
+// then a constant store to a slot nothing loads any more is dropped with its push. a label starts a
+// block that may be entered from elsewhere, so nothing is known past one
+i64 opt_forward_stores(Arena *arena, IR *ir) {
+    // the constant in each slot, valid while the stamp matches the current block
+    DynamicArray<i32> values = dynamic_array_create<i32>(arena, ir->local_count);
+    DynamicArray<i32> stamps = dynamic_array_create<i32>(arena, ir->local_count);
+    DynamicArray<i32> loads = dynamic_array_create<i32>(arena, ir->local_count);
+
+    for (i32 s = 0; s < ir->local_count; s++) {
+        append(&values, 0);
+        append(&stamps, -1);
+        append(&loads, 0);
+    }
+
+    i32 block = 0;
+    i64 changed = 0;
+
+    for (i64 i = 0; i < ir->instructions.len; i++) {
+        Instruction *instruction = &ir->instructions[i];
+
+        switch (instruction->type) {
+            case IT_Label: {
+                block += 1;
+            } break;
+            case IT_Store: {
+                Instruction previous = ir->instructions[i - 1];
+                bool constant = previous.type == IT_Push;
+
+                values[instruction->value] = previous.value;
+                stamps[instruction->value] = constant ? block : -1;
+            } break;
+            case IT_Local: {
+                if (stamps[instruction->value] == block) {
+                    *instruction = Instruction{.type = IT_Push, .value = values[instruction->value]};
+                    changed += 1;
+                    break;
+                }
+
+                loads[instruction->value] += 1;
+            } break;
+            default:
+                break;
+        }
+    }
+
+    DynamicArray<Instruction> kept = dynamic_array_create<Instruction>(arena, ir->instructions.len);
+
+    for (Instruction instruction : ir->instructions) {
+        if (instruction.type == IT_Store && loads[instruction.value] == 0 && kept[kept.len - 1].type == IT_Push) {
+            kept.len -= 1;
+            continue;
+        }
+
+        append(&kept, instruction);
+    }
+
+    changed += ir->instructions.len - kept.len;
+    ir->instructions = kept;
+
+    return changed;
+}
+
+i64 opt_fold_constants(Arena *arena, IR *ir) {
+    DynamicArray<Instruction> folded = dynamic_array_create<Instruction>(arena, ir->instructions.len);
+
+    // the operands of a stack op are the last two instructions emitted when both are pushes,
+    // so folding into the output as it is built also folds whole constant subtrees
+    for (Instruction instruction : ir->instructions) {
+        i64 len = folded.len;
+
+        switch (instruction.type) {
+            case IT_Add:
+            case IT_CompareEqual: {
+                if (len < 2 || folded[len - 2].type != IT_Push || folded[len - 1].type != IT_Push) {
+                    break;
+                }
+
+                i64 left = folded[len - 2].value;
+                i64 right = folded[len - 1].value;
+                i64 value = instruction.type == IT_Add ? left + right : (i64) (left == right);
+
+                if (!opt_fits_i32(value)) {
+                    break;
+                }
+
+                folded.len -= 2;
+                append(&folded, Instruction{.type = IT_Push, .value = (i32) value});
+                continue;
+            } break;
+            case IT_IfZero:
+            case IT_IfNotZero: {
+                if (len < 1 || folded[len - 1].type != IT_Push) {
+                    break;
+                }
+
+                i32 condition = folded[len - 1].value;
+                folded.len -= 1;
+
+                // a constant condition either always jumps or never does
+                if ((condition == 0) == (instruction.type == IT_IfZero)) {
+                    append(&folded, Instruction{.type = IT_Jump, .value = instruction.value});
+                }
+
+                continue;
+            } break;
+            default:
+                break;
+        }
+
+        append(&folded, instruction);
+    }
+
+    i64 removed = ir->instructions.len - folded.len;
+    ir->instructions = folded;
+
+    return removed;
+}
+
+i64 opt_remove_unreachable(Arena *arena, IR *ir) {
+    if (!opt_may_be_unreachable(arena, ir)) {
+        return 0;
+    }
+
+    CFG cfg = ir_build_cfg(arena, ir);
+
+    DynamicArray<bool> reachable = dynamic_array_create<bool>(arena, cfg.blocks.len);
+    for (i32 b = 0; b < cfg.blocks.len; b++) {
+        append(&reachable, false);
+    }
+
+    DynamicArray<i32> worklist = dynamic_array_create<i32>(arena, cfg.blocks.len);
+    append(&worklist, 0);
+    reachable[0] = true;
+
+    while (worklist.len > 0) {
+        i32 b = worklist[worklist.len - 1];
+        worklist.len -= 1;
+
+        for (i32 successor : cfg.blocks[b].successors) {
+            if (!reachable[successor]) {
+                reachable[successor] = true;
+                append(&worklist, successor);
+            }
+        }
+    }
+
+    DynamicArray<Instruction> kept = dynamic_array_create<Instruction>(arena, ir->instructions.len);
+
+    for (i32 b = 0; b < cfg.blocks.len; b++) {
+        if (!reachable[b]) {
+            continue;
+        }
+
+        IRBlock &block = cfg.blocks[b];
+
+        i32 next = b + 1;
+        while (next < cfg.blocks.len && !reachable[next]) {
+            next++;
+        }
+
+        i32 end = block.end;
+
+        // a jump straight to the next block that is kept falls through anyway
+        if (ir->instructions[end - 1].type == IT_Jump && block.successors[0] == next) {
+            end -= 1;
+        }
+
+        for (i32 i = block.start; i < end; i++) {
+            append(&kept, ir->instructions[i]);
+        }
+    }
+
+    append(&kept, ir->instructions[ir->instructions.len - 1]);
+
+    i64 removed = ir->instructions.len - kept.len;
+    ir->instructions = kept;
+
+    return removed;
+}
+
+// a block can only be dead when nothing falls into it and nothing jumps to it, and a jump to the
+// next block is always removed, so without either of those the cfg is not worth building
+bool opt_may_be_unreachable(Arena *arena, IR *ir) {
+    DynamicArray<bool> targeted = dynamic_array_create<bool>(arena, ir->block_count);
+    for (i32 b = 0; b < ir->block_count; b++) {
+        append(&targeted, false);
+    }
+
+    for (Instruction &instruction : ir->instructions) {
+        if (instruction.type == IT_Jump || ir_is_branch(instruction.type)) {
+            targeted[instruction.value] = true;
+        }
+    }
+
+    for (i64 i = 1; i + 1 < ir->instructions.len; i++) {
+        Instruction previous = ir->instructions[i - 1];
+        Instruction instruction = ir->instructions[i];
+
+        if (previous.type != IT_Return && previous.type != IT_Jump) {
+            continue;
+        }
+
+        if (instruction.type != IT_Label || !targeted[instruction.value]) {
+            return true;
+        }
+
+        if (previous.type == IT_Jump && previous.value == instruction.value) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// chains of blocks are grown along the heaviest edges first so the likelier way out of a block falls
+// through, then the chains are placed hot to cold and every branch and jump is redone for the new order
+i64 opt_layout_blocks(Arena *arena, IR *ir) {
+    bool branches_at_all = false;
+    for (Instruction &instruction : ir->instructions) {
+        branches_at_all = branches_at_all || ir_is_branch(instruction.type);
+    }
+
+    // with no branch there is no choice to make
+    if (!branches_at_all) {
+        return 0;
+    }
+
+    CFG cfg = ir_build_cfg(arena, ir);
+    i32 count = (i32) cfg.blocks.len;
+
+    DynamicArray<f64> frequencies = opt_block_frequencies(arena, ir, &cfg);
+
+    struct LayoutEdge {
+        i32 from;
+        i32 to;
+        i32 order;
+        f64 weight;
+    };
+
+    DynamicArray<LayoutEdge> edges = dynamic_array_create<LayoutEdge>(arena, count * 2);
+
+    for (i32 b = 0; b < count; b++) {
+        for (i32 k = 0; k < cfg.blocks[b].successors.len; k++) {
+            f64 weight = frequencies[b] * opt_edge_probability(ir, &cfg, b, k);
+            append(&edges, LayoutEdge{.from = b, .to = cfg.blocks[b].successors[k], .order = (i32) edges.len, .weight = weight});
+        }
+    }
+
+    // ties keep the edges in instruction order, which is the order the blocks already have
+    static const auto compare_weight = [](const void *a, const void *b) -> int {
+        const LayoutEdge *left = (const LayoutEdge *) a;
+        const LayoutEdge *right = (const LayoutEdge *) b;
+
+        if (left->weight != right->weight) {
+            return left->weight > right->weight ? -1 : 1;
+        }
+
+        return left->order - right->order;
+    };
+
+    qsort(edges.ptr, edges.len, sizeof(LayoutEdge), compare_weight);
+
+    // every block starts as a chain of its own, chain is the first block of the chain a block is in
+    DynamicArray<i32> chain = dynamic_array_create<i32>(arena, count);
+    DynamicArray<i32> tail = dynamic_array_create<i32>(arena, count);
+    DynamicArray<i32> next = dynamic_array_create<i32>(arena, count);
+
+    for (i32 b = 0; b < count; b++) {
+        append(&chain, b);
+        append(&tail, b);
+        append(&next, -1);
+    }
+
+    // a block that runs off the end of the function has to stay last, so its chain never joins the entry's
+    Instruction last = ir->instructions[cfg.blocks[count - 1].end - 1];
+    i32 exit = ir_is_terminator(last.type) ? -1 : count - 1;
+
+    for (LayoutEdge &edge : edges) {
+        i32 from = chain[edge.from];
+
+        if (from == chain[edge.to] || tail[from] != edge.from || chain[edge.to] != edge.to || edge.to == 0) {
+            continue;
+        }
+
+        if (from == 0 && exit != -1 && chain[exit] == edge.to) {
+            continue;
+        }
+
+        next[edge.from] = edge.to;
+        tail[from] = tail[edge.to];
+
+        for (i32 b = edge.to; b != -1; b = next[b]) {
+            chain[b] = from;
+        }
+    }
+
+    DynamicArray<i32> heads = dynamic_array_create<i32>(arena, count);
+    for (i32 b = 1; b < count; b++) {
+        if (chain[b] == b && (exit == -1 || chain[exit] != b)) {
+            append(&heads, b);
+        }
+    }
+
+    for (i64 i = 1; i < heads.len; i++) {
+        i32 head = heads[i];
+
+        i64 j = i;
+        while (j > 0 && frequencies[heads[j - 1]] < frequencies[head]) {
+            heads[j] = heads[j - 1];
+            j--;
+        }
+
+        heads[j] = head;
+    }
+
+    DynamicArray<i32> order = dynamic_array_create<i32>(arena, count);
+
+    static const auto append_chain = [](DynamicArray<i32> *order, DynamicArray<i32> *next, i32 head) {
+        for (i32 b = head; b != -1; b = (*next)[b]) {
+            append(order, b);
+        }
+    };
+
+    append_chain(&order, &next, 0);
+
+    for (i32 head : heads) {
+        append_chain(&order, &next, head);
+    }
+
+    if (exit != -1 && chain[exit] != 0) {
+        append_chain(&order, &next, chain[exit]);
+    }
+
+    bool unchanged = true;
+    for (i32 k = 0; k < count; k++) {
+        unchanged = unchanged && order[k] == k;
+    }
+
+    if (unchanged) {
+        return 0;
+    }
+
+    // what ends each block in the new order, a branch to one successor and a jump to the other at most
+    DynamicArray<InstructionType> branches = dynamic_array_create<InstructionType>(arena, count);
+    DynamicArray<i32> branch_targets = dynamic_array_create<i32>(arena, count);
+    DynamicArray<i32> jump_targets = dynamic_array_create<i32>(arena, count);
+    DynamicArray<bool> targeted = dynamic_array_create<bool>(arena, count);
+
+    for (i32 b = 0; b < count; b++) {
+        append(&branches, IT_Label);
+        append(&branch_targets, -1);
+        append(&jump_targets, -1);
+        append(&targeted, false);
+    }
+
+    for (i32 k = 0; k < count; k++) {
+        i32 b = order[k];
+        i32 following = k + 1 < count ? order[k + 1] : -1;
+
+        IRBlock &block = cfg.blocks[b];
+        InstructionType type = ir->instructions[block.end - 1].type;
+
+        if (ir_is_branch(type)) {
+            i32 fallthrough = block.successors[0];
+            i32 taken = block.successors[1];
+
+            if (following == taken && following != fallthrough) {
+                branches[b] = type == IT_IfZero ? IT_IfNotZero : IT_IfZero;
+                branch_targets[b] = fallthrough;
+            } else {
+                branches[b] = type;
+                branch_targets[b] = taken;
+
+                if (following != fallthrough) {
+                    jump_targets[b] = fallthrough;
+                }
+            }
+        } else if (block.successors.len == 1 && following != block.successors[0]) {
+            jump_targets[b] = block.successors[0];
+        }
+
+        if (branch_targets[b] != -1) {
+            targeted[branch_targets[b]] = true;
+        }
+
+        if (jump_targets[b] != -1) {
+            targeted[jump_targets[b]] = true;
+        }
+    }
+
+    // only blocks something jumps to keep a label, one that had none gets a new id
+    for (i32 b = 0; b < count; b++) {
+        if (targeted[b] && cfg.blocks[b].label == -1) {
+            cfg.blocks[b].label = ir->block_count;
+            ir->block_count += 1;
+        }
+    }
+
+    DynamicArray<Instruction> laid_out = dynamic_array_create<Instruction>(arena, ir->instructions.len + count);
+
+    for (i32 b : order) {
+        IRBlock &block = cfg.blocks[b];
+
+        i32 start = block.start;
+        i32 end = block.end;
+
+        if (ir->instructions[start].type == IT_Label) {
+            start += 1;
+        }
+
+        InstructionType type = ir->instructions[end - 1].type;
+        if (ir_is_branch(type) || type == IT_Jump) {
+            end -= 1;
+        }
+
+        if (targeted[b]) {
+            append(&laid_out, Instruction{.type = IT_Label, .value = block.label});
+        }
+
+        for (i32 i = start; i < end; i++) {
+            append(&laid_out, ir->instructions[i]);
+        }
+
+        if (branch_targets[b] != -1) {
+            append(&laid_out, Instruction{.type = branches[b], .value = cfg.blocks[branch_targets[b]].label});
+        }
+
+        if (jump_targets[b] != -1) {
+            append(&laid_out, Instruction{.type = IT_Jump, .value = cfg.blocks[jump_targets[b]].label});
+        }
+    }
+
+    append(&laid_out, ir->instructions[ir->instructions.len - 1]);
+
+    i64 removed = ir->instructions.len - laid_out.len;
+    ir->instructions = laid_out;
+
+    return removed;
+}
+
+// how often each block runs per call. there are no loops, so a block is done once all of its
+// predecessors are, in whatever order layout has left them
+DynamicArray<f64> opt_block_frequencies(Arena *arena, IR *ir, CFG *cfg) {
+    i32 count = (i32) cfg->blocks.len;
+
+    DynamicArray<f64> frequencies = dynamic_array_create<f64>(arena, count);
+    DynamicArray<i32> pending = dynamic_array_create<i32>(arena, count);
+    DynamicArray<i32> ready = dynamic_array_create<i32>(arena, count);
+
+    for (i32 b = 0; b < count; b++) {
+        append(&frequencies, b == 0 ? 1.0 : 0.0);
+        append(&pending, (i32) cfg->blocks[b].predecessors.len);
+
+        if (pending[b] == 0) {
+            append(&ready, b);
+        }
+    }
+
+    while (ready.len > 0) {
+        i32 b = ready[ready.len - 1];
+        ready.len -= 1;
+
+        IRBlock &block = cfg->blocks[b];
+
+        for (i32 k = 0; k < block.successors.len; k++) {
+            i32 successor = block.successors[k];
+            frequencies[successor] += frequencies[b] * opt_edge_probability(ir, cfg, b, k);
+
+            pending[successor] -= 1;
+            if (pending[successor] == 0) {
+                append(&ready, successor);
+            }
+        }
+    }
+
+    return frequencies;
+}
+
+// static prediction after Ball and Larus, an equality compare is usually false and a way out that
+// returns at once is usually not taken. the hit rates are the ones Wu and Larus measured, and two
+// heuristics that both apply are combined as independent evidence
+f64 opt_edge_probability(IR *ir, CFG *cfg, i32 block, i32 successor) {
+    IRBlock &from = cfg->blocks[block];
+
+    if (from.successors.len == 1) {
+        return 1.0;
+    }
+
+    static const auto combine = [](f64 a, f64 b) {
+        return a * b / (a * b + (1.0 - a) * (1.0 - b));
+    };
+
+    static const auto returns = [](IR *ir, CFG *cfg, i32 block) {
+        return ir->instructions[cfg->blocks[block].end - 1].type == IT_Return;
+    };
+
+    InstructionType type = ir->instructions[from.end - 1].type;
+
+    i32 on_zero = type == IT_IfZero ? from.successors[1] : from.successors[0];
+    i32 on_not_zero = type == IT_IfZero ? from.successors[0] : from.successors[1];
+
+    // chance that the condition is not zero
+    f64 not_zero = 0.5;
+
+    if (from.end - 2 >= from.start && ir->instructions[from.end - 2].type == IT_CompareEqual) {
+        not_zero = combine(not_zero, 0.16);
+    }
+
+    if (returns(ir, cfg, on_zero) != returns(ir, cfg, on_not_zero)) {
+        not_zero = combine(not_zero, returns(ir, cfg, on_not_zero) ? 0.28 : 0.72);
+    }
+
+    f64 taken = type == IT_IfZero ? 1.0 - not_zero : not_zero;
+
+    return successor == 1 ? taken : 1.0 - taken;
+}
+
+// expected jumps and branches taken per call with the blocks in the order they are in now
+f64 opt_taken_branches(Arena *arena, IR *ir) {
+    CFG cfg = ir_build_cfg(arena, ir);
+    DynamicArray<f64> frequencies = opt_block_frequencies(arena, ir, &cfg);
+
+    f64 taken = 0.0;
+
+    for (i32 b = 0; b < cfg.blocks.len; b++) {
+        IRBlock &block = cfg.blocks[b];
+        bool jumps = ir->instructions[block.end - 1].type == IT_Jump;
+
+        for (i32 k = 0; k < block.successors.len; k++) {
+            if (jumps || k == 1) {
+                taken += frequencies[b] * opt_edge_probability(ir, &cfg, b, k);
+            }
+        }
+    }
+
+    return taken;
+}
+
+i64 opt_ssa_fold_constants(Arena *arena, SSAFunction *function) {
+    i64 before = opt_ssa_instruction_count(function);
+
+    DynamicArray<bool> is_constant = dynamic_array_create<bool>(arena, function->vreg_count);
+    DynamicArray<i32> constants = dynamic_array_create<i32>(arena, function->vreg_count);
+    DynamicArray<i32> replacements = dynamic_array_create<i32>(arena, function->vreg_count);
+
+    for (i32 i = 0; i < function->vreg_count; i++) {
+        append(&is_constant, false);
+        append(&constants, 0);
+        append(&replacements, i);
+    }
+
+    // blocks are laid out in order with forward edges only, so one pass sees every def before
+    // its uses and every edge removal before the block it points at
+    for (i32 b = 0; b < function->blocks.len; b++) {
+        SSABlock *block = &function->blocks[b];
+
+        if (b != 0 && block->predecessors.len == 0) {
+            for (SSAInstruction &instruction : block->instructions) {
+                if (instruction.type == SI_Branch) {
+                    opt_ssa_remove_edge(function, b, instruction.blocks[0]);
+                    opt_ssa_remove_edge(function, b, instruction.blocks[1]);
+                } else if (instruction.type == SI_Jump) {
+                    opt_ssa_remove_edge(function, b, instruction.blocks[0]);
+                }
+            }
+
+            block->instructions.len = 0;
+            continue;
+        }
+
+        i64 kept = 0;
+
+        for (i64 i = 0; i < block->instructions.len; i++) {
+            SSAInstruction instruction = block->instructions[i];
+
+            for (i32 k = 0; k < ssa_operand_count(instruction.type); k++) {
+                instruction.operands[k] = replacements[instruction.operands[k]];
+            }
+
+            i32 left = instruction.operands[0];
+            i32 right = instruction.operands[1];
+
+            switch (instruction.type) {
+                case SI_Add:
+                case SI_CompareEqual: {
+                    if (!is_constant[left] || !is_constant[right]) {
+                        break;
+                    }
+
+                    i64 value = instruction.type == SI_Add
+                        ? (i64) constants[left] + (i64) constants[right]
+                        : (i64) (constants[left] == constants[right]);
+
+                    if (opt_fits_i32(value)) {
+                        instruction = {.type = SI_Constant, .def = instruction.def, .value = (i32) value};
+                    }
+                } break;
+                case SI_Phi: {
+                    // operand 0 comes from the block holding the branch, which dominates the join
+                    bool same = left == right || (is_constant[left] && is_constant[right] && constants[left] == constants[right]);
+
+                    if (same) {
+                        replacements[instruction.def] = left;
+                        continue;
+                    }
+                } break;
+                case SI_Branch: {
+                    if (!is_constant[left]) {
+                        break;
+                    }
+
+                    i32 taken = constants[left] != 0 ? instruction.blocks[0] : instruction.blocks[1];
+                    i32 not_taken = constants[left] != 0 ? instruction.blocks[1] : instruction.blocks[0];
+
+                    opt_ssa_remove_edge(function, b, not_taken);
+                    instruction = {.type = SI_Jump, .def = -1, .blocks = {taken, -1}};
+                } break;
+                default:
+                    break;
+            }
+
+            if (instruction.type == SI_Constant) {
+                is_constant[instruction.def] = true;
+                constants[instruction.def] = instruction.value;
+            }
+
+            block->instructions[kept] = instruction;
+            kept++;
+        }
+
+        block->instructions.len = kept;
+    }
+
+    return before - opt_ssa_instruction_count(function);
+}
+
+i64 opt_ssa_remove_dead_code(Arena *arena, SSAFunction *function) {
+    i64 before = opt_ssa_instruction_count(function);
+
+    DynamicArray<i32> use_counts = ssa_use_counts(arena, function);
+
+    // uses always come later in the layout, so walking backwards frees whole chains in one go
+    for (i64 b = function->blocks.len - 1; b >= 0; b--) {
+        DynamicArray<SSAInstruction> *instructions = &function->blocks[b].instructions;
+
+        for (i64 i = instructions->len - 1; i >= 0; i--) {
+            SSAInstruction instruction = (*instructions)[i];
+
+            if (instruction.def == -1 || use_counts[instruction.def] > 0) {
+                continue;
+            }
+
+            for (i32 k = 0; k < ssa_operand_count(instruction.type); k++) {
+                use_counts[instruction.operands[k]] -= 1;
+            }
+
+            for (i64 j = i + 1; j < instructions->len; j++) {
+                (*instructions)[j - 1] = (*instructions)[j];
+            }
+
+            instructions->len -= 1;
+        }
+    }
+
+    return before - opt_ssa_instruction_count(function);
+}
+
+void opt_ssa_remove_edge(SSAFunction *function, i32 from, i32 to) {
+    SSABlock *block = &function->blocks[to];
+
+    i64 kept = 0;
+    for (i64 i = 0; i < block->predecessors.len; i++) {
+        if (block->predecessors[i] != from) {
+            block->predecessors[kept] = block->predecessors[i];
+            kept++;
+        }
+    }
+
+    block->predecessors.len = kept;
+
+    // a phi left with one incoming edge just forwards the other operand, folded away once
+    // the block itself is visited
+    for (SSAInstruction &instruction : block->instructions) {
+        if (instruction.type != SI_Phi) {
+            break;
+        }
+
+        i32 k = instruction.blocks[0] == from ? 1 : 0;
+
+        instruction.operands = {instruction.operands[k], instruction.operands[k]};
+        instruction.blocks = {instruction.blocks[k], instruction.blocks[k]};
+    }
+}
+
+i64 opt_ssa_instruction_count(SSAFunction *function) {
+    i64 count = 0;
+
+    for (SSABlock &block : function->blocks) {
+        count += block.instructions.len;
+    }
+
+    return count;
+}
+
+bool opt_fits_i32(i64 value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+void opt_record(OptStats *stats, string name, i64 removed) {
+    for (OptPassResult &pass : stats->passes) {
+        if (slice_memcmp(pass.name, name)) {
+            pass.removed += removed;
+            return;
+        }
+    }
+
+    append(&stats->passes, OptPassResult{.name = name, .removed = removed});
+}
+
+string opt_stats_to_string(Arena *arena, OptStats *stats) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 256);
+
+    // layout can add jumps where it moved a block out of the way
+    for (OptPassResult &pass : stats->passes) {
+        if (pass.removed < 0) {
+            fmt(&bytes, "{}: added {} instructions\n", pass.name, -pass.removed);
+        } else {
+            fmt(&bytes, "{}: removed {} instructions\n", pass.name, pass.removed);
+        }
+    }
+
+    return to_slice(&bytes);
+}
+
+// @regalloc
+enum Register {
+    R_RAX,
+    R_RCX,
+    R_RDX,
+    R_RBX,
+    R_RSP,
+    R_RBP,
+    R_RSI,
+    R_RDI,
+    R_R8,
+    R_R9,
+    R_R10,
+    R_R11,
+    R_R12,
+    R_R13,
+    R_R14,
+    R_R15,
+};
+
+string register_names[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+string byte_register_names[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+enum RegAllocMode {
+    RA_Stack,
+    RA_Linear,
+};
+
+enum LocationType {
+    LT_None,
+    LT_Register,
+    LT_Spill,
+};
+
+struct Location {
+    LocationType type;
+    i32 index;
+};
+
+struct Target {
+    array<Register, 4> parameters;
+
+    // values have to survive the putchar calls so only callee saved registers are handed out,
+    // rax is kept free as a scratch register for memory to memory moves
+    array<Register, 7> allocatable;
+    i32 allocatable_count;
+
+    // space the caller reserves above the return address for the callee to spill its arguments
+    i32 shadow_space;
+};
+
+// what MASM output is linked against with program.c
+Target target_win64 = {
+    .parameters = {R_RCX, R_RDX, R_R8, R_R9},
+    .allocatable = {R_RBX, R_RSI, R_RDI, R_R12, R_R13, R_R14, R_R15},
+    .allocatable_count = 7,
+    .shadow_space = 32,
+};
+
+// what the jit runs, rsi and rdi are argument registers here and not preserved across calls
+Target target_sysv = {
+    .parameters = {R_RDI, R_RSI, R_RDX, R_RCX},
+    .allocatable = {R_RBX, R_R12, R_R13, R_R14, R_R15},
+    .allocatable_count = 5,
+    .shadow_space = 0,
+};
+
+struct LiveInterval {
+    i32 vreg;
+    i32 start;
+    i32 end;
+};
+
+struct VirtualOperands {
+    i32 def;
+    array<i32, 2> uses;
+};
+
+struct RegAlloc {
+    // indexed by instruction
+    slice<VirtualOperands> operands;
+
+    // indexed by virtual register
+    slice<LiveInterval> intervals;
+    slice<Location> locations;
+
+    Target *target;
+    array<i32, 4> parameters;
+    i32 spill_count;
+    u32 used_registers;
+};
+
+RegAlloc regalloc_linear(Arena *arena, IR *ir, Target *target);
+RegAlloc regalloc_ssa(Arena *arena, SSAFunction *function, Target *target);
+
+i32 regalloc_new_vreg(DynamicArray<LiveInterval> *intervals, i32 position);
+i32 regalloc_pop(DynamicArray<i32> *stack, DynamicArray<LiveInterval> *intervals, i32 position);
+void regalloc_extend_slots(Arena *arena, IR *ir, RegAlloc *allocation, DynamicArray<LiveInterval> *intervals, DynamicArray<i32> slots);
+void regalloc_linear_scan(Arena *arena, RegAlloc *allocation);
+i32 regalloc_saved_register_count(RegAlloc *allocation);
+i32 regalloc_frame_size(RegAlloc *allocation);
+
+string regalloc_to_string(Arena *arena, RegAlloc *allocation);
+
+RegAlloc regalloc_linear(Arena *arena, IR *ir, Target *target) {
+    DynamicArray<VirtualOperands> operands = dynamic_array_create<VirtualOperands>(arena, ir->instructions.len);
+    DynamicArray<LiveInterval> intervals = dynamic_array_create<LiveInterval>(arena, ir->instructions.len);
+    DynamicArray<i32> stack = dynamic_array_create<i32>(arena, 16);
+
+    RegAlloc allocation = {
+        .target = target,
+        .parameters = {-1, -1, -1, -1},
+    };
+
+    // each let slot is one virtual register for its whole life, stores move into it. layout can put
+    // a block after the one it jumps back to, so the cfg decides where a slot is live further down
+    DynamicArray<i32> slots = dynamic_array_create<i32>(arena, ir->local_count);
+    for (i32 slot = 0; slot < ir->local_count; slot++) {
+        append(&slots, -1);
+    }
+
+    static const auto parameter_vreg = [](RegAlloc *allocation, DynamicArray<LiveInterval> *intervals, i32 slot) {
+        // parameters are copied out of their argument register in the prologue and every
+        // read of them shares that one register, so they are live from the start
+        i32 vreg = allocation->parameters[slot];
+        if (vreg == -1) {
+            vreg = regalloc_new_vreg(intervals, 0);
+            allocation->parameters[slot] = vreg;
+        }
+
+        return vreg;
+    };
+
+    static const auto slot_vreg = [](RegAlloc *allocation, DynamicArray<LiveInterval> *intervals, DynamicArray<i32> *slots, i32 slot, i32 position) {
+        if (slot < (i32) allocation->parameters.size()) {
+            return parameter_vreg(allocation, intervals, slot);
+        }
+
+        // the first mention in instruction order need not be the store that runs first
+        if ((*slots)[slot] == -1) {
+            (*slots)[slot] = regalloc_new_vreg(intervals, position);
+        }
+
+        return (*slots)[slot];
+    };
+
+    // replay the operand stack at compile time, every stack slot becomes a virtual register
+    for (i32 i = 0; i < ir->instructions.len; i++) {
+        Instruction instruction = ir->instructions[i];
+        VirtualOperands ops = {.def = -1, .uses = {-1, -1}};
+
+        switch (instruction.type) {
+            case IT_StartFunction:
+            case IT_EndFunction:
+            case IT_Jump:
+            case IT_Label:
+                break;
+            case IT_Push: {
+                ops.def = regalloc_new_vreg(&intervals, i);
+                append(&stack, ops.def);
+            } break;
+            case IT_Local: {
+                append(&stack, slot_vreg(&allocation, &intervals, &slots, instruction.value, i));
+            } break;
+            case IT_Store: {
+                ops.uses[0] = regalloc_pop(&stack, &intervals, i);
+                ops.def = slot_vreg(&allocation, &intervals, &slots, instruction.value, i);
+
+                if (intervals[ops.def].end < i) {
+                    intervals[ops.def].end = i;
+                }
+            } break;
+            case IT_Add:
+            case IT_CompareEqual: {
+                ops.uses[1] = regalloc_pop(&stack, &intervals, i);
+                ops.uses[0] = regalloc_pop(&stack, &intervals, i);
+                ops.def = regalloc_new_vreg(&intervals, i);
+                append(&stack, ops.def);
+            } break;
+            case IT_Return:
+            case IT_IfZero:
+            case IT_IfNotZero:
+            case IT_Print: {
+                ops.uses[0] = regalloc_pop(&stack, &intervals, i);
+            } break;
+            default:
+                Unreachable("unsupported instruction type in regalloc_linear");
+        }
+
+        append(&operands, ops);
+    }
+
+    regalloc_extend_slots(arena, ir, &allocation, &intervals, slots);
+
+    allocation.operands = to_slice(&operands);
+    allocation.intervals = to_slice(&intervals);
+
+    regalloc_linear_scan(arena, &allocation);
+
+    return allocation;
+}
+
+i32 regalloc_new_vreg(DynamicArray<LiveInterval> *intervals, i32 position) {
+    i32 vreg = (i32) intervals->len;
+    append(intervals, LiveInterval{.vreg = vreg, .start = position, .end = position});
+
+    return vreg;
+}
+
+i32 regalloc_pop(DynamicArray<i32> *stack, DynamicArray<LiveInterval> *intervals, i32 position) {
+    Assertf(stack->len > 0, "operand stack underflow in regalloc_linear");
+
+    i32 vreg = (*stack)[stack->len - 1];
+    stack->len -= 1;
+
+    LiveInterval *interval = &(*intervals)[vreg];
+    if (interval->end < position) {
+        interval->end = position;
+    }
+
+    return vreg;
+}
+
+// a slot live into or out of a block is live over the whole of it. values on the operand stack never
+// cross a block, so the slots are all that needs the cfg
+void regalloc_extend_slots(Arena *arena, IR *ir, RegAlloc *allocation, DynamicArray<LiveInterval> *intervals, DynamicArray<i32> slots) {
+    CFG cfg = ir_build_cfg(arena, ir);
+
+    i32 slot_count = ir->local_count;
+    i64 count = cfg.blocks.len;
+
+    // live_in[b * slot_count + slot]
+    DynamicArray<bool> live_in = dynamic_array_create<bool>(arena, count * slot_count);
+    DynamicArray<bool> live_out = dynamic_array_create<bool>(arena, count * slot_count);
+    DynamicArray<bool> live = dynamic_array_create<bool>(arena, slot_count);
+
+    for (i64 i = 0; i < count * slot_count; i++) {
+        append(&live_in, false);
+        append(&live_out, false);
+    }
+
+    for (i32 slot = 0; slot < slot_count; slot++) {
+        append(&live, false);
+    }
+
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (i64 b = count - 1; b >= 0; b--) {
+            IRBlock &block = cfg.blocks[b];
+
+            for (i32 slot = 0; slot < slot_count; slot++) {
+                bool out = false;
+                for (i32 successor : block.successors) {
+                    out = out || live_in[successor * slot_count + slot];
+                }
+
+                live_out[b * slot_count + slot] = out;
+                live[slot] = out;
+            }
+
+            for (i32 i = block.end - 1; i >= block.start; i--) {
+                Instruction instruction = ir->instructions[i];
+
+                if (instruction.type == IT_Store) {
+                    live[instruction.value] = false;
+                } else if (instruction.type == IT_Local) {
+                    live[instruction.value] = true;
+                }
+            }
+
+            for (i32 slot = 0; slot < slot_count; slot++) {
+                if (live_in[b * slot_count + slot] != live[slot]) {
+                    live_in[b * slot_count + slot] = live[slot];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    static const auto cover = [](LiveInterval *interval, i32 position) {
+        if (interval->start > position) {
+            interval->start = position;
+        }
+
+        if (interval->end < position) {
+            interval->end = position;
+        }
+    };
+
+    for (i64 b = 0; b < count; b++) {
+        IRBlock &block = cfg.blocks[b];
+
+        for (i32 slot = 0; slot < slot_count; slot++) {
+            i32 vreg = slot < (i32) allocation->parameters.size() ? allocation->parameters[slot] : slots[slot];
+
+            if (vreg == -1) {
+                continue;
+            }
+
+            if (live_in[b * slot_count + slot]) {
+                cover(&(*intervals)[vreg], block.start);
+            }
+
+            if (live_out[b * slot_count + slot]) {
+                cover(&(*intervals)[vreg], block.end - 1);
+            }
+        }
+    }
+}
+
+void regalloc_linear_scan(Arena *arena, RegAlloc *allocation) {
+    static const auto compare_start = [](const void *a, const void *b) -> int {
+        const LiveInterval *left = (const LiveInterval *) a;
+        const LiveInterval *right = (const LiveInterval *) b;
+
+        if (left->start != right->start) {
+            return left->start - right->start;
+        }
+
+        return left->vreg - right->vreg;
+    };
+
+    slice<LiveInterval> sorted = slice_clone(arena, allocation->intervals);
+    qsort(sorted.ptr, sorted.len, sizeof(LiveInterval), compare_start);
+
+    DynamicArray<Location> locations = dynamic_array_create<Location>(arena, sorted.len);
+    for (i32 i = 0; i < sorted.len; i++) {
+        append(&locations, Location{.type = LT_None});
+    }
+
+    // active intervals ordered by increasing end
+    i32 register_count = allocation->target->allocatable_count;
+
+    DynamicArray<LiveInterval> active = dynamic_array_create<LiveInterval>(arena, register_count);
+    u32 free_registers = (1u << register_count) - 1;
+
+    static const auto insert_active = [](DynamicArray<LiveInterval> *active, LiveInterval interval) {
+        append(active, interval);
+
+        i64 j = active->len - 1;
+        while (j > 0 && (*active)[j - 1].end > interval.end) {
+            (*active)[j] = (*active)[j - 1];
+            j--;
+        }
+
+        (*active)[j] = interval;
+    };
+
+    for (LiveInterval current : sorted) {
+        // never defined, e.g. a parameter that was dropped because nothing reads it
+        if (current.start < 0) {
+            continue;
+        }
+
+        // expire intervals that ended strictly before this one starts, an instruction never
+        // writes its result into the register of one of its own operands
+        i64 expired = 0;
+        while (expired < active.len && active[expired].end < current.start) {
+            free_registers |= 1u << locations[active[expired].vreg].index;
+            expired++;
+        }
+
+        for (i64 j = expired; j < active.len; j++) {
+            active[j - expired] = active[j];
+        }
+        active.len -= expired;
+
+        if (active.len == register_count) {
+            // spill whichever interval lives the longest
+            LiveInterval last = active[active.len - 1];
+
+            if (last.end > current.end) {
+                locations[current.vreg] = locations[last.vreg];
+                locations[last.vreg] = Location{.type = LT_Spill, .index = allocation->spill_count};
+                allocation->spill_count += 1;
+
+                active.len -= 1;
+                insert_active(&active, current);
+            } else {
+                locations[current.vreg] = Location{.type = LT_Spill, .index = allocation->spill_count};
+                allocation->spill_count += 1;
+            }
+
+            continue;
+        }
+
+        i32 reg = 0;
+        while ((free_registers & (1u << reg)) == 0) {
+            reg++;
+        }
+
+        free_registers &= ~(1u << reg);
+        allocation->used_registers |= 1u << reg;
+
+        locations[current.vreg] = Location{.type = LT_Register, .index = reg};
+        insert_active(&active, current);
+    }
+
+    allocation->locations = to_slice(&locations);
+}
+
+RegAlloc regalloc_ssa(Arena *arena, SSAFunction *function, Target *target) {
+    DynamicArray<LiveInterval> intervals = dynamic_array_create<LiveInterval>(arena, function->vreg_count);
+    for (i32 i = 0; i < function->vreg_count; i++) {
+        append(&intervals, LiveInterval{.vreg = i, .start = -1, .end = -1});
+    }
+
+    // position of the terminator of every block, phi operands are read there
+    DynamicArray<i32> block_ends = dynamic_array_create<i32>(arena, function->blocks.len);
+
+    // blocks are laid out in order and every edge points forward, so a single linear
+    // numbering gives intervals that cover every path between a def and its uses
+    i32 position = 0;
+
+    for (SSABlock &block : function->blocks) {
+        for (SSAInstruction &instruction : block.instructions) {
+            if (instruction.def != -1 && instruction.type != SI_Phi) {
+                intervals[instruction.def].start = position;
+                intervals[instruction.def].end = position;
+            }
+
+            if (instruction.type != SI_Phi) {
+                for (i32 i = 0; i < ssa_operand_count(instruction.type); i++) {
+                    LiveInterval *interval = &intervals[instruction.operands[i]];
+                    if (interval->end < position) {
+                        interval->end = position;
+                    }
+                }
+            }
+
+            position++;
+        }
+
+        append(&block_ends, position - 1);
+    }
+
+    // a phi is written by the moves at the end of each predecessor
+    for (SSABlock &block : function->blocks) {
+        for (SSAInstruction &instruction : block.instructions) {
+            if (instruction.type != SI_Phi) {
+                continue;
+            }
+
+            LiveInterval *interval = &intervals[instruction.def];
+
+            for (i32 k = 0; k < 2; k++) {
+                i32 end = block_ends[instruction.blocks[k]];
+
+                if (interval->start == -1 || end < interval->start) {
+                    interval->start = end;
+                }
+
+                LiveInterval *operand = &intervals[instruction.operands[k]];
+                if (operand->end < end) {
+                    operand->end = end;
+                }
+            }
+
+            if (interval->end < interval->start) {
+                interval->end = interval->start;
+            }
+        }
+    }
+
+    RegAlloc allocation = {
+        .intervals = to_slice(&intervals),
+        .target = target,
+        .parameters = {-1, -1, -1, -1},
+    };
+
+    regalloc_linear_scan(arena, &allocation);
+
+    return allocation;
+}
+
+i32 regalloc_saved_register_count(RegAlloc *allocation) {
+    i32 count = 0;
+
+    for (i32 i = 0; i < allocation->target->allocatable_count; i++) {
+        if (allocation->used_registers & (1u << i)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+i32 regalloc_frame_size(RegAlloc *allocation) {
+    // spill slots plus the shadow space for putchar, keeping rsp 16 byte aligned at the call
+    i32 saved = regalloc_saved_register_count(allocation);
+    i32 size = allocation->spill_count * 8 + allocation->target->shadow_space;
+
+    if ((saved * 8 + size) % 16 != 0) {
+        size += 8;
+    }
+
+    return size;
+}
+
+string regalloc_to_string(Arena *arena, RegAlloc *allocation) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+
+    for (LiveInterval interval : allocation->intervals) {
+        Location location = allocation->locations[interval.vreg];
+
+        fmt(&bytes, "v{} [{}, {}] ", interval.vreg, interval.start, interval.end);
+
+        switch (location.type) {
+            case LT_Register: {
+                fmt(&bytes, "{}\n", register_names[allocation->target->allocatable[location.index]]);
+            } break;
+            case LT_Spill: {
+                fmt(&bytes, "spill {}\n", location.index);
+            } break;
+            case LT_None: {
+                fmt(&bytes, "unused\n");
+            } break;
+            default:
+                Unreachable("unsupported location type in regalloc_to_string");
+        }
+    }
+
+    return to_slice(&bytes);
+}
+
+// @asm
+enum AsmOp {
+    AO_None,
+    AO_Comment,
+    AO_Proc,
+    AO_Endp,
+    AO_Label,
+    AO_Push,
+    AO_Pop,
+    AO_Mov,
+    AO_Movzx,
+    AO_Lea,
+    AO_Add,
+    AO_Sub,
+    AO_Xor,
+    AO_Cmp,
+    AO_Setz,
+    AO_Call,
+    AO_Ret,
+    AO_Jmp,
+    AO_Je,
+    AO_Jne,
+};
+
+enum OperandType {
+    OT_None,
+    OT_Register,
+    OT_Immediate,
+    OT_Memory,
+
+    // reg + index + value, only lea takes it
+    OT_Indexed,
+
+    OT_Label,
+};
+
+struct AsmOperand {
+    OperandType type;
+    Register reg;
+
+    // immediate value, or the displacement from reg for memory operands
+    i64 value;
+
+    // OT_Indexed only
+    Register index;
+
+    // labels and external symbols
+    string name;
+};
+
+struct AsmInstruction {
+    AsmOp op;
+    array<AsmOperand, 2> operands;
+};
+
+// how the stack ir is lowered when it is not register allocated. SM_Stack keeps every value on the
+// machine stack like the ir does, SM_Tree reads each statement back into its expression tree and covers
+// it with the largest x86 forms that fit, immediates, memory operands, lea and adds in place
+enum SelectMode {
+    SM_Stack,
+    SM_Tree,
+};
+
+// the operands of one stack ir instruction as ir positions, -1 when it has fewer
+struct TreeNode {
+    i32 left;
+    i32 right;
+};
+
+struct TreeSelector {
+    DynamicArray<AsmInstruction> code;
+    slice<Instruction> instructions;
+    DynamicArray<TreeNode> nodes;
+
+    // leaves of the add chains being selected, a nested chain goes after its parent's and is cut off again
+    DynamicArray<i32> terms;
+};
+
+// caller saved under both conventions and never an argument the prologue still needs, the parameters
+// are in their home slots by the time any expression runs
+const u32 TREE_SCRATCH_REGISTERS = (1u << R_RAX) | (1u << R_RCX) | (1u << R_RDX) | (1u << R_R8) | (1u << R_R9) | (1u << R_R10) | (1u << R_R11);
+
+slice<AsmInstruction> asmgen(Arena *arena, IR *ir, Target *target);
+slice<AsmInstruction> asmgen_tree(Arena *arena, IR *ir, Target *target);
+slice<AsmInstruction> asmgen_linear(Arena *arena, IR *ir, RegAlloc *allocation);
+slice<AsmInstruction> asmgen_ssa(Arena *arena, SSAFunction *function, RegAlloc *allocation);
+
+void asmgen_ssa_phi_moves(DynamicArray<AsmInstruction> *code, SSAFunction *function, RegAlloc *allocation, i32 from, i32 to);
+string asmgen_block_label(Arena *arena, i32 block);
+
+void asmgen_register_prologue(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, string name);
+void asmgen_register_parameter(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 index);
+void asmgen_register_constant(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 value);
+void asmgen_register_add(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 left, i32 right);
+void asmgen_register_compare_equal(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 left, i32 right);
+void asmgen_register_compare(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 left, i32 right);
+void asmgen_register_branch(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value, AsmOp jump, string label);
+void asmgen_register_print(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value);
+void asmgen_register_return(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value);
+void asmgen_register_epilogue(DynamicArray<AsmInstruction> *code, RegAlloc *allocation);
+void asmgen_register_move(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 value);
+AsmOperand asmgen_location(RegAlloc *allocation, i32 vreg);
+
+void asmgen_tree_value(TreeSelector *selector, i32 node, Register destination, u32 free);
+void asmgen_tree_compare(TreeSelector *selector, i32 node, Register destination, u32 free);
+void asmgen_tree_chain(TreeSelector *selector, i64 first, i64 last, Register destination, u32 free);
+void asmgen_tree_store(TreeSelector *selector, i32 node, i32 slot);
+void asmgen_tree_terms(TreeSelector *selector, i32 node);
+AsmOperand asmgen_tree_operand(TreeSelector *selector, i32 node, Register destination, u32 free, bool *spilled);
+i32 asmgen_tree_rank(TreeSelector *selector, i32 node);
+Register asmgen_tree_scratch(u32 free);
+AsmOperand asmgen_slot(i32 slot);
+
+void asm_emit(DynamicArray<AsmInstruction> *code, AsmOp op, AsmOperand a = {}, AsmOperand b = {});
+AsmOperand asm_register(Register reg);
+AsmOperand asm_immediate(i64 value);
+AsmOperand asm_memory(Register base, i64 displacement);
+AsmOperand asm_indexed(Register base, Register index, i64 displacement);
+AsmOperand asm_label(string name);
+bool asm_operand_equals(AsmOperand a, AsmOperand b);
+bool asm_operand_reads(AsmOperand operand, Register reg);
+i64 asm_instruction_count(slice<AsmInstruction> code);
+
+string asm_to_string(Arena *arena, slice<AsmInstruction> code);
+void asm_write(Writer *writer, slice<AsmInstruction> code);
+void asm_write_header(Writer *writer);
+void asm_write_code(Writer *writer, slice<AsmInstruction> code);
+void asm_write_footer(Writer *writer);
+void asm_operand_to_string(DynamicArray<u8> *bytes, AsmOperand operand, bool sized);
+string asm_op_to_string(AsmOp op);
+
+slice<AsmInstruction> asmgen(Arena *arena, IR *ir, Target *target) {
+    DynamicArray<AsmInstruction> code = dynamic_array_create<AsmInstruction>(arena, ir->instructions.len * 3 + 16);
+
+    slice<Instruction> instructions = to_slice(&ir->instructions);
+
+    // number of 8 byte slots pushed below rbp, needed to align rsp for putchar. r10 and rax
+    // are the scratch registers as both are free to clobber under either calling convention
+    i32 depth = 0;
+
+    for (i32 i = 0; i < instructions.len; i++) {
+        Instruction instruction = instructions[i];
+
+        asm_emit(&code, AO_Comment, asm_immediate(i));
+
+        switch (instruction.type) {
+            case IT_StartFunction: {
+                asm_emit(&code, AO_Proc, asm_label(instruction.string));
+                asm_emit(&code, AO_Push, asm_register(R_RBP));
+                asm_emit(&code, AO_Mov, asm_register(R_RBP), asm_register(R_RSP));
+
+                // argument registers do not survive putchar so every parameter gets a home slot,
+                // the let slots follow them
+                for (i32 p = 0; p < (i32) target->parameters.size(); p++) {
+                    asm_emit(&code, AO_Push, asm_register(target->parameters[p]));
+                }
+
+                i32 lets = ir->local_count - (i32) target->parameters.size();
+                if (lets > 0) {
+                    asm_emit(&code, AO_Sub, asm_register(R_RSP), asm_immediate(lets * 8));
+                }
+
+                depth = ir->local_count;
+            } break;
+            case IT_EndFunction: {
+                if (ir_falls_off_end(instructions, i)) {
+                    asm_emit(&code, AO_Xor, asm_register(R_RAX), asm_register(R_RAX));
+                    asm_emit(&code, AO_Mov, asm_register(R_RSP), asm_register(R_RBP));
+                    asm_emit(&code, AO_Pop, asm_register(R_RBP));
+                    asm_emit(&code, AO_Ret);
+                }
+
+                asm_emit(&code, AO_Endp, asm_label(instruction.string));
+            } break;
+            case IT_Push: {
+                asm_emit(&code, AO_Push, asm_immediate(instruction.value));
+                depth += 1;
+            } break;
+            case IT_Add: {
+                asm_emit(&code, AO_Pop, asm_register(R_R10));
+                asm_emit(&code, AO_Pop, asm_register(R_RAX));
+                asm_emit(&code, AO_Add, asm_register(R_RAX), asm_register(R_R10));
+                asm_emit(&code, AO_Push, asm_register(R_RAX));
+                depth -= 1;
+            } break;
+            case IT_Local: {
+                asm_emit(&code, AO_Push, asm_memory(R_RBP, -(instruction.value + 1) * 8));
+                depth += 1;
+            } break;
+            case IT_Store: {
+                asm_emit(&code, AO_Pop, asm_register(R_R10));
+                asm_emit(&code, AO_Mov, asm_memory(R_RBP, -(instruction.value + 1) * 8), asm_register(R_R10));
+                depth -= 1;
+            } break;
+            case IT_Return: {
+                asm_emit(&code, AO_Pop, asm_register(R_RAX));
+                asm_emit(&code, AO_Mov, asm_register(R_RSP), asm_register(R_RBP));
+                asm_emit(&code, AO_Pop, asm_register(R_RBP));
+                asm_emit(&code, AO_Ret);
+                depth -= 1;
+            } break;
+            case IT_IfZero:
+            case IT_IfNotZero: {
+                asm_emit(&code, AO_Pop, asm_register(R_R10));
+                asm_emit(&code, AO_Cmp, asm_register(R_R10), asm_immediate(0));
+                asm_emit(&code, instruction.type == IT_IfZero ? AO_Je : AO_Jne, asm_label(asmgen_block_label(arena, instruction.value)));
+                depth -= 1;
+            } break;
+            case IT_Jump: {
+                asm_emit(&code, AO_Jmp, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_Label: {
+                asm_emit(&code, AO_Label, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_CompareEqual: {
+                asm_emit(&code, AO_Pop, asm_register(R_RAX));
+                asm_emit(&code, AO_Pop, asm_register(R_R10));
+                asm_emit(&code, AO_Cmp, asm_register(R_RAX), asm_register(R_R10));
+
+                // a compare that only decides a branch branches on the flags, an IfZero jumps when it is false
+                if (i + 1 < instructions.len && ir_is_branch(instructions[i + 1].type)) {
+                    Instruction branch = instructions[i + 1];
+
+                    asm_emit(&code, branch.type == IT_IfZero ? AO_Jne : AO_Je, asm_label(asmgen_block_label(arena, branch.value)));
+                    depth -= 2;
+                    i++;
+
+                    continue;
+                }
+
+                asm_emit(&code, AO_Mov, asm_register(R_RAX), asm_immediate(0));
+                asm_emit(&code, AO_Setz, asm_register(R_RAX));
+                asm_emit(&code, AO_Push, asm_register(R_RAX));
+                depth -= 1;
+            } break;
+            case IT_Print: {
+                Register argument = target->parameters[0];
+
+                asm_emit(&code, AO_Pop, asm_register(argument));
+                depth -= 1;
+
+                // rsp is 16 byte aligned right after rbp is pushed
+                i32 padding = target->shadow_space + (depth % 2 == 0 ? 0 : 8);
+
+                if (padding > 0) {
+                    asm_emit(&code, AO_Sub, asm_register(R_RSP), asm_immediate(padding));
+                }
+
+                asm_emit(&code, AO_Call, asm_label("putchar"));
+                asm_emit(&code, AO_Mov, asm_register(argument), asm_immediate(10));
+                asm_emit(&code, AO_Call, asm_label("putchar"));
+
+                if (padding > 0) {
+                    asm_emit(&code, AO_Add, asm_register(R_RSP), asm_immediate(padding));
+                }
+            } break;
+            default:
+                Unreachable("unsupported instruction type in asmgen");
+        }
+    }
+
+    return to_slice(&code);
+}
+
+slice<AsmInstruction> asmgen_tree(Arena *arena, IR *ir, Target *target) {
+    slice<Instruction> instructions = to_slice(&ir->instructions);
+
+    TreeSelector selector = {
+        .code = dynamic_array_create<AsmInstruction>(arena, instructions.len * 2 + 16),
+        .instructions = instructions,
+        .nodes = dynamic_array_create<TreeNode>(arena, instructions.len + 1),
+        .terms = dynamic_array_create<i32>(arena, 64),
+    };
+
+    // the operands of every op are whatever is on top of the stack when it runs, and every statement
+    // leaves the stack empty, so one pass rebuilds the trees
+    DynamicArray<i32> stack = dynamic_array_create<i32>(arena, 64);
+
+    for (i32 i = 0; i < instructions.len; i++) {
+        TreeNode node = {.left = -1, .right = -1};
+
+        switch (instructions[i].type) {
+            case IT_Push:
+            case IT_Local: {
+                append(&stack, i);
+            } break;
+            case IT_Add:
+            case IT_CompareEqual: {
+                Assertf(stack.len >= 2, "binary op without two operands in asmgen_tree");
+
+                node.left = stack[stack.len - 2];
+                node.right = stack[stack.len - 1];
+
+                stack.len -= 2;
+                append(&stack, i);
+            } break;
+            case IT_Store:
+            case IT_Return:
+            case IT_IfZero:
+            case IT_IfNotZero:
+            case IT_Print: {
+                Assertf(stack.len == 1, "statement does not take exactly one value in asmgen_tree");
+
+                node.left = stack[0];
+                stack.len = 0;
+            } break;
+            default: {
+                Assertf(stack.len == 0, "value left on the stack across a statement in asmgen_tree");
+            } break;
+        }
+
+        append(&selector.nodes, node);
+    }
+
+    DynamicArray<AsmInstruction> *code = &selector.code;
+
+    for (i32 i = 0; i < instructions.len; i++) {
+        Instruction instruction = instructions[i];
+        i32 value = selector.nodes[i].left;
+
+        // expressions are selected as a whole with the statement that uses them
+        if (instruction.type == IT_Push || instruction.type == IT_Local || instruction.type == IT_Add || instruction.type == IT_CompareEqual) {
+            continue;
+        }
+
+        asm_emit(code, AO_Comment, asm_immediate(i));
+
+        switch (instruction.type) {
+            case IT_StartFunction: {
+                asm_emit(code, AO_Proc, asm_label(instruction.string));
+                asm_emit(code, AO_Push, asm_register(R_RBP));
+                asm_emit(code, AO_Mov, asm_register(R_RBP), asm_register(R_RSP));
+
+                // the same frame as the stack lowering, every parameter gets a home slot
+                for (i32 p = 0; p < (i32) target->parameters.size(); p++) {
+                    asm_emit(code, AO_Push, asm_register(target->parameters[p]));
+                }
+
+                i32 lets = ir->local_count - (i32) target->parameters.size();
+                if (lets > 0) {
+                    asm_emit(code, AO_Sub, asm_register(R_RSP), asm_immediate(lets * 8));
+                }
+            } break;
+            case IT_EndFunction: {
+                if (ir_falls_off_end(instructions, i)) {
+                    asm_emit(code, AO_Xor, asm_register(R_RAX), asm_register(R_RAX));
+                    asm_emit(code, AO_Mov, asm_register(R_RSP), asm_register(R_RBP));
+                    asm_emit(code, AO_Pop, asm_register(R_RBP));
+                    asm_emit(code, AO_Ret);
+                }
+
+                asm_emit(code, AO_Endp, asm_label(instruction.string));
+            } break;
+            case IT_Store: {
+                asmgen_tree_store(&selector, value, instruction.value);
+            } break;
+            case IT_Return: {
+                asmgen_tree_value(&selector, value, R_RAX, TREE_SCRATCH_REGISTERS & ~(1u << R_RAX));
+
+                asm_emit(code, AO_Mov, asm_register(R_RSP), asm_register(R_RBP));
+                asm_emit(code, AO_Pop, asm_register(R_RBP));
+                asm_emit(code, AO_Ret);
+            } break;
+            case IT_IfZero:
+            case IT_IfNotZero: {
+                Instruction condition = instructions[value];
+                AsmOperand label = asm_label(asmgen_block_label(arena, instruction.value));
+                bool if_zero = instruction.type == IT_IfZero;
+
+                // a compare condition is never made into a 0 or 1, the branch goes on its flags
+                if (condition.type == IT_CompareEqual) {
+                    asmgen_tree_compare(&selector, value, R_RAX, TREE_SCRATCH_REGISTERS & ~(1u << R_RAX));
+                    asm_emit(code, if_zero ? AO_Jne : AO_Je, label);
+                    break;
+                }
+
+                if (condition.type == IT_Local) {
+                    asm_emit(code, AO_Cmp, asmgen_slot(condition.value), asm_immediate(0));
+                } else {
+                    asmgen_tree_value(&selector, value, R_RAX, TREE_SCRATCH_REGISTERS & ~(1u << R_RAX));
+                    asm_emit(code, AO_Cmp, asm_register(R_RAX), asm_immediate(0));
+                }
+
+                asm_emit(code, if_zero ? AO_Je : AO_Jne, label);
+            } break;
+            case IT_Jump: {
+                asm_emit(code, AO_Jmp, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_Label: {
+                asm_emit(code, AO_Label, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_Print: {
+                Register argument = target->parameters[0];
+
+                asmgen_tree_value(&selector, value, argument, TREE_SCRATCH_REGISTERS & ~(1u << argument));
+
+                // expressions leave rsp where it was, so only the frame is below rbp
+                i32 padding = target->shadow_space + (ir->local_count % 2 == 0 ? 0 : 8);
+
+                if (padding > 0) {
+                    asm_emit(code, AO_Sub, asm_register(R_RSP), asm_immediate(padding));
+                }
+
+                asm_emit(code, AO_Call, asm_label("putchar"));
+                asm_emit(code, AO_Mov, asm_register(argument), asm_immediate(10));
+                asm_emit(code, AO_Call, asm_label("putchar"));
+
+                if (padding > 0) {
+                    asm_emit(code, AO_Add, asm_register(R_RSP), asm_immediate(padding));
+                }
+            } break;
+            default:
+                Unreachable("unsupported instruction type in asmgen_tree");
+        }
+    }
+
+    return to_slice(code);
+}
+
+// evaluates the tree at node into destination, free are the scratch registers it may also clobber
+void asmgen_tree_value(TreeSelector *selector, i32 node, Register destination, u32 free) {
+    DynamicArray<AsmInstruction> *code = &selector->code;
+    Instruction instruction = selector->instructions[node];
+
+    switch (instruction.type) {
+        case IT_Push: {
+            asm_emit(code, AO_Mov, asm_register(destination), asm_immediate(instruction.value));
+        } break;
+        case IT_Local: {
+            asm_emit(code, AO_Mov, asm_register(destination), asmgen_slot(instruction.value));
+        } break;
+        case IT_Add: {
+            i64 first = selector->terms.len;
+            asmgen_tree_terms(selector, node);
+
+            asmgen_tree_chain(selector, first, selector->terms.len, destination, free);
+            selector->terms.len = first;
+        } break;
+        case IT_CompareEqual: {
+            asmgen_tree_compare(selector, node, destination, free);
+
+            asm_emit(code, AO_Setz, asm_register(destination));
+            asm_emit(code, AO_Movzx, asm_register(destination), asm_register(destination));
+        } break;
+        default:
+            Unreachable("unsupported instruction type in asmgen_tree_value");
+    }
+}
+
+// sets the flags for the compare at node and nothing else, destination is clobbered on the way
+void asmgen_tree_compare(TreeSelector *selector, i32 node, Register destination, u32 free) {
+    DynamicArray<AsmInstruction> *code = &selector->code;
+
+    i32 left = selector->nodes[node].left;
+    i32 right = selector->nodes[node].right;
+
+    // cmp takes an immediate or memory operand on the right, equality does not care about the order
+    if (asmgen_tree_rank(selector, left) < asmgen_tree_rank(selector, right)) {
+        i32 swap = left;
+        left = right;
+        right = swap;
+    }
+
+    // a local against a constant needs no register at all
+    if (selector->instructions[left].type == IT_Local && selector->instructions[right].type == IT_Push) {
+        asm_emit(code, AO_Cmp, asmgen_slot(selector->instructions[left].value), asm_immediate(selector->instructions[right].value));
+        return;
+    }
+
+    asmgen_tree_value(selector, left, destination, free);
+
+    bool spilled = false;
+    AsmOperand operand = asmgen_tree_operand(selector, right, destination, free, &spilled);
+    asm_emit(code, AO_Cmp, asm_register(destination), operand);
+
+    // lea leaves the flags alone
+    if (spilled) {
+        asm_emit(code, AO_Lea, asm_register(R_RSP), asm_memory(R_RSP, 8));
+    }
+}
+
+// the sum of terms first to last, entries of -1 were taken out by the caller. the constants fold into
+// one immediate, values that need a register are combined first while nothing else is live and the last
+// of them takes the constant along in a lea, locals are added straight from their slots
+void asmgen_tree_chain(TreeSelector *selector, i64 first, i64 last, Register destination, u32 free) {
+    DynamicArray<AsmInstruction> *code = &selector->code;
+
+    i64 constant = 0;
+    i32 constant_count = 0;
+    i32 register_count = 0;
+
+    for (i64 k = first; k < last; k++) {
+        i32 term = selector->terms[k];
+
+        if (term == -1) {
+            continue;
+        }
+
+        InstructionType type = selector->instructions[term].type;
+
+        if (type == IT_Push) {
+            constant += selector->instructions[term].value;
+            constant_count++;
+        } else if (type != IT_Local) {
+            register_count++;
+        }
+    }
+
+    bool folded = opt_fits_i32(constant);
+    bool loaded = false;
+
+    for (i64 k = first; k < last; k++) {
+        i32 term = selector->terms[k];
+
+        if (term == -1 || selector->instructions[term].type == IT_Push || selector->instructions[term].type == IT_Local) {
+            continue;
+        }
+
+        register_count--;
+
+        if (!loaded) {
+            asmgen_tree_value(selector, term, destination, free);
+            loaded = true;
+            continue;
+        }
+
+        bool spilled = false;
+        AsmOperand operand = asmgen_tree_operand(selector, term, destination, free, &spilled);
+
+        if (register_count == 0 && operand.type == OT_Register && folded && constant != 0) {
+            asm_emit(code, AO_Lea, asm_register(destination), asm_indexed(destination, operand.reg, constant));
+            constant = 0;
+        } else {
+            asm_emit(code, AO_Add, asm_register(destination), operand);
+        }
+
+        if (spilled) {
+            asm_emit(code, AO_Add, asm_register(R_RSP), asm_immediate(8));
+        }
+    }
+
+    for (i64 k = first; k < last; k++) {
+        i32 term = selector->terms[k];
+
+        if (term == -1 || selector->instructions[term].type != IT_Local) {
+            continue;
+        }
+
+        AsmOp op = loaded ? AO_Add : AO_Mov;
+        asm_emit(code, op, asm_register(destination), asmgen_slot(selector->instructions[term].value));
+        loaded = true;
+    }
+
+    if (constant_count == 0 || (loaded && constant == 0)) {
+        return;
+    }
+
+    if (!loaded) {
+        asm_emit(code, AO_Mov, asm_register(destination), asm_immediate(constant));
+        return;
+    }
+
+    if (folded) {
+        asm_emit(code, AO_Add, asm_register(destination), asm_immediate(constant));
+        return;
+    }
+
+    // the sum would not fit an imm32, each constant does
+    for (i64 k = first; k < last; k++) {
+        i32 term = selector->terms[k];
+
+        if (term != -1 && selector->instructions[term].type == IT_Push) {
+            asm_emit(code, AO_Add, asm_register(destination), asm_immediate(selector->instructions[term].value));
+        }
+    }
+}
+
+// a store of x + y to x adds y to the slot in place, a constant is stored as an immediate
+void asmgen_tree_store(TreeSelector *selector, i32 node, i32 slot) {
+    DynamicArray<AsmInstruction> *code = &selector->code;
+    Instruction instruction = selector->instructions[node];
+
+    u32 free = TREE_SCRATCH_REGISTERS & ~(1u << R_RAX);
+
+    if (instruction.type == IT_Push) {
+        asm_emit(code, AO_Mov, asmgen_slot(slot), asm_immediate(instruction.value));
+        return;
+    }
+
+    if (instruction.type != IT_Add) {
+        asmgen_tree_value(selector, node, R_RAX, free);
+        asm_emit(code, AO_Mov, asmgen_slot(slot), asm_register(R_RAX));
+        return;
+    }
+
+    i64 first = selector->terms.len;
+    asmgen_tree_terms(selector, node);
+    i64 last = selector->terms.len;
+
+    i64 self = -1;
+    for (i64 k = first; k < last; k++) {
+        Instruction term = selector->instructions[selector->terms[k]];
+
+        if (term.type == IT_Local && term.value == slot) {
+            self = k;
+            break;
+        }
+    }
+
+    if (self == -1) {
+        asmgen_tree_chain(selector, first, last, R_RAX, free);
+        asm_emit(code, AO_Mov, asmgen_slot(slot), asm_register(R_RAX));
+
+        selector->terms.len = first;
+        return;
+    }
+
+    selector->terms[self] = -1;
+
+    i64 constant = 0;
+    bool constant_only = true;
+
+    for (i64 k = first; k < last; k++) {
+        i32 term = selector->terms[k];
+
+        if (term == -1) {
+            continue;
+        }
+
+        if (selector->instructions[term].type != IT_Push) {
+            constant_only = false;
+            break;
+        }
+
+        constant += selector->instructions[term].value;
+    }
+
+    if (constant_only && opt_fits_i32(constant)) {
+        if (constant != 0) {
+            asm_emit(code, AO_Add, asmgen_slot(slot), asm_immediate(constant));
+        }
+    } else {
+        asmgen_tree_chain(selector, first, last, R_RAX, free);
+        asm_emit(code, AO_Add, asmgen_slot(slot), asm_register(R_RAX));
+    }
+
+    selector->terms.len = first;
+}
+
+// the leaves of the add tree at node, anything that is not an add is a leaf here
+void asmgen_tree_terms(TreeSelector *selector, i32 node) {
+    if (selector->instructions[node].type != IT_Add) {
+        append(&selector->terms, node);
+        return;
+    }
+
+    asmgen_tree_terms(selector, selector->nodes[node].left);
+    asmgen_tree_terms(selector, selector->nodes[node].right);
+}
+
+// the right hand operand of a two operand instruction whose left is destination. leaves are used as
+// they are, anything else goes to a free scratch register, or when there is none destination waits on
+// the stack and the value is read back from there, spilled tells the caller to drop that slot again
+AsmOperand asmgen_tree_operand(TreeSelector *selector, i32 node, Register destination, u32 free, bool *spilled) {
+    Instruction instruction = selector->instructions[node];
+
+    if (instruction.type == IT_Push) {
+        return asm_immediate(instruction.value);
+    }
+
+    if (instruction.type == IT_Local) {
+        return asmgen_slot(instruction.value);
+    }
+
+    if (free != 0) {
+        Register scratch = asmgen_tree_scratch(free);
+        asmgen_tree_value(selector, node, scratch, free & ~(1u << scratch));
+
+        return asm_register(scratch);
+    }
+
+    asm_emit(&selector->code, AO_Push, asm_register(destination));
+    asmgen_tree_value(selector, node, destination, free);
+    *spilled = true;
+
+    return asm_memory(R_RSP, 0);
+}
+
+// how cheaply node goes in as an operand, immediates before memory before registers
+i32 asmgen_tree_rank(TreeSelector *selector, i32 node) {
+    switch (selector->instructions[node].type) {
+        case IT_Push:   return 0;
+        case IT_Local:  return 1;
+        default:        return 2;
+    }
+}
+
+Register asmgen_tree_scratch(u32 free) {
+    for (i32 reg = 0; reg < 16; reg++) {
+        if (free & (1u << reg)) {
+            return (Register) reg;
+        }
+    }
+
+    Unreachable("no free scratch register in asmgen_tree_scratch");
+    return R_RAX;
+}
+
+// the frame slot of a parameter or let, the same layout the stack lowering uses
+AsmOperand asmgen_slot(i32 slot) {
+    return asm_memory(R_RBP, -(slot + 1) * 8);
+}
+
+slice<AsmInstruction> asmgen_linear(Arena *arena, IR *ir, RegAlloc *allocation) {
+    DynamicArray<AsmInstruction> code = dynamic_array_create<AsmInstruction>(arena, ir->instructions.len * 2 + 16);
+
+    slice<Instruction> instructions = to_slice(&ir->instructions);
+
+    for (i32 i = 0; i < instructions.len; i++) {
+        Instruction instruction = instructions[i];
+        VirtualOperands ops = allocation->operands[i];
+
+        asm_emit(&code, AO_Comment, asm_immediate(i));
+
+        switch (instruction.type) {
+            case IT_StartFunction: {
+                asmgen_register_prologue(&code, allocation, instruction.string);
+
+                for (i32 p = 0; p < (i32) allocation->parameters.size(); p++) {
+                    if (allocation->parameters[p] == -1) {
+                        continue;
+                    }
+
+                    asmgen_register_parameter(&code, allocation, allocation->parameters[p], p);
+                }
+            } break;
+            case IT_EndFunction: {
+                if (ir_falls_off_end(instructions, i)) {
+                    asm_emit(&code, AO_Xor, asm_register(R_RAX), asm_register(R_RAX));
+                    asmgen_register_epilogue(&code, allocation);
+                }
+
+                asm_emit(&code, AO_Endp, asm_label(instruction.string));
+            } break;
+            case IT_Push: {
+                asmgen_register_constant(&code, allocation, ops.def, instruction.value);
+            } break;
+            case IT_Local: {
+                // reads the slot register directly, nothing to emit
+            } break;
+            case IT_Store: {
+                asmgen_register_move(&code, allocation, ops.def, ops.uses[0]);
+            } break;
+            case IT_Add: {
+                asmgen_register_add(&code, allocation, ops.def, ops.uses[0], ops.uses[1]);
+            } break;
+            case IT_Return: {
+                asmgen_register_return(&code, allocation, ops.uses[0]);
+            } break;
+            case IT_IfZero:
+            case IT_IfNotZero: {
+                AsmOp jump = instruction.type == IT_IfZero ? AO_Je : AO_Jne;
+                asmgen_register_branch(&code, allocation, ops.uses[0], jump, asmgen_block_label(arena, instruction.value));
+            } break;
+            case IT_Jump: {
+                asm_emit(&code, AO_Jmp, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_Label: {
+                asm_emit(&code, AO_Label, asm_label(asmgen_block_label(arena, instruction.value)));
+            } break;
+            case IT_CompareEqual: {
+                // the stack hands the result straight to a branch that follows, so nothing else reads it
+                if (i + 1 < instructions.len && ir_is_branch(instructions[i + 1].type)) {
+                    Instruction branch = instructions[i + 1];
+
+                    asmgen_register_compare(&code, allocation, ops.uses[0], ops.uses[1]);
+                    asm_emit(&code, branch.type == IT_IfZero ? AO_Jne : AO_Je, asm_label(asmgen_block_label(arena, branch.value)));
+                    i++;
+
+                    break;
+                }
+
+                asmgen_register_compare_equal(&code, allocation, ops.def, ops.uses[0], ops.uses[1]);
+            } break;
+            case IT_Print: {
+                asmgen_register_print(&code, allocation, ops.uses[0]);
+            } break;
+            default:
+                Unreachable("unsupported instruction type in asmgen_linear");
+        }
+    }
+
+    return to_slice(&code);
+}
+
+slice<AsmInstruction> asmgen_ssa(Arena *arena, SSAFunction *function, RegAlloc *allocation) {
+    i64 instruction_count = 0;
+    for (SSABlock &block : function->blocks) {
+        instruction_count += block.instructions.len;
+    }
+
+    DynamicArray<AsmInstruction> code = dynamic_array_create<AsmInstruction>(arena, instruction_count * 2 + 16);
+
+    asmgen_register_prologue(&code, allocation, function->name);
+
+    DynamicArray<i32> use_counts = ssa_use_counts(arena, function);
+
+    for (i32 b = 0; b < function->blocks.len; b++) {
+        SSABlock *block = &function->blocks[b];
+        i32 next_block = b + 1;
+
+        asm_emit(&code, AO_Label, asm_label(asmgen_block_label(arena, block->id)));
+
+        // set when the flags of the compare just before the branch decide it
+        bool fused = false;
+
+        for (i64 k = 0; k < block->instructions.len; k++) {
+            SSAInstruction &instruction = block->instructions[k];
+
+            switch (instruction.type) {
+                case SI_Parameter: {
+                    asmgen_register_parameter(&code, allocation, instruction.def, instruction.value);
+                } break;
+                case SI_Constant: {
+                    asmgen_register_constant(&code, allocation, instruction.def, instruction.value);
+                } break;
+                case SI_Add: {
+                    asmgen_register_add(&code, allocation, instruction.def, instruction.operands[0], instruction.operands[1]);
+                } break;
+                case SI_CompareEqual: {
+                    // a compare only the next branch reads is never made into a 0 or 1, the phi moves
+                    // in between are only movs and leave the flags alone
+                    if (k + 1 < block->instructions.len && block->instructions[k + 1].type == SI_Branch &&
+                        block->instructions[k + 1].operands[0] == instruction.def && use_counts[instruction.def] == 1) {
+                        asmgen_register_compare(&code, allocation, instruction.operands[0], instruction.operands[1]);
+                        fused = true;
+
+                        break;
+                    }
+
+                    asmgen_register_compare_equal(&code, allocation, instruction.def, instruction.operands[0], instruction.operands[1]);
+                } break;
+                case SI_Phi: {
+                    // resolved by the moves at the end of each predecessor
+                } break;
+                case SI_Print: {
+                    asmgen_register_print(&code, allocation, instruction.operands[0]);
+                } break;
+                case SI_Return: {
+                    asmgen_register_return(&code, allocation, instruction.operands[0]);
+                } break;
+                case SI_Branch: {
+                    // the phi destinations are not live in the taken block yet so the moves
+                    // for both edges can happen before the branch
+                    asmgen_ssa_phi_moves(&code, function, allocation, block->id, instruction.blocks[0]);
+                    asmgen_ssa_phi_moves(&code, function, allocation, block->id, instruction.blocks[1]);
+
+                    if (fused) {
+                        asm_emit(&code, AO_Jne, asm_label(asmgen_block_label(arena, instruction.blocks[1])));
+                    } else {
+                        asm_emit(&code, AO_Cmp, asmgen_location(allocation, instruction.operands[0]), asm_immediate(0));
+                        asm_emit(&code, AO_Je, asm_label(asmgen_block_label(arena, instruction.blocks[1])));
+                    }
+
+                    if (instruction.blocks[0] != next_block) {
+                        asm_emit(&code, AO_Jmp, asm_label(asmgen_block_label(arena, instruction.blocks[0])));
+                    }
+                } break;
+                case SI_Jump: {
+                    asmgen_ssa_phi_moves(&code, function, allocation, block->id, instruction.blocks[0]);
+
+                    if (instruction.blocks[0] != next_block) {
+                        asm_emit(&code, AO_Jmp, asm_label(asmgen_block_label(arena, instruction.blocks[0])));
+                    }
+                } break;
+                default:
+                    Unreachable("unsupported instruction type in asmgen_ssa");
+            }
+        }
+
+        // only the block the body ends in is left open, a body without a trailing return returns 0
+        if (!ssa_is_terminated(block)) {
+            asm_emit(&code, AO_Xor, asm_register(R_RAX), asm_register(R_RAX));
+            asmgen_register_epilogue(&code, allocation);
+        }
+    }
+
+    asm_emit(&code, AO_Endp, asm_label(function->name));
+
+    return to_slice(&code);
+}
+
+void asmgen_ssa_phi_moves(DynamicArray<AsmInstruction> *code, SSAFunction *function, RegAlloc *allocation, i32 from, i32 to) {
+    // phis only appear at the top of a block
+    for (SSAInstruction &instruction : function->blocks[to].instructions) {
+        if (instruction.type != SI_Phi) {
+            break;
+        }
+
+        for (i32 k = 0; k < 2; k++) {
+            if (instruction.blocks[k] == from) {
+                asmgen_register_move(code, allocation, instruction.def, instruction.operands[k]);
+            }
+        }
+    }
+}
+
+string asmgen_block_label(Arena *arena, i32 block) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 16);
+    fmt(&bytes, "block_{}", block);
+
+    return to_slice(&bytes);
+}
+
+void asmgen_register_prologue(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, string name) {
+    asm_emit(code, AO_Proc, asm_label(name));
+    asm_emit(code, AO_Push, asm_register(R_RBP));
+    asm_emit(code, AO_Mov, asm_register(R_RBP), asm_register(R_RSP));
+
+    for (i32 r = 0; r < allocation->target->allocatable_count; r++) {
+        if (allocation->used_registers & (1u << r)) {
+            asm_emit(code, AO_Push, asm_register(allocation->target->allocatable[r]));
+        }
+    }
+
+    asm_emit(code, AO_Sub, asm_register(R_RSP), asm_immediate(regalloc_frame_size(allocation)));
+}
+
+void asmgen_register_parameter(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 index) {
+    asm_emit(code, AO_Mov, asmgen_location(allocation, def), asm_register(allocation->target->parameters[index]));
+}
+
+void asmgen_register_constant(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 value) {
+    asm_emit(code, AO_Mov, asmgen_location(allocation, def), asm_immediate(value));
+}
+
+void asmgen_register_add(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 left, i32 right) {
+    AsmOperand destination = asmgen_location(allocation, def);
+
+    if (destination.type == OT_Register) {
+        asm_emit(code, AO_Mov, destination, asmgen_location(allocation, left));
+        asm_emit(code, AO_Add, destination, asmgen_location(allocation, right));
+        return;
+    }
+
+    asm_emit(code, AO_Mov, asm_register(R_RAX), asmgen_location(allocation, left));
+    asm_emit(code, AO_Add, asm_register(R_RAX), asmgen_location(allocation, right));
+    asm_emit(code, AO_Mov, destination, asm_register(R_RAX));
+}
+
+void asmgen_register_compare_equal(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 left, i32 right) {
+    asmgen_register_compare(code, allocation, left, right);
+
+    asm_emit(code, AO_Setz, asm_register(R_RAX));
+    asm_emit(code, AO_Movzx, asm_register(R_RAX), asm_register(R_RAX));
+    asm_emit(code, AO_Mov, asmgen_location(allocation, def), asm_register(R_RAX));
+}
+
+// only sets the flags, rax is clobbered when neither side is in a register
+void asmgen_register_compare(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 left, i32 right) {
+    AsmOperand a = asmgen_location(allocation, left);
+    AsmOperand b = asmgen_location(allocation, right);
+
+    if (a.type == OT_Register) {
+        asm_emit(code, AO_Cmp, a, b);
+    } else if (b.type == OT_Register) {
+        asm_emit(code, AO_Cmp, b, a);
+    } else {
+        asm_emit(code, AO_Mov, asm_register(R_RAX), a);
+        asm_emit(code, AO_Cmp, asm_register(R_RAX), b);
+    }
+}
+
+// jump is je or jne, taken when value is zero or when it is not
+void asmgen_register_branch(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value, AsmOp jump, string label) {
+    asm_emit(code, AO_Cmp, asmgen_location(allocation, value), asm_immediate(0));
+    asm_emit(code, jump, asm_label(label));
+}
+
+void asmgen_register_print(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value) {
+    Register argument = allocation->target->parameters[0];
+
+    asm_emit(code, AO_Mov, asm_register(argument), asmgen_location(allocation, value));
+    asm_emit(code, AO_Call, asm_label("putchar"));
+    asm_emit(code, AO_Mov, asm_register(argument), asm_immediate(10));
+    asm_emit(code, AO_Call, asm_label("putchar"));
+}
+
+void asmgen_register_return(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 value) {
+    asm_emit(code, AO_Mov, asm_register(R_RAX), asmgen_location(allocation, value));
+    asmgen_register_epilogue(code, allocation);
+}
+
+// rax already holds the return value
+void asmgen_register_epilogue(DynamicArray<AsmInstruction> *code, RegAlloc *allocation) {
+    asm_emit(code, AO_Lea, asm_register(R_RSP), asm_memory(R_RBP, -regalloc_saved_register_count(allocation) * 8));
+
+    for (i32 r = allocation->target->allocatable_count - 1; r >= 0; r--) {
+        if (allocation->used_registers & (1u << r)) {
+            asm_emit(code, AO_Pop, asm_register(allocation->target->allocatable[r]));
+        }
+    }
+
+    asm_emit(code, AO_Pop, asm_register(R_RBP));
+    asm_emit(code, AO_Ret);
+}
+
+void asmgen_register_move(DynamicArray<AsmInstruction> *code, RegAlloc *allocation, i32 def, i32 value) {
+    AsmOperand to = asmgen_location(allocation, def);
+    AsmOperand from = asmgen_location(allocation, value);
+
+    if (asm_operand_equals(to, from)) {
+        return;
+    }
+
+    if (to.type == OT_Memory && from.type == OT_Memory) {
+        asm_emit(code, AO_Mov, asm_register(R_RAX), from);
+        asm_emit(code, AO_Mov, to, asm_register(R_RAX));
+        return;
+    }
+
+    asm_emit(code, AO_Mov, to, from);
+}
+
+AsmOperand asmgen_location(RegAlloc *allocation, i32 vreg) {
+    Location location = allocation->locations[vreg];
+
+    switch (location.type) {
+        case LT_Register:
+            return asm_register(allocation->target->allocatable[location.index]);
+        case LT_Spill: {
+            // spill slots sit below the saved callee registers
+            i32 offset = (regalloc_saved_register_count(allocation) + location.index + 1) * 8;
+            return asm_memory(R_RBP, -offset);
+        } break;
+        default:
+            Unreachable("unallocated virtual register in asmgen_location");
+    }
+
+    return {};
+}
+
+void asm_emit(DynamicArray<AsmInstruction> *code, AsmOp op, AsmOperand a, AsmOperand b) {
+    append(code, AsmInstruction{.op = op, .operands = {a, b}});
+}
+
+AsmOperand asm_register(Register reg) {
+    return AsmOperand{.type = OT_Register, .reg = reg};
+}
+
+AsmOperand asm_immediate(i64 value) {
+    return AsmOperand{.type = OT_Immediate, .value = value};
+}
+
+AsmOperand asm_memory(Register base, i64 displacement) {
+    return AsmOperand{.type = OT_Memory, .reg = base, .value = displacement};
+}
+
+AsmOperand asm_indexed(Register base, Register index, i64 displacement) {
+    Assertf(index != R_RSP, "rsp cannot be an index register");
+    return AsmOperand{.type = OT_Indexed, .reg = base, .value = displacement, .index = index};
+}
+
+AsmOperand asm_label(string name) {
+    return AsmOperand{.type = OT_Label, .name = name};
+}
+
+bool asm_operand_equals(AsmOperand a, AsmOperand b) {
+    if (a.type != b.type) {
+        return false;
+    }
+
+    switch (a.type) {
+        case OT_None:
+            return true;
+        case OT_Register:
+            return a.reg == b.reg;
+        case OT_Immediate:
+            return a.value == b.value;
+        case OT_Memory:
+            return a.reg == b.reg && a.value == b.value;
+        case OT_Indexed:
+            return a.reg == b.reg && a.index == b.index && a.value == b.value;
+        case OT_Label:
+            return slice_memcmp(a.name, b.name);
+    }
+
+    return false;
+}
+
+bool asm_operand_reads(AsmOperand operand, Register reg) {
+    if (operand.type == OT_Indexed) {
+        return operand.reg == reg || operand.index == reg;
+    }
+
+    return (operand.type == OT_Register || operand.type == OT_Memory) && operand.reg == reg;
+}
+
+// what the listing executes, comments and removed instructions are not counted
+i64 asm_instruction_count(slice<AsmInstruction> code) {
+    i64 count = 0;
+
+    for (AsmInstruction &instruction : code) {
+        if (instruction.op != AO_None && instruction.op != AO_Comment) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+string asm_to_string(Arena *arena, slice<AsmInstruction> code) {
+    Writer writer = writer_create(arena, NULL);
+    asm_write(&writer, code);
+
+    return writer_to_string(&writer);
+}
+
+void asm_write(Writer *writer, slice<AsmInstruction> code) {
+    asm_write_header(writer);
+    asm_write_code(writer, code);
+    asm_write_footer(writer);
+}
+
+void asm_write_header(Writer *writer) {
+    fmt(&writer->buffer, "EXTERN putchar:PROC\n");
+    fmt(&writer->buffer, ".code\n");
+}
+
+// the instructions alone, the listing of a module is the listings of its functions back to back
+void asm_write_code(Writer *writer, slice<AsmInstruction> code) {
+    DynamicArray<u8> *bytes = &writer->buffer;
+
+    for (AsmInstruction &instruction : code) {
+        writer_poll(writer);
+
+        AsmOperand a = instruction.operands[0];
+        AsmOperand b = instruction.operands[1];
+
+        switch (instruction.op) {
+            case AO_None:
+                continue;
+            case AO_Comment: {
+                append_string(bytes, "\n; [");
+                append_i64(bytes, a.value);
+                append_string(bytes, "]\n");
+                continue;
+            } break;
+            case AO_Proc: {
+                append_string(bytes, a.name);
+                append_string(bytes, " proc\n");
+                continue;
+            } break;
+            case AO_Endp: {
+                append_string(bytes, a.name);
+                append_string(bytes, " endp\n");
+                continue;
+            } break;
+            case AO_Label: {
+                append_string(bytes, a.name);
+                append_string(bytes, ":\n");
+                continue;
+            } break;
+            case AO_Setz: {
+                append_string(bytes, "    setz ");
+                append_string(bytes, byte_register_names[a.reg]);
+                append(bytes, (u8) '\n');
+                continue;
+            } break;
+            case AO_Movzx: {
+                append_string(bytes, "    movzx ");
+                append_string(bytes, register_names[a.reg]);
+                append_string(bytes, ", ");
+                append_string(bytes, byte_register_names[b.reg]);
+                append(bytes, (u8) '\n');
+                continue;
+            } break;
+            default:
+                break;
+        }
+
+        append_string(bytes, "    ");
+        append_string(bytes, asm_op_to_string(instruction.op));
+
+        if (a.type != OT_None) {
+            append(bytes, (u8) ' ');
+            asm_operand_to_string(bytes, a, instruction.op != AO_Lea);
+        }
+
+        if (b.type != OT_None) {
+            append_string(bytes, ", ");
+            asm_operand_to_string(bytes, b, instruction.op != AO_Lea);
+        }
+
+        append(bytes, (u8) '\n');
+    }
+}
+
+void asm_write_footer(Writer *writer) {
+    fmt(&writer->buffer, "end\n");
+}
+
+void asm_operand_to_string(DynamicArray<u8> *bytes, AsmOperand operand, bool sized) {
+    switch (operand.type) {
+        case OT_Register: {
+            append_string(bytes, register_names[operand.reg]);
+        } break;
+        case OT_Immediate: {
+            append_i64(bytes, operand.value);
+        } break;
+        case OT_Memory: {
+            if (sized) {
+                append_string(bytes, "qword ptr ");
+            }
+
+            append(bytes, (u8) '[');
+            append_string(bytes, register_names[operand.reg]);
+
+            if (operand.value < 0) {
+                append_string(bytes, " - ");
+                append_i64(bytes, -operand.value);
+            } else if (operand.value > 0) {
+                append_string(bytes, " + ");
+                append_i64(bytes, operand.value);
+            }
+
+            append(bytes, (u8) ']');
+        } break;
+        case OT_Indexed: {
+            append(bytes, (u8) '[');
+            append_string(bytes, register_names[operand.reg]);
+            append_string(bytes, " + ");
+            append_string(bytes, register_names[operand.index]);
+
+            if (operand.value < 0) {
+                append_string(bytes, " - ");
+                append_i64(bytes, -operand.value);
+            } else if (operand.value > 0) {
+                append_string(bytes, " + ");
+                append_i64(bytes, operand.value);
+            }
+
+            append(bytes, (u8) ']');
+        } break;
+        case OT_Label: {
+            append_string(bytes, operand.name);
+        } break;
+        default:
+            Unreachable("unsupported operand type in asm_operand_to_string");
+    }
+}
+
+string asm_op_to_string(AsmOp op) {
+    switch (op) {
+        case AO_Push:   return "push";
+        case AO_Pop:    return "pop";
+        case AO_Mov:    return "mov";
+        case AO_Movzx:  return "movzx";
+        case AO_Lea:    return "lea";
+        case AO_Add:    return "add";
+        case AO_Sub:    return "sub";
+        case AO_Xor:    return "xor";
+        case AO_Cmp:    return "cmp";
+        case AO_Setz:   return "setz";
+        case AO_Call:   return "call";
+        case AO_Ret:    return "ret";
+        case AO_Jmp:    return "jmp";
+        case AO_Je:     return "je";
+        case AO_Jne:    return "jne";
+        default:        Unreachable("unsupported op in asm_op_to_string");
+    }
+
+    return "";
+}
+
+// @peephole
+struct PeepholeRule {
+    string name;
+    i32 window;
+
+    // writes the replacement for a matching window into out and returns its length, which is
+    // never more than the window, or -1 when the rule does not apply
+    i32 (*rewrite)(AsmInstruction *window, AsmInstruction *out);
+};
+
+i32 peephole_push_pop_same(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_push_pop_move(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_push_move_pop(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_move_self(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_move_overwritten(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_zero_setz(AsmInstruction *window, AsmInstruction *out);
+i32 peephole_jump_next_label(AsmInstruction *window, AsmInstruction *out);
+
+PeepholeRule peephole_rules[] = {
+    {"push_pop_same",       2, peephole_push_pop_same},
+    {"push_pop_move",       2, peephole_push_pop_move},
+    {"push_move_pop",       3, peephole_push_move_pop},
+    {"move_self",           1, peephole_move_self},
+    {"move_overwritten",    2, peephole_move_overwritten},
+    {"zero_setz",           2, peephole_zero_setz},
+    {"jump_next_label",     2, peephole_jump_next_label},
+};
+
+const i32 peephole_rule_count = sizeof(peephole_rules) / sizeof(peephole_rules[0]);
+const i32 peephole_max_window = 3;
+
+struct PeepholeStats {
+    array<i64, peephole_rule_count> fired;
+    i64 before;
+    i64 after;
+};
+
+PeepholeStats peephole(slice<AsmInstruction> *code);
+string peephole_stats_to_string(Arena *arena, PeepholeStats *stats);
+
+PeepholeStats peephole(slice<AsmInstruction> *code) {
+    PeepholeStats stats = {};
+
+    static const auto is_skipped = [](AsmOp op) {
+        return op == AO_None || op == AO_Comment;
+    };
+
+    for (AsmInstruction &instruction : *code) {
+        if (!is_skipped(instruction.op)) {
+            stats.before++;
+        }
+    }
+
+    // rewrites can expose new matches for earlier rules so sweep until nothing fires
+    bool changed = true;
+
+    for (i32 sweep = 0; changed && sweep < 8; sweep++) {
+        changed = false;
+
+        for (i64 i = 0; i < code->len; i++) {
+            if (is_skipped((*code)[i].op)) {
+                continue;
+            }
+
+            for (i32 r = 0; r < peephole_rule_count; r++) {
+                PeepholeRule rule = peephole_rules[r];
+
+                // comments are transparent, labels and proc boundaries are not skipped so they
+                // only ever match rules that ask for them
+                array<i64, peephole_max_window> indices = {};
+                array<AsmInstruction, peephole_max_window> window = {};
+                i32 found = 0;
+
+                for (i64 j = i; j < code->len && found < rule.window; j++) {
+                    if (is_skipped((*code)[j].op)) {
+                        continue;
+                    }
+
+                    indices[found] = j;
+                    window[found] = (*code)[j];
+                    found++;
+                }
+
+                if (found < rule.window) {
+                    continue;
+                }
+
+                array<AsmInstruction, peephole_max_window> out = {};
+                i32 count = rule.rewrite(window.data(), out.data());
+
+                if (count < 0) {
+                    continue;
+                }
+
+                for (i32 k = 0; k < rule.window; k++) {
+                    (*code)[indices[k]] = k < count ? out[k] : AsmInstruction{.op = AO_None};
+                }
+
+                stats.fired[r]++;
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    i64 kept = 0;
+    for (i64 i = 0; i < code->len; i++) {
+        if ((*code)[i].op == AO_None) {
+            continue;
+        }
+
+        (*code)[kept] = (*code)[i];
+        kept++;
+
+        if ((*code)[i].op != AO_Comment) {
+            stats.after++;
+        }
+    }
+
+    code->len = kept;
+
+    return stats;
+}
+
+// push X; pop X
+i32 peephole_push_pop_same(AsmInstruction *window, AsmInstruction *) {
+    if (window[0].op != AO_Push || window[1].op != AO_Pop) {
+        return -1;
+    }
+
+    if (!asm_operand_equals(window[0].operands[0], window[1].operands[0])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// push X; pop R -> mov R, X
+i32 peephole_push_pop_move(AsmInstruction *window, AsmInstruction *out) {
+    if (window[0].op != AO_Push || window[1].op != AO_Pop) {
+        return -1;
+    }
+
+    AsmOperand source = window[0].operands[0];
+    AsmOperand destination = window[1].operands[0];
+
+    if (destination.type != OT_Register || asm_operand_reads(source, R_RSP)) {
+        return -1;
+    }
+
+    out[0] = {.op = AO_Mov, .operands = {destination, source}};
+    return 1;
+}
+
+// push X; mov D, Y; pop R -> mov R, X; mov D, Y
+i32 peephole_push_move_pop(AsmInstruction *window, AsmInstruction *out) {
+    if (window[0].op != AO_Push || window[1].op != AO_Mov || window[2].op != AO_Pop) {
+        return -1;
+    }
+
+    AsmOperand source = window[0].operands[0];
+    AsmOperand move_destination = window[1].operands[0];
+    AsmOperand move_source = window[1].operands[1];
+    AsmOperand destination = window[2].operands[0];
+
+    if (destination.type != OT_Register) {
+        return -1;
+    }
+
+    // R is now written before the move, so the move must not touch it in any way
+    if (asm_operand_reads(move_destination, destination.reg) || asm_operand_reads(move_source, destination.reg)) {
+        return -1;
+    }
+
+    if (asm_operand_reads(source, R_RSP) || asm_operand_reads(move_destination, R_RSP) || asm_operand_reads(move_source, R_RSP)) {
+        return -1;
+    }
+
+    out[0] = {.op = AO_Mov, .operands = {destination, source}};
+    out[1] = window[1];
+    return 2;
+}
+
+// mov R, R
+i32 peephole_move_self(AsmInstruction *window, AsmInstruction *) {
+    if (window[0].op != AO_Mov || !asm_operand_equals(window[0].operands[0], window[0].operands[1])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// mov R, X; mov R, Y -> mov R, Y when Y does not read R
+i32 peephole_move_overwritten(AsmInstruction *window, AsmInstruction *out) {
+    if (window[0].op != AO_Mov || window[1].op != AO_Mov) {
+        return -1;
+    }
+
+    AsmOperand destination = window[0].operands[0];
+
+    if (destination.type != OT_Register || !asm_operand_equals(destination, window[1].operands[0])) {
+        return -1;
+    }
+
+    if (asm_operand_reads(window[1].operands[1], destination.reg)) {
+        return -1;
+    }
+
+    out[0] = window[1];
+    return 1;
+}
+
+// mov R, 0; setz R8 -> setz R8; movzx R, R8
+i32 peephole_zero_setz(AsmInstruction *window, AsmInstruction *out) {
+    if (window[0].op != AO_Mov || window[1].op != AO_Setz) {
+        return -1;
+    }
+
+    AsmOperand destination = window[0].operands[0];
+    AsmOperand source = window[0].operands[1];
+
+    if (destination.type != OT_Register || source.type != OT_Immediate || source.value != 0) {
+        return -1;
+    }
+
+    if (window[1].operands[0].reg != destination.reg) {
+        return -1;
+    }
+
+    out[0] = window[1];
+    out[1] = {.op = AO_Movzx, .operands = {destination, destination}};
+    return 2;
+}
+
+// jmp L; L: and je L; L: and jne L; L:
+i32 peephole_jump_next_label(AsmInstruction *window, AsmInstruction *out) {
+    if ((window[0].op != AO_Jmp && window[0].op != AO_Je && window[0].op != AO_Jne) || window[1].op != AO_Label) {
+        return -1;
+    }
+
+    if (!asm_operand_equals(window[0].operands[0], window[1].operands[0])) {
+        return -1;
+    }
+
+    out[0] = window[1];
+    return 1;
+}
+
+string peephole_stats_to_string(Arena *arena, PeepholeStats *stats) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 256);
+
+    for (i32 r = 0; r < peephole_rule_count; r++) {
+        fmt(&bytes, "{}: fired {} times\n", peephole_rules[r].name, stats->fired[r]);
+    }
+
+    fmt(&bytes, "instructions: {} -> {}\n", stats->before, stats->after);
+
+    return to_slice(&bytes);
+}
+
+// @encode
+struct ExternalSymbol {
+    string name;
+    u64 address;
+};
+
+struct CodeLabel {
+    string name;
+    i64 offset;
+};
+
+// a rel32 that is patched once every label is known
+struct LabelFixup {
+    string label;
+    i64 offset;
+};
+
+// a call to a symbol that was not given an address, left for the linker
+struct Relocation {
+    string symbol;
+    i64 offset;
+};
+
+struct CodeFunction {
+    string name;
+    i64 offset;
+    i64 size;
+};
+
+struct MachineCode {
+    DynamicArray<u8> bytes;
+    DynamicArray<CodeLabel> labels;
+    DynamicArray<LabelFixup> fixups;
+    DynamicArray<Relocation> relocations;
+    DynamicArray<CodeFunction> functions;
+};
+
+MachineCode encode(Arena *arena, slice<AsmInstruction> code, slice<ExternalSymbol> externals);
+
+void encode_instruction(MachineCode *machine_code, AsmInstruction instruction, slice<ExternalSymbol> externals);
+void encode_resolve_fixups(MachineCode *machine_code);
+void encode_alu(MachineCode *machine_code, u8 rm_reg_opcode, u8 reg_rm_opcode, u8 extension, AsmOperand destination, AsmOperand source);
+void encode_rex(MachineCode *machine_code, bool wide, i32 reg, AsmOperand rm);
+void encode_modrm(MachineCode *machine_code, i32 reg, AsmOperand rm);
+void encode_u8(MachineCode *machine_code, u8 value);
+void encode_u32(MachineCode *machine_code, u32 value);
+void encode_u64(MachineCode *machine_code, u64 value);
+bool encode_fits_i8(i64 value);
+bool encode_fits_i32(i64 value);
+
+MachineCode encode(Arena *arena, slice<AsmInstruction> code, slice<ExternalSymbol> externals) {
+    MachineCode machine_code = {
+        .bytes = dynamic_array_create<u8>(arena, code.len * 4),
+        .labels = dynamic_array_create<CodeLabel>(arena, 16),
+        .fixups = dynamic_array_create<LabelFixup>(arena, 16),
+        .relocations = dynamic_array_create<Relocation>(arena, 16),
+        .functions = dynamic_array_create<CodeFunction>(arena, 4),
+    };
+
+    for (AsmInstruction &instruction : code) {
+        encode_instruction(&machine_code, instruction, externals);
+    }
+
+    encode_resolve_fixups(&machine_code);
+
+    return machine_code;
+}
+
+// labels are local to a proc like they are in MASM, so every function's jumps are patched at its endp
+// and the same label name can appear again in the next function
+void encode_resolve_fixups(MachineCode *machine_code) {
+    // every jump is a rel32 so nothing moves once the labels are placed
+    for (LabelFixup &fixup : machine_code->fixups) {
+        i64 target = -1;
+
+        for (CodeLabel &label : machine_code->labels) {
+            if (slice_memcmp(label.name, fixup.label)) {
+                target = label.offset;
+                break;
+            }
+        }
+
+        Assertf(target != -1, "jump to undefined label in encode");
+
+        u32 displacement = (u32) (target - (fixup.offset + 4));
+        memcpy(&machine_code->bytes[fixup.offset], &displacement, sizeof(displacement));
+    }
+
+    reset(&machine_code->labels);
+    reset(&machine_code->fixups);
+}
+
+void encode_instruction(MachineCode *machine_code, AsmInstruction instruction, slice<ExternalSymbol> externals) {
+    AsmOperand a = instruction.operands[0];
+    AsmOperand b = instruction.operands[1];
+
+    switch (instruction.op) {
+        case AO_None:
+        case AO_Comment:
+            break;
+        case AO_Proc: {
+            append(&machine_code->functions, CodeFunction{.name = a.name, .offset = machine_code->bytes.len});
+        } break;
+        case AO_Endp: {
+            CodeFunction *function = &machine_code->functions[machine_code->functions.len - 1];
+            function->size = machine_code->bytes.len - function->offset;
+
+            encode_resolve_fixups(machine_code);
+        } break;
+        case AO_Label: {
+            for (CodeLabel &label : machine_code->labels) {
+                Assertf(!slice_memcmp(label.name, a.name), "duplicate label in encode");
+            }
+
+            append(&machine_code->labels, CodeLabel{.name = a.name, .offset = machine_code->bytes.len});
+        } break;
+        case AO_Push: {
+            if (a.type == OT_Register) {
+                encode_rex(machine_code, false, 0, a);
+                encode_u8(machine_code, 0x50 + (a.reg & 7));
+            } else if (a.type == OT_Immediate) {
+                Assertf(encode_fits_i32(a.value), "push immediate does not fit in 32 bits");
+
+                encode_u8(machine_code, 0x68);
+                encode_u32(machine_code, (u32) a.value);
+            } else {
+                encode_rex(machine_code, false, 6, a);
+                encode_u8(machine_code, 0xFF);
+                encode_modrm(machine_code, 6, a);
+            }
+        } break;
+        case AO_Pop: {
+            Assertf(a.type == OT_Register, "pop only supports registers in encode");
+
+            encode_rex(machine_code, false, 0, a);
+            encode_u8(machine_code, 0x58 + (a.reg & 7));
+        } break;
+        case AO_Mov: {
+            if (a.type == OT_Register && b.type == OT_Immediate && !encode_fits_i32(b.value)) {
+                encode_rex(machine_code, true, 0, a);
+                encode_u8(machine_code, 0xB8 + (a.reg & 7));
+                encode_u64(machine_code, (u64) b.value);
+                break;
+            }
+
+            encode_alu(machine_code, 0x89, 0x8B, 0, a, b);
+        } break;
+        case AO_Movzx: {
+            encode_rex(machine_code, true, a.reg, b);
+            encode_u8(machine_code, 0x0F);
+            encode_u8(machine_code, 0xB6);
+            encode_modrm(machine_code, a.reg, b);
+        } break;
+        case AO_Lea: {
+            encode_rex(machine_code, true, a.reg, b);
+            encode_u8(machine_code, 0x8D);
+            encode_modrm(machine_code, a.reg, b);
+        } break;
+        case AO_Add: {
+            encode_alu(machine_code, 0x01, 0x03, 0, a, b);
+        } break;
+        case AO_Sub: {
+            encode_alu(machine_code, 0x29, 0x2B, 5, a, b);
+        } break;
+        case AO_Xor: {
+            encode_alu(machine_code, 0x31, 0x33, 6, a, b);
+        } break;
+        case AO_Cmp: {
+            encode_alu(machine_code, 0x39, 0x3B, 7, a, b);
+        } break;
+        case AO_Setz: {
+            // any rex prefix turns 4 to 7 into spl, bpl, sil and dil instead of ah to bh
+            if (a.reg >= 4) {
+                encode_u8(machine_code, 0x40 | (a.reg >= 8 ? 0x01 : 0x00));
+            }
+
+            encode_u8(machine_code, 0x0F);
+            encode_u8(machine_code, 0x94);
+            encode_modrm(machine_code, 0, a);
+        } break;
+        case AO_Call: {
+            for (ExternalSymbol &external : externals) {
+                if (slice_memcmp(external.name, a.name)) {
+                    // mov rax, address; call rax, the target can be anywhere in the address space
+                    encode_u8(machine_code, 0x48);
+                    encode_u8(machine_code, 0xB8);
+                    encode_u64(machine_code, external.address);
+                    encode_u8(machine_code, 0xFF);
+                    encode_u8(machine_code, 0xD0);
+                    return;
+                }
+            }
+
+            encode_u8(machine_code, 0xE8);
+            append(&machine_code->relocations, Relocation{.symbol = a.name, .offset = machine_code->bytes.len});
+            encode_u32(machine_code, 0);
+        } break;
+        case AO_Ret: {
+            encode_u8(machine_code, 0xC3);
+        } break;
+        case AO_Jmp: {
+            encode_u8(machine_code, 0xE9);
+            append(&machine_code->fixups, LabelFixup{.label = a.name, .offset = machine_code->bytes.len});
+            encode_u32(machine_code, 0);
+        } break;
+        case AO_Je:
+        case AO_Jne: {
+            encode_u8(machine_code, 0x0F);
+            encode_u8(machine_code, instruction.op == AO_Je ? 0x84 : 0x85);
+            append(&machine_code->fixups, LabelFixup{.label = a.name, .offset = machine_code->bytes.len});
+            encode_u32(machine_code, 0);
+        } break;
+        default:
+            Unreachable("unsupported op in encode_instruction");
+    }
+}
+
+void encode_alu(MachineCode *machine_code, u8 rm_reg_opcode, u8 reg_rm_opcode, u8 extension, AsmOperand destination, AsmOperand source) {
+    if (source.type == OT_Immediate) {
+        Assertf(encode_fits_i32(source.value), "immediate does not fit in 32 bits");
+
+        // mov has no sign extended imm8 form
+        bool short_form = rm_reg_opcode != 0x89 && encode_fits_i8(source.value);
+
+        encode_rex(machine_code, true, extension, destination);
+        encode_u8(machine_code, rm_reg_opcode == 0x89 ? 0xC7 : (short_form ? 0x83 : 0x81));
+        encode_modrm(machine_code, extension, destination);
+
+        if (short_form) {
+            encode_u8(machine_code, (u8) source.value);
+        } else {
+            encode_u32(machine_code, (u32) source.value);
+        }
+
+        return;
+    }
+
+    if (source.type == OT_Register) {
+        encode_rex(machine_code, true, source.reg, destination);
+        encode_u8(machine_code, rm_reg_opcode);
+        encode_modrm(machine_code, source.reg, destination);
+        return;
+    }
+
+    Assertf(destination.type == OT_Register && source.type == OT_Memory, "unsupported operands in encode_alu");
+
+    encode_rex(machine_code, true, destination.reg, source);
+    encode_u8(machine_code, reg_rm_opcode);
+    encode_modrm(machine_code, destination.reg, source);
+}
+
+void encode_rex(MachineCode *machine_code, bool wide, i32 reg, AsmOperand rm) {
+    u8 rex = 0x40;
+
+    if (wide) {
+        rex |= 0x08;
+    }
+
+    if (reg >= 8) {
+        rex |= 0x04;
+    }
+
+    if ((rm.type == OT_Register || rm.type == OT_Memory || rm.type == OT_Indexed) && rm.reg >= 8) {
+        rex |= 0x01;
+    }
+
+    if (rm.type == OT_Indexed && rm.index >= 8) {
+        rex |= 0x02;
+    }
+
+    if (rex != 0x40) {
+        encode_u8(machine_code, rex);
+    }
+}
+
+void encode_modrm(MachineCode *machine_code, i32 reg, AsmOperand rm) {
+    u8 reg_bits = (u8) ((reg & 7) << 3);
+
+    if (rm.type == OT_Register) {
+        encode_u8(machine_code, 0xC0 | reg_bits | (rm.reg & 7));
+        return;
+    }
+
+    Assertf(rm.type == OT_Memory || rm.type == OT_Indexed, "unsupported operand in encode_modrm");
+
+    u8 base = rm.reg & 7;
+
+    // rbp and r13 have no displacement free form, rsp and r12 need a sib byte
+    u8 mod = 0x80;
+    if (rm.value == 0 && base != 5) {
+        mod = 0x00;
+    } else if (encode_fits_i8(rm.value)) {
+        mod = 0x40;
+    }
+
+    if (rm.type == OT_Indexed) {
+        // rm of 4 says a sib byte follows, scale 1
+        encode_u8(machine_code, mod | reg_bits | 4);
+        encode_u8(machine_code, (u8) (((rm.index & 7) << 3) | base));
+    } else {
+        encode_u8(machine_code, mod | reg_bits | base);
+
+        if (base == 4) {
+            encode_u8(machine_code, 0x24);
+        }
+    }
+
+    if (mod == 0x40) {
+        encode_u8(machine_code, (u8) rm.value);
+    } else if (mod == 0x80) {
+        encode_u32(machine_code, (u32) rm.value);
+    }
+}
+
+void encode_u8(MachineCode *machine_code, u8 value) {
+    append(&machine_code->bytes, value);
+}
+
+void encode_u32(MachineCode *machine_code, u32 value) {
+    for (i32 i = 0; i < 4; i++) {
+        append(&machine_code->bytes, (u8) (value >> (i * 8)));
+    }
+}
+
+void encode_u64(MachineCode *machine_code, u64 value) {
+    for (i32 i = 0; i < 8; i++) {
+        append(&machine_code->bytes, (u8) (value >> (i * 8)));
+    }
+}
+
+bool encode_fits_i8(i64 value) {
+    return value >= -128 && value <= 127;
+}
+
+bool encode_fits_i32(i64 value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// @jit
+typedef u64 (*JitFunction)(u64 x, u64 y, u64 z, u64 w);
+
+struct Jit {
+    u8 *memory;
+    u64 size;
+    JitFunction function;
+};
+
+bool jit_compile(Arena *arena, slice<AsmInstruction> code, string name, Jit *jit);
+void jit_destroy(Jit *jit);
+
+bool jit_compile(Arena *arena, slice<AsmInstruction> code, string name, Jit *jit) {
+#if defined(OS_LINUX)
+    ExternalSymbol externals[] = {
+        {.name = "putchar", .address = (u64) (void *) &putchar},
+    };
+
+    MachineCode machine_code = encode(arena, code, slice<ExternalSymbol>(externals, 1));
+    Assertf(machine_code.relocations.len == 0, "unresolved call in jit_compile");
+
+    i64 entry = -1;
+    for (CodeFunction &function : machine_code.functions) {
+        if (slice_memcmp(function.name, name)) {
+            entry = function.offset;
+        }
+    }
+
+    if (entry == -1) {
+        Err("jit_compile could not find the entry function");
+        return false;
+    }
+
+    u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+    u64 size = ((u64) machine_code.bytes.len + page_size - 1) & ~(page_size - 1);
+
+    // written while RW, then flipped to RX so the mapping is never writable and executable at once
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        Err("mmap failed in jit_compile");
+        return false;
+    }
+
+    memcpy(memory, machine_code.bytes.ptr, machine_code.bytes.len);
+
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        Err("mprotect failed in jit_compile");
+        return false;
+    }
+
+    *jit = {
+        .memory = (u8 *) memory,
+        .size = size,
+        .function = (JitFunction) ((u8 *) memory + entry),
+    };
+
+    return true;
+#else
+    Err("the jit is only supported on linux");
+    return false;
+#endif
+}
+
+void jit_destroy(Jit *jit) {
+#if defined(OS_LINUX)
+    if (jit->memory) {
+        munmap(jit->memory, jit->size);
+    }
+#endif
+
+    *jit = {};
+}
+
+// @elf
+const u32 ELF_SHT_PROGBITS = 1;
+const u32 ELF_SHT_SYMTAB = 2;
+const u32 ELF_SHT_STRTAB = 3;
+const u32 ELF_SHT_RELA = 4;
+
+const u64 ELF_SHF_ALLOC = 0x2;
+const u64 ELF_SHF_EXECINSTR = 0x4;
+const u64 ELF_SHF_INFO_LINK = 0x40;
+
+const u32 ELF_R_X86_64_PLT32 = 4;
+
+const i32 ELF_HEADER_SIZE = 64;
+const i32 ELF_SECTION_HEADER_SIZE = 64;
+const i32 ELF_SYMBOL_SIZE = 24;
+const i32 ELF_RELA_SIZE = 24;
+
+enum ElfSection {
+    ES_Null,
+    ES_Text,
+    ES_RelaText,
+    ES_Symtab,
+    ES_Strtab,
+    ES_Shstrtab,
+    ES_NoteGnuStack,
+    ES_Count,
+};
+
+struct ElfSectionHeader {
+    u32 name;
+    u32 type;
+    u64 flags;
+    u64 offset;
+    u64 size;
+    u32 link;
+    u32 info;
+    u64 alignment;
+    u64 entry_size;
+};
+
+string elf_write_object(Arena *arena, MachineCode *machine_code);
+
+u32 elf_add_string(DynamicArray<u8> *table, string s);
+void elf_write_symbol(DynamicArray<u8> *bytes, u32 name, u8 info, u16 section, u64 value, u64 size);
+void elf_write_u16(DynamicArray<u8> *bytes, u16 value);
+void elf_write_u32(DynamicArray<u8> *bytes, u32 value);
+void elf_write_u64(DynamicArray<u8> *bytes, u64 value);
+void elf_align(DynamicArray<u8> *bytes, u64 alignment);
+
+string elf_write_object(Arena *arena, MachineCode *machine_code) {
+    DynamicArray<u8> strtab = dynamic_array_create<u8>(arena, 256);
+    DynamicArray<u8> shstrtab = dynamic_array_create<u8>(arena, 128);
+    DynamicArray<u8> symtab = dynamic_array_create<u8>(arena, 256);
+    DynamicArray<u8> rela = dynamic_array_create<u8>(arena, 256);
+
+    append(&strtab, (u8) 0);
+    append(&shstrtab, (u8) 0);
+
+    // locals have to come first, the null symbol and one for .text
+    elf_write_symbol(&symtab, 0, 0, 0, 0, 0);
+    elf_write_symbol(&symtab, 0, 0x03, ES_Text, 0, 0);
+    u32 first_global = 2;
+
+    for (CodeFunction &function : machine_code->functions) {
+        u32 name = elf_add_string(&strtab, function.name);
+
+        // STB_GLOBAL, STT_FUNC
+        elf_write_symbol(&symtab, name, 0x12, ES_Text, function.offset, function.size);
+    }
+
+    DynamicArray<string> externals = dynamic_array_create<string>(arena, 4);
+
+    for (Relocation &relocation : machine_code->relocations) {
+        i64 index = -1;
+        for (i64 i = 0; i < externals.len; i++) {
+            if (slice_memcmp(externals[i], relocation.symbol)) {
+                index = i;
+            }
+        }
+
+        if (index == -1) {
+            index = externals.len;
+            append(&externals, relocation.symbol);
+
+            // STB_GLOBAL, STT_NOTYPE, undefined
+            elf_write_symbol(&symtab, elf_add_string(&strtab, relocation.symbol), 0x10, 0, 0, 0);
+        }
+
+        u64 symbol = first_global + machine_code->functions.len + index;
+
+        // the call displacement is relative to the end of its own 4 bytes
+        elf_write_u64(&rela, relocation.offset);
+        elf_write_u64(&rela, (symbol << 32) | ELF_R_X86_64_PLT32);
+        elf_write_u64(&rela, (u64) -4);
+    }
+
+    array<ElfSectionHeader, ES_Count> sections = {};
+
+    sections[ES_Text] = {
+        .name = elf_add_string(&shstrtab, ".text"),
+        .type = ELF_SHT_PROGBITS,
+        .flags = ELF_SHF_ALLOC | ELF_SHF_EXECINSTR,
+        .size = (u64) machine_code->bytes.len,
+        .alignment = 16,
+    };
+
+    sections[ES_RelaText] = {
+        .name = elf_add_string(&shstrtab, ".rela.text"),
+        .type = ELF_SHT_RELA,
+        .flags = ELF_SHF_INFO_LINK,
+        .size = (u64) rela.len,
+        .link = ES_Symtab,
+        .info = ES_Text,
+        .alignment = 8,
+        .entry_size = ELF_RELA_SIZE,
+    };
+
+    sections[ES_Symtab] = {
+        .name = elf_add_string(&shstrtab, ".symtab"),
+        .type = ELF_SHT_SYMTAB,
+        .size = (u64) symtab.len,
+        .link = ES_Strtab,
+        .info = first_global,
+        .alignment = 8,
+        .entry_size = ELF_SYMBOL_SIZE,
+    };
+
+    sections[ES_Strtab] = {
+        .name = elf_add_string(&shstrtab, ".strtab"),
+        .type = ELF_SHT_STRTAB,
+        .size = (u64) strtab.len,
+        .alignment = 1,
+    };
+
+    // marks the stack as non executable, without it the linker warns and assumes it is
+    sections[ES_NoteGnuStack] = {
+        .name = elf_add_string(&shstrtab, ".note.GNU-stack"),
+        .type = ELF_SHT_PROGBITS,
+        .alignment = 1,
+    };
+
+    sections[ES_Shstrtab] = {
+        .name = elf_add_string(&shstrtab, ".shstrtab"),
+        .type = ELF_SHT_STRTAB,
+        .size = (u64) shstrtab.len,
+        .alignment = 1,
+    };
+
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, ELF_HEADER_SIZE + machine_code->bytes.len + 1024);
+
+    // filled in below once the section header table offset is known
+    for (i32 i = 0; i < ELF_HEADER_SIZE; i++) {
+        append(&bytes, (u8) 0);
+    }
+
+    array<DynamicArray<u8> *, ES_Count> contents = {};
+    contents[ES_Text] = &machine_code->bytes;
+    contents[ES_RelaText] = &rela;
+    contents[ES_Symtab] = &symtab;
+    contents[ES_Strtab] = &strtab;
+    contents[ES_Shstrtab] = &shstrtab;
+
+    for (i32 i = 1; i < ES_Count; i++) {
+        elf_align(&bytes, sections[i].alignment);
+        sections[i].offset = bytes.len;
+
+        if (contents[i]) {
+            for (u8 byte : *contents[i]) {
+                append(&bytes, byte);
+            }
+        }
+    }
+
+    elf_align(&bytes, 8);
+    u64 section_headers_offset = bytes.len;
+
+    for (ElfSectionHeader &section : sections) {
+        elf_write_u32(&bytes, section.name);
+        elf_write_u32(&bytes, section.type);
+        elf_write_u64(&bytes, section.flags);
+        elf_write_u64(&bytes, 0);
+        elf_write_u64(&bytes, section.offset);
+        elf_write_u64(&bytes, section.size);
+        elf_write_u32(&bytes, section.link);
+        elf_write_u32(&bytes, section.info);
+        elf_write_u64(&bytes, section.alignment);
+        elf_write_u64(&bytes, section.entry_size);
+    }
+
+    DynamicArray<u8> header = dynamic_array_create<u8>(arena, ELF_HEADER_SIZE);
+
+    // ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE
+    u8 identification[16] = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0};
+    for (u8 byte : identification) {
+        append(&header, byte);
+    }
+
+    elf_write_u16(&header, 1);                          // ET_REL
+    elf_write_u16(&header, 62);                         // EM_X86_64
+    elf_write_u32(&header, 1);                          // EV_CURRENT
+    elf_write_u64(&header, 0);                          // entry
+    elf_write_u64(&header, 0);                          // program headers
+    elf_write_u64(&header, section_headers_offset);
+    elf_write_u32(&header, 0);                          // flags
+    elf_write_u16(&header, ELF_HEADER_SIZE);
+    elf_write_u16(&header, 0);                          // program header size
+    elf_write_u16(&header, 0);                          // program header count
+    elf_write_u16(&header, ELF_SECTION_HEADER_SIZE);
+    elf_write_u16(&header, ES_Count);
+    elf_write_u16(&header, ES_Shstrtab);
+
+    memcpy(bytes.ptr, header.ptr, ELF_HEADER_SIZE);
+
+    return to_slice(&bytes);
+}
+
+u32 elf_add_string(DynamicArray<u8> *table, string s) {
+    u32 offset = (u32) table->len;
+
+    for (u8 c : s) {
+        append(table, c);
+    }
+
+    append(table, (u8) 0);
+
+    return offset;
+}
+
+void elf_write_symbol(DynamicArray<u8> *bytes, u32 name, u8 info, u16 section, u64 value, u64 size) {
+    elf_write_u32(bytes, name);
+    append(bytes, info);
+    append(bytes, (u8) 0);
+    elf_write_u16(bytes, section);
+    elf_write_u64(bytes, value);
+    elf_write_u64(bytes, size);
+}
+
+void elf_write_u16(DynamicArray<u8> *bytes, u16 value) {
+    for (i32 i = 0; i < 2; i++) {
+        append(bytes, (u8) (value >> (i * 8)));
+    }
+}
+
+void elf_write_u32(DynamicArray<u8> *bytes, u32 value) {
+    for (i32 i = 0; i < 4; i++) {
+        append(bytes, (u8) (value >> (i * 8)));
+    }
+}
+
+void elf_write_u64(DynamicArray<u8> *bytes, u64 value) {
+    for (i32 i = 0; i < 8; i++) {
+        append(bytes, (u8) (value >> (i * 8)));
+    }
+}
+
+void elf_align(DynamicArray<u8> *bytes, u64 alignment) {
+    while (alignment > 1 && bytes->len % alignment != 0) {
+        append(bytes, (u8) 0);
+    }
+}
+
+// @vm
+enum Opcode : u8 {
+    OP_Push,
+    OP_Local,
+    OP_Store,
+    OP_Add,
+    OP_CompareEqual,
+    OP_JumpIfZero,
+    OP_JumpIfNotZero,
+    OP_Jump,
+    OP_Print,
+    OP_Return,
+    OP_Halt,
+
+    // superinstructions for the sequences ir_gen emits most
+    OP_LocalAddImmediate,       // Local, Push, Add
+    OP_AddImmediate,            // Push, Add
+    OP_AddLocal,                // Local, Add
+    OP_JumpIfNotEqualImmediate, // Push, CompareEqual, IfZero
+    OP_JumpIfNotEqual,          // CompareEqual, IfZero
+    OP_JumpIfEqualImmediate,    // Push, CompareEqual, IfNotZero
+    OP_JumpIfEqual,             // CompareEqual, IfNotZero
+
+    OP_Count,
+};
+
+struct BytecodeInstruction {
+    Opcode opcode;
+    u16 local;
+    i32 value;
+
+    // index of the instruction a jump goes to, resolved from the ir label at compile time
+    i32 target;
+};
+
+struct Bytecode {
+    slice<BytecodeInstruction> instructions;
+    i32 max_stack;
+    i32 local_count;
+};
+
+struct BytecodeFixup {
+    i64 instruction;
+    i32 block;
+};
+
+const i32 VM_STACK_SIZE = 1024;
+const i32 VM_MAX_LOCALS = 1024;
+
+Bytecode bytecode_compile(Arena *arena, IR *ir, bool superinstructions);
+string bytecode_to_string(Arena *arena, Bytecode *bytecode);
+string opcode_to_string(Opcode opcode);
+
+u64 vm_run(Bytecode *bytecode, array<u64, 4> arguments, bool quiet);
+u64 vm_run_switch(Bytecode *bytecode, array<u64, 4> arguments, bool quiet);
+void vm_print(u64 value, bool quiet);
+void vm_benchmark(Arena *arena, IR *ir, array<u64, 4> arguments, i32 iterations);
+
+Bytecode bytecode_compile(Arena *arena, IR *ir, bool superinstructions) {
+    DynamicArray<BytecodeInstruction> instructions = dynamic_array_create<BytecodeInstruction>(arena, ir->instructions.len);
+    DynamicArray<BytecodeFixup> fixups = dynamic_array_create<BytecodeFixup>(arena, 16);
+
+    slice<Instruction> ir_instructions = to_slice(&ir->instructions);
+
+    static const auto matches_2 = [](slice<Instruction> instructions, i64 i, InstructionType a, InstructionType b) {
+        return i + 1 < instructions.len && instructions[i].type == a && instructions[i + 1].type == b;
+    };
+
+    static const auto matches_3 = [](slice<Instruction> instructions, i64 i, InstructionType a, InstructionType b, InstructionType c) {
+        return matches_2(instructions, i, a, b) && i + 2 < instructions.len && instructions[i + 2].type == c;
+    };
+
+    i32 depth = 0;
+    i32 max_stack = 0;
+
+    // the stack depth only depends on the ir so it is tracked there, fused or not
+    for (Instruction instruction : ir_instructions) {
+        switch (instruction.type) {
+            case IT_Push:
+            case IT_Local:
+                depth += 1;
+                break;
+            case IT_Add:
+            case IT_CompareEqual:
+            case IT_IfZero:
+            case IT_IfNotZero:
+            case IT_Print:
+            case IT_Return:
+            case IT_Store:
+                depth -= 1;
+                break;
+            default:
+                break;
+        }
+
+        if (depth > max_stack) {
+            max_stack = depth;
+        }
+    }
+
+    Assertf(max_stack <= VM_STACK_SIZE, "program needs more stack than the vm has");
+    Assertf(ir->local_count <= VM_MAX_LOCALS, "program has more locals than the vm has");
+
+    // the bytecode offset of every label, by block id
+    DynamicArray<i64> offsets = dynamic_array_create<i64>(arena, ir->block_count);
+    for (i32 b = 0; b < ir->block_count; b++) {
+        append(&offsets, (i64) -1);
+    }
+
+    i64 i = 0;
+
+    while (i < ir_instructions.len) {
+        Instruction instruction = ir_instructions[i];
+
+        // a label is its own ir instruction, so a fused sequence never spans one
+        if (superinstructions) {
+            if (matches_3(ir_instructions, i, IT_Local, IT_Push, IT_Add)) {
+                append(&instructions, BytecodeInstruction{.opcode = OP_LocalAddImmediate, .local = (u16) instruction.value, .value = ir_instructions[i + 1].value});
+                i += 3;
+                continue;
+            }
+
+            if (matches_3(ir_instructions, i, IT_Push, IT_CompareEqual, IT_IfZero)) {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = ir_instructions[i + 2].value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfNotEqualImmediate, .value = instruction.value});
+                i += 3;
+                continue;
+            }
+
+            if (matches_3(ir_instructions, i, IT_Push, IT_CompareEqual, IT_IfNotZero)) {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = ir_instructions[i + 2].value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfEqualImmediate, .value = instruction.value});
+                i += 3;
+                continue;
+            }
+
+            if (matches_2(ir_instructions, i, IT_Push, IT_Add)) {
+                append(&instructions, BytecodeInstruction{.opcode = OP_AddImmediate, .value = instruction.value});
+                i += 2;
+                continue;
+            }
+
+            if (matches_2(ir_instructions, i, IT_Local, IT_Add)) {
+                append(&instructions, BytecodeInstruction{.opcode = OP_AddLocal, .local = (u16) instruction.value});
+                i += 2;
+                continue;
+            }
+
+            if (matches_2(ir_instructions, i, IT_CompareEqual, IT_IfZero)) {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = ir_instructions[i + 1].value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfNotEqual});
+                i += 2;
+                continue;
+            }
+
+            if (matches_2(ir_instructions, i, IT_CompareEqual, IT_IfNotZero)) {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = ir_instructions[i + 1].value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfEqual});
+                i += 2;
+                continue;
+            }
+        }
+
+        switch (instruction.type) {
+            case IT_StartFunction:
+                break;
+            case IT_EndFunction: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Halt});
+            } break;
+            case IT_Push: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Push, .value = instruction.value});
+            } break;
+            case IT_Local: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Local, .local = (u16) instruction.value});
+            } break;
+            case IT_Store: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Store, .local = (u16) instruction.value});
+            } break;
+            case IT_Add: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Add});
+            } break;
+            case IT_CompareEqual: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_CompareEqual});
+            } break;
+            case IT_IfZero: {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = instruction.value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfZero});
+            } break;
+            case IT_IfNotZero: {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = instruction.value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_JumpIfNotZero});
+            } break;
+            case IT_Jump: {
+                append(&fixups, BytecodeFixup{.instruction = instructions.len, .block = instruction.value});
+                append(&instructions, BytecodeInstruction{.opcode = OP_Jump});
+            } break;
+            case IT_Label: {
+                Assertf(offsets[instruction.value] == -1, "duplicate label in bytecode_compile");
+                offsets[instruction.value] = instructions.len;
+            } break;
+            case IT_Print: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Print});
+            } break;
+            case IT_Return: {
+                append(&instructions, BytecodeInstruction{.opcode = OP_Return});
+            } break;
+            default:
+                Unreachable("unsupported instruction type in bytecode_compile");
+        }
+
+        i += 1;
+    }
+
+    for (BytecodeFixup &fixup : fixups) {
+        i64 target = offsets[fixup.block];
+        Assertf(target != -1, "jump to undefined label in bytecode_compile");
+
+        instructions[fixup.instruction].target = (i32) target;
+    }
+
+    return Bytecode{
+        .instructions = to_slice(&instructions),
+        .max_stack = max_stack,
+        .local_count = ir->local_count,
+    };
+}
+
+u64 vm_run(Bytecode *bytecode, array<u64, 4> arguments, bool quiet) {
+#if defined(COMPILER_GCC) || defined(COMPILER_CLANG)
+    // threaded dispatch, every handler jumps straight to the next one through this table
+    static void *handlers[OP_Count] = {
+        &&op_push,
+        &&op_local,
+        &&op_store,
+        &&op_add,
+        &&op_compare_equal,
+        &&op_jump_if_zero,
+        &&op_jump_if_not_zero,
+        &&op_jump,
+        &&op_print,
+        &&op_return,
+        &&op_halt,
+        &&op_local_add_immediate,
+        &&op_add_immediate,
+        &&op_add_local,
+        &&op_jump_if_not_equal_immediate,
+        &&op_jump_if_not_equal,
+        &&op_jump_if_equal_immediate,
+        &&op_jump_if_equal,
+    };
+
+    u64 stack[VM_STACK_SIZE];
+    u64 *sp = stack;
+
+    // the parameters are the first four slots, the let slots are always stored before they are read
+    u64 locals[VM_MAX_LOCALS];
+    for (i32 i = 0; i < (i32) arguments.size(); i++) {
+        locals[i] = arguments[i];
+    }
+
+    BytecodeInstruction *code = bytecode->instructions.ptr;
+    BytecodeInstruction *ip = code;
+
+    #define VM_DISPATCH() goto *handlers[ip->opcode]
+
+    VM_DISPATCH();
+
+    op_push:
+        *sp++ = (u64) (i64) ip->value;
+        ip++;
+        VM_DISPATCH();
+    op_local:
+        *sp++ = locals[ip->local];
+        ip++;
+        VM_DISPATCH();
+    op_store:
+        locals[ip->local] = *--sp;
+        ip++;
+        VM_DISPATCH();
+    op_add:
+        sp--;
+        sp[-1] += sp[0];
+        ip++;
+        VM_DISPATCH();
+    op_compare_equal:
+        sp--;
+        sp[-1] = sp[-1] == sp[0];
+        ip++;
+        VM_DISPATCH();
+    op_jump_if_zero:
+        sp--;
+        ip = sp[0] == 0 ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+    op_jump_if_not_zero:
+        sp--;
+        ip = sp[0] != 0 ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+    op_jump:
+        ip = code + ip->target;
+        VM_DISPATCH();
+    op_print:
+        sp--;
+        vm_print(sp[0], quiet);
+        ip++;
+        VM_DISPATCH();
+    op_return:
+        return sp[-1];
+    op_halt:
+        return 0;
+    op_local_add_immediate:
+        *sp++ = locals[ip->local] + (u64) (i64) ip->value;
+        ip++;
+        VM_DISPATCH();
+    op_add_immediate:
+        sp[-1] += (u64) (i64) ip->value;
+        ip++;
+        VM_DISPATCH();
+    op_add_local:
+        sp[-1] += locals[ip->local];
+        ip++;
+        VM_DISPATCH();
+    op_jump_if_not_equal_immediate:
+        sp--;
+        ip = sp[0] != (u64) (i64) ip->value ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+    op_jump_if_not_equal:
+        sp -= 2;
+        ip = sp[0] != sp[1] ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+    op_jump_if_equal_immediate:
+        sp--;
+        ip = sp[0] == (u64) (i64) ip->value ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+    op_jump_if_equal:
+        sp -= 2;
+        ip = sp[0] == sp[1] ? code + ip->target : ip + 1;
+        VM_DISPATCH();
+
+    #undef VM_DISPATCH
+#else
+    // msvc has no computed goto
+    return vm_run_switch(bytecode, arguments, quiet);
+#endif
+}
+
+u64 vm_run_switch(Bytecode *bytecode, array<u64, 4> arguments, bool quiet) {
+    u64 stack[VM_STACK_SIZE];
+    u64 *sp = stack;
+
+    // the parameters are the first four slots, the let slots are always stored before they are read
+    u64 locals[VM_MAX_LOCALS];
+    for (i32 i = 0; i < (i32) arguments.size(); i++) {
+        locals[i] = arguments[i];
+    }
+
+    BytecodeInstruction *code = bytecode->instructions.ptr;
+    BytecodeInstruction *ip = code;
+
+    while (true) {
+        switch (ip->opcode) {
+            case OP_Push: {
+                *sp++ = (u64) (i64) ip->value;
+                ip++;
+            } break;
+            case OP_Local: {
+                *sp++ = locals[ip->local];
+                ip++;
+            } break;
+            case OP_Store: {
+                locals[ip->local] = *--sp;
+                ip++;
+            } break;
+            case OP_Add: {
+                sp--;
+                sp[-1] += sp[0];
+                ip++;
+            } break;
+            case OP_CompareEqual: {
+                sp--;
+                sp[-1] = sp[-1] == sp[0];
+                ip++;
+            } break;
+            case OP_JumpIfZero: {
+                sp--;
+                ip = sp[0] == 0 ? code + ip->target : ip + 1;
+            } break;
+            case OP_JumpIfNotZero: {
+                sp--;
+                ip = sp[0] != 0 ? code + ip->target : ip + 1;
+            } break;
+            case OP_Jump: {
+                ip = code + ip->target;
+            } break;
+            case OP_Print: {
+                sp--;
+                vm_print(sp[0], quiet);
+                ip++;
+            } break;
+            case OP_Return:
+                return sp[-1];
+            case OP_Halt:
+                return 0;
+            case OP_LocalAddImmediate: {
+                *sp++ = locals[ip->local] + (u64) (i64) ip->value;
+                ip++;
+            } break;
+            case OP_AddImmediate: {
+                sp[-1] += (u64) (i64) ip->value;
+                ip++;
+            } break;
+            case OP_AddLocal: {
+                sp[-1] += locals[ip->local];
+                ip++;
+            } break;
+            case OP_JumpIfNotEqualImmediate: {
+                sp--;
+                ip = sp[0] != (u64) (i64) ip->value ? code + ip->target : ip + 1;
+            } break;
+            case OP_JumpIfNotEqual: {
+                sp -= 2;
+                ip = sp[0] != sp[1] ? code + ip->target : ip + 1;
+            } break;
+            case OP_JumpIfEqualImmediate: {
+                sp--;
+                ip = sp[0] == (u64) (i64) ip->value ? code + ip->target : ip + 1;
+            } break;
+            case OP_JumpIfEqual: {
+                sp -= 2;
+                ip = sp[0] == sp[1] ? code + ip->target : ip + 1;
+            } break;
+            default:
+                Unreachable("unsupported opcode in vm_run_switch");
+        }
+    }
+
+    return 0;
+}
+
+void vm_print(u64 value, bool quiet) {
+    if (quiet) {
+        return;
+    }
+
+    putchar((int) value);
+    putchar('\n');
+}
+
+void vm_benchmark(Arena *arena, IR *ir, array<u64, 4> arguments, i32 iterations) {
+    Bytecode naive = bytecode_compile(arena, ir, false);
+    Bytecode fused = bytecode_compile(arena, ir, true);
+
+    u64 expected = vm_run_switch(&naive, arguments, true);
+    Assertf(vm_run(&fused, arguments, true) == expected, "threaded vm disagrees with the switch vm");
+
+    // the sum keeps the calls from being optimised away
+    u64 sum = 0;
+
+    for (i32 i = 0; i < iterations / 10; i++) {
+        sum += vm_run_switch(&naive, arguments, true);
+        sum += vm_run(&fused, arguments, true);
+    }
+
+    u64 start = time_now_nanoseconds();
+    for (i32 i = 0; i < iterations; i++) {
+        sum += vm_run_switch(&naive, arguments, true);
+    }
+    u64 switch_time = time_now_nanoseconds() - start;
+
+    start = time_now_nanoseconds();
+    for (i32 i = 0; i < iterations; i++) {
+        sum += vm_run(&fused, arguments, true);
+    }
+    u64 threaded_time = time_now_nanoseconds() - start;
+
+    volatile u64 sink = sum;
+    (void) sink;
+
+    printf("vm benchmark, %d runs, result %llu\n", iterations, (unsigned long long) expected);
+    printf("  switch   %6lld instructions  %8.2f ns/run\n", (long long) naive.instructions.len, (f64) switch_time / iterations);
+    printf("  threaded %6lld instructions  %8.2f ns/run\n", (long long) fused.instructions.len, (f64) threaded_time / iterations);
+    printf("  speedup  %.2fx\n", (f64) switch_time / (f64) (threaded_time ? threaded_time : 1));
+}
+
+string bytecode_to_string(Arena *arena, Bytecode *bytecode) {
+    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+
+    for (i32 i = 0; i < bytecode->instructions.len; i++) {
+        BytecodeInstruction instruction = bytecode->instructions[i];
+
+        fmt(&bytes, "[{}] {}", i, opcode_to_string(instruction.opcode));
+
+        switch (instruction.opcode) {
+            case OP_Push:
+            case OP_AddImmediate: {
+                fmt(&bytes, " {}", instruction.value);
+            } break;
+            case OP_Local:
+            case OP_Store:
+            case OP_AddLocal: {
+                fmt(&bytes, " local {}", (i32) instruction.local);
+            } break;
+            case OP_LocalAddImmediate: {
+                fmt(&bytes, " local {} {}", (i32) instruction.local, instruction.value);
+            } break;
+            case OP_JumpIfZero:
+            case OP_JumpIfNotZero:
+            case OP_Jump:
+            case OP_JumpIfNotEqual:
+            case OP_JumpIfEqual: {
+                fmt(&bytes, " -> {}", instruction.target);
+            } break;
+            case OP_JumpIfNotEqualImmediate:
+            case OP_JumpIfEqualImmediate: {
+                fmt(&bytes, " {} -> {}", instruction.value, instruction.target);
+            } break;
+            default:
+                break;
+        }
+
+        fmt(&bytes, "\n");
+    }
+
+    return to_slice(&bytes);
+}
+
+string opcode_to_string(Opcode opcode) {
+    switch (opcode) {
+        case OP_Push:                   return "Push";
+        case OP_Local:                  return "Local";
+        case OP_Store:                  return "Store";
+        case OP_Add:                    return "Add";
+        case OP_CompareEqual:           return "CompareEqual";
+        case OP_JumpIfZero:             return "JumpIfZero";
+        case OP_JumpIfNotZero:          return "JumpIfNotZero";
+        case OP_Jump:                   return "Jump";
+        case OP_Print:                  return "Print";
+        case OP_Return:                 return "Return";
+        case OP_Halt:                   return "Halt";
+        case OP_LocalAddImmediate:      return "LocalAddImmediate";
+        case OP_AddImmediate:           return "AddImmediate";
+        case OP_AddLocal:               return "AddLocal";
+        case OP_JumpIfNotEqualImmediate:return "JumpIfNotEqualImmediate";
+        case OP_JumpIfNotEqual:         return "JumpIfNotEqual";
+        case OP_JumpIfEqualImmediate:   return "JumpIfEqualImmediate";
+        case OP_JumpIfEqual:            return "JumpIfEqual";
+        default:                        Unreachable("unsupported opcode in opcode_to_string");
+    }
+
+    return "";
+}
+
+// @stats
+// the per function phases run on the worker threads, their time is summed over every function and
+// they have no memory numbers of their own, that all lands in SP_Functions which they make up
+enum StatsPhase {
+    SP_Lex,
+    SP_Parse,
+    SP_Cache,
+    SP_Functions,
+    SP_IRGen,
+    SP_Optimise,
+    SP_RegAlloc,
+    SP_Asmgen,
+    SP_Peephole,
+    SP_Output,
+    SP_Count,
+};
+
+enum StatsFormat {
+    SF_None,
+    SF_Human,
+    SF_Json,
+};
+
+struct PhaseStats {
+    u64 nanoseconds;
+
+    // resident memory the phase added and the process peak when it ended
+    u64 memory_growth;
+    u64 memory_peak;
+};
+
+struct FunctionStats {
+    array<u64, SP_Count> nanoseconds;
+    i64 ir_instructions;
+};
+
+struct CompileStats {
+    bool enabled;
+    array<PhaseStats, SP_Count> phases;
+
+    i32 thread_count;
+    i64 source_bytes;
+    i64 tokens;
+    i64 ast_nodes;
+    i64 functions;
+    i64 ir_instructions;
+    i64 asm_instructions;
+    i64 output_bytes;
+
+    // functions loaded from and compiled for the cache, both 0 without --cache
+    i64 cache_hits;
+    i64 cache_misses;
+};
+
+struct PhaseTimer {
+    StatsPhase phase;
+    u64 start;
+    u64 memory_start;
+};
+
+PhaseTimer stats_begin(CompileStats *stats, StatsPhase phase);
+void stats_end(CompileStats *stats, PhaseTimer timer);
+void stats_add_function(CompileStats *stats, FunctionStats *function);
+void stats_print(CompileStats *stats, StatsFormat format);
+string stats_phase_to_string(StatsPhase phase);
+u64 memory_resident_bytes();
+u64 memory_peak_bytes();
+
+PhaseTimer stats_begin(CompileStats *stats, StatsPhase phase) {
+    PhaseTimer timer = {.phase = phase, .start = time_now_nanoseconds()};
+
+    if (stats->enabled) {
+        timer.memory_start = memory_resident_bytes();
+    }
+
+    return timer;
+}
+
+void stats_end(CompileStats *stats, PhaseTimer timer) {
+    PhaseStats *phase = &stats->phases[timer.phase];
+    phase->nanoseconds += time_now_nanoseconds() - timer.start;
+
+    if (stats->enabled) {
+        u64 memory_end = memory_resident_bytes();
+
+        phase->memory_growth += memory_end > timer.memory_start ? memory_end - timer.memory_start : 0;
+        phase->memory_peak = memory_peak_bytes();
+    }
+}
+
+void stats_add_function(CompileStats *stats, FunctionStats *function) {
+    for (i32 i = 0; i < SP_Count; i++) {
+        stats->phases[i].nanoseconds += function->nanoseconds[i];
+    }
+
+    stats->functions += 1;
+    stats->ir_instructions += function->ir_instructions;
+}
+
+void stats_print(CompileStats *stats, StatsFormat format) {
+    if (format == SF_Json) {
+        printf("{\n  \"phases\": [\n");
+
+        for (i32 i = 0; i < SP_Count; i++) {
+            PhaseStats phase = stats->phases[i];
+
+            string name = stats_phase_to_string((StatsPhase) i);
+
+            printf("    {\"name\": \"%.*s\", \"nanoseconds\": %llu, \"memory_growth\": %llu, \"memory_peak\": %llu}%s\n",
+                (i32) name.len, name.ptr, (unsigned long long) phase.nanoseconds,
+                (unsigned long long) phase.memory_growth, (unsigned long long) phase.memory_peak,
+                i == SP_Count - 1 ? "" : ",");
+        }
+
+        printf("  ],\n");
+        printf("  \"threads\": %d,\n", stats->thread_count);
+        printf("  \"source_bytes\": %lld,\n", (long long) stats->source_bytes);
+        printf("  \"tokens\": %lld,\n", (long long) stats->tokens);
+        printf("  \"ast_nodes\": %lld,\n", (long long) stats->ast_nodes);
+        printf("  \"functions\": %lld,\n", (long long) stats->functions);
+        printf("  \"ir_instructions\": %lld,\n", (long long) stats->ir_instructions);
+        printf("  \"asm_instructions\": %lld,\n", (long long) stats->asm_instructions);
+        printf("  \"output_bytes\": %lld,\n", (long long) stats->output_bytes);
+        printf("  \"cache_hits\": %lld,\n", (long long) stats->cache_hits);
+        printf("  \"cache_misses\": %lld\n", (long long) stats->cache_misses);
+        printf("}\n");
+
+        return;
+    }
+
+    printf("phase          time ms   memory +KB   peak KB\n");
+
+    for (i32 i = 0; i < SP_Count; i++) {
+        PhaseStats phase = stats->phases[i];
+        string name = stats_phase_to_string((StatsPhase) i);
+        bool nested = i >= SP_IRGen && i <= SP_Peephole;
+
+        printf("%s%-*.*s %9.3f", nested ? "  " : "", nested ? 12 : 14, (i32) name.len, name.ptr, (f64) phase.nanoseconds / 1e6);
+
+        if (nested) {
+            printf("            -         -\n");
+        } else {
+            printf(" %12llu %9llu\n", (unsigned long long) (phase.memory_growth / 1024), (unsigned long long) (phase.memory_peak / 1024));
+        }
+    }
+
+    printf("threads %d, %lld source bytes, %lld tokens, %lld ast nodes, %lld functions\n",
+        stats->thread_count, (long long) stats->source_bytes, (long long) stats->tokens,
+        (long long) stats->ast_nodes, (long long) stats->functions);
+    printf("%lld ir instructions, %lld asm instructions, %lld output bytes\n",
+        (long long) stats->ir_instructions, (long long) stats->asm_instructions, (long long) stats->output_bytes);
+
+    if (stats->cache_hits + stats->cache_misses > 0) {
+        printf("cache %lld hits, %lld misses\n", (long long) stats->cache_hits, (long long) stats->cache_misses);
+    }
+}
+
+string stats_phase_to_string(StatsPhase phase) {
+    switch (phase) {
+        case SP_Lex:        return "lex";
+        case SP_Parse:      return "parse";
+        case SP_Cache:      return "cache";
+        case SP_Functions:  return "functions";
+        case SP_IRGen:      return "ir_gen";
+        case SP_Optimise:   return "optimise";
+        case SP_RegAlloc:   return "regalloc";
+        case SP_Asmgen:     return "asmgen";
+        case SP_Peephole:   return "peephole";
+        case SP_Output:     return "output";
+        default:            Unreachable("unsupported phase in stats_phase_to_string");
+    }
+
+    return "";
+}
+
+// the arenas reserve up front and commit as they are touched, so resident memory is what they really used
+u64 memory_resident_bytes() {
+#if defined(OS_LINUX)
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+    i32 read = fscanf(statm, "%llu %llu", &size, &resident);
+    fclose(statm);
+
+    return read == 2 ? (u64) resident * (u64) sysconf(_SC_PAGESIZE) : 0;
+#elif defined(OS_WINDOWS)
+    return platform_resident_bytes();
+#else
+    return 0;
+#endif
+}
+
+u64 memory_peak_bytes() {
+#if defined(OS_LINUX)
+    struct rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+    // ru_maxrss is in kilobytes on linux
+    return (u64) usage.ru_maxrss * 1024;
+#elif defined(OS_WINDOWS)
+    return platform_peak_bytes();
+#else
+    return 0;
+#endif
+}
+
+// @cache
+// compiled functions are kept on disk under a hash of their tokens, the compiler build and every flag
+// that changes the code, so an unchanged function is loaded instead of parsed and compiled. files are
+// written under a temporary name and renamed into place so a reader never sees half of one
+const u32 CACHE_MAGIC = 0x48434341;
+const u32 CACHE_FORMAT_VERSION = 3;
+
+// any rebuild of the compiler may change the code it generates
+const char *CACHE_COMPILER_BUILD = __DATE__ " " __TIME__;
+
+struct CacheHeader {
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 instruction_count;
+    u32 name_bytes;
+};
+
+// names are offsets into the block of bytes that follows the instructions
+struct CacheOperand {
+    i64 value;
+    u32 name_offset;
+    u32 name_length;
+    u8 type;
+    u8 reg;
+    u8 index;
+};
+
+struct CacheInstruction {
+    u32 op;
+    array<CacheOperand, 2> operands;
+};
+
+u64 cache_seed(IRKind ir, RegAllocMode regalloc, SelectMode isel, i32 optimisation_level, Target *target);
+u64 cache_hash_function(TokenStream *tokens, FunctionSpan *span, u64 seed);
+u64 hash_bytes(u64 hash, const void *bytes, u64 size);
+bool cache_load(Arena *arena, const char *directory, u64 key, slice<AsmInstruction> *code);
+bool cache_store(Arena *arena, const char *directory, u64 key, slice<AsmInstruction> code);
+bool cache_decode(Arena *arena, slice<u8> file, u64 key, slice<AsmInstruction> *code);
+const char *cache_path(Arena *arena, const char *directory, u64 key, const char *suffix);
+bool create_directory_if_missing(const char *directory);
+bool replace_file(const char *from, const char *to);
+
+u64 cache_seed(IRKind ir, RegAllocMode regalloc, SelectMode isel, i32 optimisation_level, Target *target) {
+    u64 hash = hash_bytes(14695981039346656037ull, &CACHE_FORMAT_VERSION, sizeof(CACHE_FORMAT_VERSION));
+    hash = hash_bytes(hash, CACHE_COMPILER_BUILD, strlen(CACHE_COMPILER_BUILD));
+
+    i32 flags[] = {(i32) ir, (i32) regalloc, (i32) isel, optimisation_level, target->shadow_space, (i32) target->parameters[0]};
+    hash = hash_bytes(hash, flags, sizeof(flags));
+
+    return hash;
+}
+
+// whitespace between tokens does not change the code so only the kinds and the text are hashed
+u64 cache_hash_function(TokenStream *tokens, FunctionSpan *span, u64 seed) {
+    u64 hash = seed;
+
+    for (u32 i = span->token_start; i < span->token_end; i++) {
+        u8 kind = tokens->kinds[i];
+        u32 length = tokens->lengths[i];
+
+        hash = hash_bytes(hash, &kind, sizeof(kind));
+        hash = hash_bytes(hash, &length, sizeof(length));
+        hash = hash_bytes(hash, tokens->source.ptr + tokens->starts[i], length);
+    }
+
+    return hash;
+}
+
+// fnv-1a, 64 bit so a collision between two functions is not worth worrying about
+u64 hash_bytes(u64 hash, const void *bytes, u64 size) {
+    const u8 *cursor = (const u8 *) bytes;
+
+    for (u64 i = 0; i < size; i++) {
+        hash ^= cursor[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// false on a miss, a file that is missing, truncated or from another build is a miss
+bool cache_load(Arena *arena, const char *directory, u64 key, slice<AsmInstruction> *code) {
+    const char *path = cache_path(arena, directory, key, ".bin");
+
+#if defined(OS_LINUX)
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void *memory = mmap(NULL, (u64) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+
+    bool hit = cache_decode(arena, slice<u8>((u8 *) memory, info.st_size), key, code);
+    munmap(memory, (u64) info.st_size);
+
+    return hit;
+#elif defined(OS_WINDOWS)
+    u64 size = 0;
+    const u8 *memory = platform_map_file(path, &size);
+    if (!memory) {
+        return false;
+    }
+
+    bool hit = cache_decode(arena, slice<u8>((u8 *) memory, (i64) size), key, code);
+    platform_unmap_file(memory);
+
+    return hit;
+#else
+    return false;
+#endif
+}
+
+// copies the instructions and their names out of the mapping into the arena
+bool cache_decode(Arena *arena, slice<u8> file, u64 key, slice<AsmInstruction> *code) {
+    if (file.len < (i64) sizeof(CacheHeader)) {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, file.ptr, sizeof(header));
+
+    i64 instructions_size = (i64) header.instruction_count * (i64) sizeof(CacheInstruction);
+
+    if (header.magic != CACHE_MAGIC || header.version != CACHE_FORMAT_VERSION || header.key != key) {
+        return false;
+    }
+
+    if (file.len != (i64) sizeof(CacheHeader) + instructions_size + header.name_bytes) {
+        return false;
+    }
+
+    const u8 *records = file.ptr + sizeof(CacheHeader);
+    string names = slice_clone(arena, slice_range(file, sizeof(CacheHeader) + instructions_size, file.len));
+
+    DynamicArray<AsmInstruction> instructions = dynamic_array_create<AsmInstruction>(arena, header.instruction_count + 1);
+
+    for (u32 i = 0; i < header.instruction_count; i++) {
+        CacheInstruction record;
+        memcpy(&record, records + i * sizeof(CacheInstruction), sizeof(record));
+
+        AsmInstruction instruction = {.op = (AsmOp) record.op};
+
+        for (i32 k = 0; k < 2; k++) {
+            CacheOperand operand = record.operands[k];
+
+            if ((u64) operand.name_offset + operand.name_length > header.name_bytes) {
+                return false;
+            }
+
+            instruction.operands[k] = {
+                .type = (OperandType) operand.type,
+                .reg = (Register) operand.reg,
+                .value = operand.value,
+                .index = (Register) operand.index,
+                .name = slice_range(names, operand.name_offset, operand.name_offset + operand.name_length),
+            };
+        }
+
+        append(&instructions, instruction);
+    }
+
+    *code = to_slice(&instructions);
+
+    return true;
+}
+
+bool cache_store(Arena *arena, const char *directory, u64 key, slice<AsmInstruction> code) {
+    DynamicArray<CacheInstruction> records = dynamic_array_create<CacheInstruction>(arena, code.len + 1);
+    DynamicArray<u8> names = dynamic_array_create<u8>(arena, 256);
+
+    for (AsmInstruction &instruction : code) {
+        CacheInstruction record = {.op = (u32) instruction.op};
+
+        for (i32 k = 0; k < 2; k++) {
+            AsmOperand operand = instruction.operands[k];
+
+            record.operands[k] = {
+                .value = operand.value,
+                .name_offset = (u32) names.len,
+                .name_length = (u32) operand.name.len,
+                .type = (u8) operand.type,
+                .reg = (u8) operand.reg,
+                .index = (u8) operand.index,
+            };
+
+            for (u8 c : operand.name) {
+                append(&names, c);
+            }
+        }
+
+        append(&records, record);
+    }
+
+    CacheHeader header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_FORMAT_VERSION,
+        .key = key,
+        .instruction_count = (u32) records.len,
+        .name_bytes = (u32) names.len,
+    };
+
+    // unique per process and call, two compilers storing the same function at once each rename a whole file
+    const char *temporary = cache_path(arena, directory, key ^ time_now_nanoseconds(), ".tmp");
+    const char *path = cache_path(arena, directory, key, ".bin");
+
+    FILE *file = fopen(temporary, "wb");
+    if (!file) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(records.ptr, sizeof(CacheInstruction), records.len, file) == (u64) records.len;
+    ok = ok && fwrite(names.ptr, 1, names.len, file) == (u64) names.len;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || !replace_file(temporary, path)) {
+        remove(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+const char *cache_path(Arena *arena, const char *directory, u64 key, const char *suffix) {
+    DynamicArray<u8> path = dynamic_array_create<u8>(arena, 256);
+    fmt(&path, "{}/", string(directory));
+
+    for (i32 shift = 60; shift >= 0; shift -= 4) {
+        append(&path, (u8) "0123456789abcdef"[(key >> shift) & 0xF]);
+    }
+
+    fmt(&path, "{}", string(suffix));
+    append(&path, (u8) 0);
+
+    return (const char *) path.ptr;
+}
+
+// true when the directory exists afterwards
+bool create_directory_if_missing(const char *directory) {
+#if defined(OS_LINUX)
+    return mkdir(directory, 0755) == 0 || errno == EEXIST;
+#elif defined(OS_WINDOWS)
+    return platform_create_directory(directory);
+#else
+    return false;
+#endif
+}
+
+// moves from over to, replacing to when it exists. rename does that on linux but fails on windows
+bool replace_file(const char *from, const char *to) {
+#if defined(OS_WINDOWS)
+    return platform_replace_file(from, to);
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// @driver
+// debug dumps, each one is only built when asked for with --emit
+enum EmitKind {
+    EK_Tokens,
+    EK_AST,
+    EK_IR,
+    EK_Asm,
+    EK_Count,
+};
+
+struct Options {
+    LexMode lex_mode;
+    IRKind ir;
+    RegAllocMode regalloc;
+    SelectMode isel;
+    i32 optimisation_level;
+
+    // jit the function and call it instead of writing asm
+    bool run;
+    array<u64, 4> run_arguments;
+
+    // write a linux object file instead of asm, NULL when not requested
+    const char *object_path;
+
+    // interpret the stack ir instead of generating code, shares run_arguments with --run
+    bool vm;
+    i32 vm_benchmark_iterations;
+
+    // size of the synthetic source the lexer benchmark runs on, 0 when not requested
+    i32 lex_benchmark_megabytes;
+
+    // sources of at least this many megabytes are lexed in chunks on every thread, 0 never does
+    i32 parallel_lex_megabytes;
+
+    // functions are compiled in parallel on this many threads
+    i32 thread_count;
+
+    // print per phase timings and counts once the output is written
+    StatsFormat stats;
+
+    // one bit per EmitKind, dumps go to stdout unless dump_directory is set, then each gets its own file
+    u32 emit;
+    const char *dump_directory;
+
+    // compiled functions are reused from here, NULL when not requested
+    const char *cache_directory;
+
+    // compile many sources on one context, from stdin or from a manifest of paths when batch_manifest is set
+    bool batch;
+    const char *batch_manifest;
+
+    // stay resident and recompile what changed whenever the source file is saved
+    bool watch;
+
+    // read, compile and write one function at a time so memory does not grow with the file
+    bool pipeline;
+};
+
+// a phase dump made on a worker thread, written from the main thread once every function is done
+struct PhaseDump {
+    const char *title;
+    string text;
+};
+
+// per thread state. a function is compiled in scratch, which is reset once its code and dumps are copied
+// to arena, so only the results of a module accumulate and not the ir and allocator state behind them
+struct CompileWorker {
+    Arena arena;
+    Arena scratch;
+
+    // symbol table lent to ir_gen and ssa_gen, all -1 between functions
+    slice<i32> slots;
+};
+
+struct CompiledFunction {
+    slice<AsmInstruction> code;
+    slice<PhaseDump> dumps;
+    FunctionStats stats;
+
+    // NULL unless ir generation rejected the function, nothing else is filled in then
+    const char *error;
+};
+
+// one function node per task, results are written to the task's own index so the module comes out
+// in source order no matter which thread compiled what
+struct CompileJob {
+    AST *ast;
+    Options *options;
+    Target *target;
+    bool dump_ir;
+
+    slice<NodeIndex> functions;
+    slice<CompileWorker> workers;
+    slice<CompiledFunction> results;
+};
+
+CompileWorker compile_worker_create();
+void compile_worker_destroy(CompileWorker *worker);
+void compile_function_task(void *context, i32 worker, i64 index);
+CompiledFunction compile_function(CompileJob *job, CompileWorker *worker, NodeIndex function);
+bool compile_ir(Arena *arena, CompileJob *job, CompileWorker *worker, NodeIndex function, DynamicArray<PhaseDump> *dumps, FunctionStats *stats, IR *ir);
+void compile_report(AST *ast, NodeIndex function, const char *error);
+slice<AsmInstruction> compile_copy_code(Arena *arena, slice<AsmInstruction> code);
+bool dump_begin(Arena *arena, Options *options, EmitKind kind, Writer *writer);
+void dump_end(Writer *writer);
+void dump_phases(Writer *writer, slice<PhaseDump> dumps);
+string emit_kind_to_string(EmitKind kind);
+
+CompileWorker compile_worker_create() {
+    return {.arena = arena_create(GB(1)), .scratch = arena_create(GB(1))};
+}
+
+void compile_worker_destroy(CompileWorker *worker) {
+    arena_destroy(&worker->scratch);
+    arena_destroy(&worker->arena);
+}
+
+void compile_function_task(void *context, i32 worker, i64 index) {
+    CompileJob *job = (CompileJob *) context;
+    job->results[index] = compile_function(job, &job->workers[worker], job->functions[index]);
+}
+
+CompiledFunction compile_function(CompileJob *job, CompileWorker *worker, NodeIndex function) {
+    Arena *arena = &worker->scratch;
+    Options *options = job->options;
+
+    DynamicArray<PhaseDump> dumps = dynamic_array_create<PhaseDump>(arena, 8);
+    FunctionStats stats = {};
+    slice<AsmInstruction> code = {};
+
+    // the dumps are made between the timed regions so they never count towards a phase
+    u64 start = 0;
+
+    if (options->ir == IK_SSA) {
+        start = time_now_nanoseconds();
+
+        // the ssa form is always lowered through the linear scan allocator
+        SSAFunction ssa = {};
+        bool generated = ssa_gen(arena, job->ast, function, worker->slots, &ssa);
+
+        stats.nanoseconds[SP_IRGen] += time_now_nanoseconds() - start;
+
+        if (!generated) {
+            arena_reset(arena);
+            return {.error = ssa.error};
+        }
+
+        for (SSABlock &block : ssa.blocks) {
+            stats.ir_instructions += block.instructions.len;
+        }
+
+        if (job->dump_ir) {
+            append(&dumps, PhaseDump{"=== SSA ===", ssa_to_string(arena, &ssa)});
+        }
+
+        if (options->optimisation_level > 0) {
+            start = time_now_nanoseconds();
+            OptStats opt_stats = opt_run_ssa(arena, &ssa, options->optimisation_level);
+            stats.nanoseconds[SP_Optimise] += time_now_nanoseconds() - start;
+
+            if (job->dump_ir) {
+                append(&dumps, PhaseDump{"=== OPTIMISED SSA ===", ssa_to_string(arena, &ssa)});
+                append(&dumps, PhaseDump{"=== OPT ===", opt_stats_to_string(arena, &opt_stats)});
+            }
+        }
+
+        start = time_now_nanoseconds();
+        RegAlloc allocation = regalloc_ssa(arena, &ssa, job->target);
+        stats.nanoseconds[SP_RegAlloc] += time_now_nanoseconds() - start;
+
+        if (job->dump_ir) {
+            append(&dumps, PhaseDump{"=== REGALLOC ===", regalloc_to_string(arena, &allocation)});
+        }
+
+        start = time_now_nanoseconds();
+        code = asmgen_ssa(arena, &ssa, &allocation);
+        stats.nanoseconds[SP_Asmgen] += time_now_nanoseconds() - start;
+    } else {
+        IR ir = {};
+        if (!compile_ir(arena, job, worker, function, &dumps, &stats, &ir)) {
+            arena_reset(arena);
+            return {.error = ir.error};
+        }
+
+        if (options->regalloc == RA_Linear) {
+            start = time_now_nanoseconds();
+            RegAlloc allocation = regalloc_linear(arena, &ir, job->target);
+            stats.nanoseconds[SP_RegAlloc] += time_now_nanoseconds() - start;
+
+            if (job->dump_ir) {
+                append(&dumps, PhaseDump{"=== REGALLOC ===", regalloc_to_string(arena, &allocation)});
+            }
+
+            start = time_now_nanoseconds();
+            code = asmgen_linear(arena, &ir, &allocation);
+            stats.nanoseconds[SP_Asmgen] += time_now_nanoseconds() - start;
+        } else if (options->isel == SM_Tree) {
+            start = time_now_nanoseconds();
+            code = asmgen_tree(arena, &ir, job->target);
+            stats.nanoseconds[SP_Asmgen] += time_now_nanoseconds() - start;
+
+            // what the stack lowering makes of the same ir, only built for the dump
+            if (job->dump_ir) {
+                DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 64);
+                fmt(&bytes, "instructions: {} -> {}\n", asm_instruction_count(asmgen(arena, &ir, job->target)), asm_instruction_count(code));
+
+                append(&dumps, PhaseDump{"=== ISEL ===", to_slice(&bytes)});
+            }
+        } else {
+            start = time_now_nanoseconds();
+            code = asmgen(arena, &ir, job->target);
+            stats.nanoseconds[SP_Asmgen] += time_now_nanoseconds() - start;
+        }
+    }
+
+    if (options->optimisation_level > 0) {
+        start = time_now_nanoseconds();
+        PeepholeStats peephole_stats = peephole(&code);
+        stats.nanoseconds[SP_Peephole] += time_now_nanoseconds() - start;
+
+        if (job->dump_ir) {
+            append(&dumps, PhaseDump{"=== PEEPHOLE ===", peephole_stats_to_string(arena, &peephole_stats)});
+        }
+    }
+
+    // everything else the function needed goes with the scratch arena
+    slice<PhaseDump> kept = slice_clone(&worker->arena, to_slice(&dumps));
+    for (PhaseDump &dump : kept) {
+        dump.text = slice_clone(&worker->arena, dump.text);
+    }
+
+    CompiledFunction compiled = {.code = compile_copy_code(&worker->arena, code), .dumps = kept, .stats = stats};
+    arena_reset(arena);
+
+    return compiled;
+}
+
+// the instructions and the label names they point at, block labels are formatted into the scratch arena
+slice<AsmInstruction> compile_copy_code(Arena *arena, slice<AsmInstruction> code) {
+    i64 name_bytes = 0;
+    for (AsmInstruction &instruction : code) {
+        name_bytes += instruction.operands[0].name.len + instruction.operands[1].name.len;
+    }
+
+    slice<AsmInstruction> result = slice_clone(arena, code);
+    DynamicArray<u8> names = dynamic_array_create<u8>(arena, name_bytes + 1);
+
+    for (AsmInstruction &instruction : result) {
+        for (AsmOperand &operand : instruction.operands) {
+            if (operand.name.len == 0) {
+                continue;
+            }
+
+            i64 start = names.len;
+            for (u8 c : operand.name) {
+                append(&names, c);
+            }
+
+            operand.name = slice_range(to_slice(&names), start, names.len);
+        }
+    }
+
+    return result;
+}
+
+// stack ir generation and optimisation, shared by the code generators and the vm. false when ir_gen
+// rejected the function, ir->error says why
+bool compile_ir(Arena *arena, CompileJob *job, CompileWorker *worker, NodeIndex function, DynamicArray<PhaseDump> *dumps, FunctionStats *stats, IR *ir) {
+    Options *options = job->options;
+
+    u64 start = time_now_nanoseconds();
+    bool generated = ir_gen(arena, job->ast, function, worker->slots, ir);
+    stats->nanoseconds[SP_IRGen] += time_now_nanoseconds() - start;
+
+    if (!generated) {
+        return false;
+    }
+
+    stats->ir_instructions += ir->instructions.len;
+
+    if (job->dump_ir) {
+        append(dumps, PhaseDump{"=== IR ===", ir_to_string(arena, ir)});
+    }
+
+    if (options->optimisation_level > 0) {
+        start = time_now_nanoseconds();
+        OptStats opt_stats = opt_run(arena, ir, options->optimisation_level);
+        stats->nanoseconds[SP_Optimise] += time_now_nanoseconds() - start;
+
+        if (job->dump_ir) {
+            append(dumps, PhaseDump{"=== OPTIMISED IR ===", ir_to_string(arena, ir)});
+            append(dumps, PhaseDump{"=== OPT ===", opt_stats_to_string(arena, &opt_stats)});
+        }
+    }
+
+    if (job->dump_ir) {
+        CFG cfg = ir_build_cfg(arena, ir);
+        append(dumps, PhaseDump{"=== CFG ===", cfg_to_string(arena, &cfg)});
+    }
+
+    return true;
+}
+
+void compile_report(AST *ast, NodeIndex function, const char *error) {
+    string name = ast_symbol(ast, ast_function(ast, function)->name);
+
+    printf("Function: '%.*s'\n", (int) name.len, (const char *) name.ptr);
+    Err(error);
+}
+
+// false when the dump was not requested, the writer streams to its file or stdout until dump_end
+bool dump_begin(Arena *arena, Options *options, EmitKind kind, Writer *writer) {
+    if (!(options->emit & (1u << kind))) {
+        return false;
+    }
+
+    // on stdout every dump is headed like the log sections were, the ir phases carry their own titles
+    if (!options->dump_directory) {
+        static const char *titles[EK_Count] = {"=== TOKENS ===\n", "=== AST ===\n", "", "=== ASSEMBLY ===\n"};
+
+        *writer = writer_create(arena, stdout);
+        writer_write(writer, string(titles[kind]));
+
+        return true;
+    }
+
+    string name = emit_kind_to_string(kind);
+
+    DynamicArray<u8> path = dynamic_array_create<u8>(arena, 256);
+    fmt(&path, "{}/{}.txt", string(options->dump_directory), name);
+    append(&path, (u8) 0);
+
+    FILE *file = fopen((const char *) path.ptr, "wb");
+    if (!file) {
+        printf("Dump: '%s'\n", (const char *) path.ptr);
+        Err("Failed to create dump file");
+        return false;
+    }
+
+    *writer = writer_create(arena, file);
+
+    return true;
+}
+
+void dump_end(Writer *writer) {
+    writer_flush(writer);
+
+    if (writer->file != stdout) {
+        fclose(writer->file);
+    }
+}
+
+void dump_phases(Writer *writer, slice<PhaseDump> dumps) {
+    for (PhaseDump &dump : dumps) {
+        fmt(&writer->buffer, "{}\n", string(dump.title));
+        writer_write(writer, dump.text);
+        fmt(&writer->buffer, "\n");
+    }
+}
+
+string emit_kind_to_string(EmitKind kind) {
+    switch (kind) {
+        case EK_Tokens: return "tokens";
+        case EK_AST:    return "ast";
+        case EK_IR:     return "ir";
+        case EK_Asm:    return "asm";
+        default:        Unreachable("unsupported kind in emit_kind_to_string");
+    }
+
+    return "";
+}
+
+// @context
+// the compiler as a library. a context keeps its arenas and worker state alive between compilations and
+// resets them at the start of the next one, so compiling many small sources in one process costs no
+// process launch or arena setup per source
+enum CompileTarget {
+    CT_Asm,
+    CT_Object,
+    CT_Jit,
+
+    // the optimised stack ir and bytecode of the first function, for the vm
+    CT_Bytecode,
+};
+
+// everything in here lives until the next compilation on the same context
+struct CompileResult {
+    // CT_Asm listing unless it was streamed to CompilerContext.asm_file, or CT_Object elf object
+    string output;
+
+    // CT_Jit, the first function of the module
+    JitFunction function;
+
+    // CT_Bytecode
+    IR ir;
+    Bytecode bytecode;
+
+    CompileStats stats;
+};
+
+struct CompilerContext {
+    Options options;
+    Arena arena;
+
+    // created once, their arenas are reset with the context
+    i32 worker_count;
+    array<CompileWorker, POOL_MAX_THREADS> workers;
+
+    // the code of the last CT_Jit compilation, unmapped by the next one
+    Jit jit;
+
+    // when set CT_Asm listings are written here through a fixed size buffer as they are produced and
+    // CompileResult.output stays empty, so the listing is never held in memory whole
+    FILE *asm_file;
+};
+
+CompilerContext compiler_create(Options *options);
+void compiler_destroy(CompilerContext *context);
+void compiler_reset(CompilerContext *context);
+bool compiler_compile(CompilerContext *context, string source, CompileTarget target, CompileResult *result);
+
+CompilerContext compiler_create(Options *options) {
+    CompilerContext context = {
+        .options = *options,
+        .arena = arena_create(GB(1)),
+        .worker_count = options->thread_count,
+    };
+
+    for (i32 i = 0; i < context.worker_count; i++) {
+        context.workers[i] = compile_worker_create();
+    }
+
+    return context;
+}
+
+void compiler_destroy(CompilerContext *context) {
+    jit_destroy(&context->jit);
+
+    for (i32 i = 0; i < context->worker_count; i++) {
+        compile_worker_destroy(&context->workers[i]);
+    }
+
+    arena_destroy(&context->arena);
+}
+
+void compiler_reset(CompilerContext *context) {
+    jit_destroy(&context->jit);
+
+    for (i32 i = 0; i < context->worker_count; i++) {
+        arena_reset(&context->workers[i].arena);
+    }
+
+    arena_reset(&context->arena);
+}
+
+bool compiler_compile(CompilerContext *context, string source, CompileTarget target, CompileResult *result) {
+    compiler_reset(context);
+
+    Arena *arena = &context->arena;
+    Options *options = &context->options;
+
+    *result = {};
+
+    CompileStats *stats = &result->stats;
+    *stats = {.enabled = options->stats != SF_None, .source_bytes = source.len};
+
+    // a dump that cannot be written fails the compilation instead of going missing
+    if (options->emit && options->dump_directory && !create_directory_if_missing(options->dump_directory)) {
+        printf("Dump: '%s'\n", options->dump_directory);
+        Err("Failed to create dump directory");
+        return false;
+    }
+
+    // the cache finds and hashes functions on the token arrays, so with it on the source is always lexed
+    // in batch. the vm runs stack ir, which is never cached
+    bool cached = options->cache_directory && target != CT_Bytecode;
+    bool stream = options->lex_mode == LM_Stream && !cached;
+
+    TokenStream tokens = {};
+
+    if (!stream) {
+        i64 parallel_bytes = (i64) MB(options->parallel_lex_megabytes);
+
+        PhaseTimer lex_timer = stats_begin(stats, SP_Lex);
+        if (parallel_bytes > 0 && source.len >= parallel_bytes) {
+            tokens = lex_parallel(arena, source, context->worker_count);
+        } else {
+            tokens = lex(arena, source);
+        }
+        stats_end(stats, lex_timer);
+    }
+
+    Writer dump = {};
+
+    if (dump_begin(arena, options, EK_Tokens, &dump)) {
+        // a streaming parse keeps no tokens, so the dump lexes its own copy
+        if (stream) {
+            tokens = lex(arena, source);
+        }
+
+        tokens_write(&dump, &tokens);
+        dump_end(&dump);
+    }
+
+    // the jit and the object writer both target linux, MASM output is linked on windows
+    Target *abi = target == CT_Jit || target == CT_Object ? &target_sysv : &target_win64;
+
+    // with the cache on only the functions that missed are parsed and compiled, the rest are loaded.
+    // either way results has every function in source order
+    slice<FunctionSpan> spans = {};
+    slice<CompiledFunction> results = {};
+
+    DynamicArray<u64> keys = {};
+    DynamicArray<FunctionSpan> misses = {};
+    DynamicArray<i64> miss_slots = {};
+
+    if (cached) {
+        PhaseTimer cache_timer = stats_begin(stats, SP_Cache);
+
+        if (!module_split(arena, &tokens, &spans)) {
+            return false;
+        }
+
+        u64 seed = cache_seed(options->ir, options->regalloc, options->isel, options->optimisation_level, abi);
+
+        DynamicArray<CompiledFunction> loaded = dynamic_array_create<CompiledFunction>(arena, spans.len);
+        keys = dynamic_array_create<u64>(arena, spans.len);
+        misses = dynamic_array_create<FunctionSpan>(arena, spans.len);
+        miss_slots = dynamic_array_create<i64>(arena, spans.len);
+
+        for (i64 i = 0; i < spans.len; i++) {
+            u64 key = cache_hash_function(&tokens, &spans[i], seed);
+            append(&keys, key);
+
+            CompiledFunction function = {};
+
+            if (cache_load(arena, options->cache_directory, key, &function.code)) {
+                stats->cache_hits += 1;
+            } else {
+                append(&misses, spans[i]);
+                append(&miss_slots, i);
+            }
+
+            append(&loaded, function);
+        }
+
+        stats->cache_misses = misses.len;
+        results = to_slice(&loaded);
+
+        stats_end(stats, cache_timer);
+    }
+
+    // when streaming the lexing happens inside the parser and is timed as part of it
+    PhaseTimer parse_timer = stats_begin(stats, SP_Parse);
+    AST *ast = arena_alloc<AST>(arena);
+
+    bool parsed = false;
+    if (cached) {
+        parsed = parse_spans(arena, &tokens, to_slice(&misses), ast);
+    } else {
+        parsed = stream ? parse_stream(arena, source, ast) : parse(arena, &tokens, ast);
+    }
+
+    stats_end(stats, parse_timer);
+
+    if (!parsed) {
+        return false;
+    }
+
+    stats->tokens = ast->token_count;
+    stats->ast_nodes = ast->nodes.len;
+
+    if (dump_begin(arena, options, EK_AST, &dump)) {
+        ast_write(&dump, ast);
+        dump_end(&dump);
+    }
+
+    slice<NodeIndex> functions = ast_range(ast, ast->module);
+
+    // the vm runs the first function on its own, so only one worker is ever needed for it. when
+    // everything came from the cache there is nothing to compile, one worker idles
+    i32 thread_count = context->worker_count;
+    if (functions.len < thread_count) {
+        thread_count = (i32) functions.len;
+    }
+
+    if (target == CT_Bytecode || thread_count < 1) {
+        thread_count = 1;
+    }
+
+    stats->thread_count = thread_count;
+
+    for (i32 i = 0; i < thread_count; i++) {
+        CompileWorker *worker = &context->workers[i];
+        worker->slots = ir_symbol_table_create(&worker->arena, symbol_count(ast->interner));
+    }
+
+    DynamicArray<CompiledFunction> compiled = dynamic_array_create<CompiledFunction>(arena, functions.len + 1);
+    compiled.len = functions.len;
+
+    if (!cached) {
+        results = to_slice(&compiled);
+    }
+
+    CompileJob job = {
+        .ast = ast,
+        .options = options,
+        .target = abi,
+        .dump_ir = (options->emit & (1u << EK_IR)) != 0,
+        .functions = functions,
+        .workers = slice<CompileWorker>(context->workers.data(), thread_count),
+        .results = to_slice(&compiled),
+    };
+
+    if (target == CT_Bytecode) {
+        DynamicArray<PhaseDump> dumps = dynamic_array_create<PhaseDump>(arena, 8);
+        FunctionStats function_stats = {};
+
+        PhaseTimer functions_timer = stats_begin(stats, SP_Functions);
+        bool generated = compile_ir(arena, &job, &job.workers[0], functions[0], &dumps, &function_stats, &result->ir);
+        stats_end(stats, functions_timer);
+
+        if (!generated) {
+            compile_report(ast, functions[0], result->ir.error);
+            return false;
+        }
+
+        stats_add_function(stats, &function_stats);
+
+        PhaseTimer output_timer = stats_begin(stats, SP_Output);
+        result->bytecode = bytecode_compile(arena, &result->ir, true);
+        stats_end(stats, output_timer);
+
+        if (dump_begin(arena, options, EK_IR, &dump)) {
+            append(&dumps, PhaseDump{"=== BYTECODE ===", bytecode_to_string(arena, &result->bytecode)});
+
+            dump_phases(&dump, to_slice(&dumps));
+            dump_end(&dump);
+        }
+
+        return true;
+    }
+
+    PhaseTimer functions_timer = stats_begin(stats, SP_Functions);
+
+    ThreadPool pool = {.thread_count = thread_count};
+    pool_run(&pool, functions.len, compile_function_task, &job);
+
+    stats_end(stats, functions_timer);
+
+    // every rejected function is reported in source order, then the compilation fails as a whole
+    bool rejected = false;
+    for (i64 i = 0; i < compiled.len; i++) {
+        if (compiled[i].error) {
+            compile_report(ast, functions[i], compiled[i].error);
+            rejected = true;
+        }
+    }
+
+    if (rejected) {
+        return false;
+    }
+
+    if (cached && compiled.len > 0) {
+        PhaseTimer cache_timer = stats_begin(stats, SP_Cache);
+
+        // a cache that cannot be written only costs the next compile its hits
+        bool writable = create_directory_if_missing(options->cache_directory);
+        if (!writable) {
+            printf("Cache: '%s'\n", options->cache_directory);
+            Err("Failed to create cache directory");
+        }
+
+        for (i64 k = 0; k < compiled.len; k++) {
+            i64 slot = miss_slots[k];
+            results[slot] = compiled[k];
+
+            if (writable) {
+                cache_store(arena, options->cache_directory, keys[slot], compiled[k].code);
+            }
+        }
+
+        stats_end(stats, cache_timer);
+    }
+
+    if (dump_begin(arena, options, EK_IR, &dump)) {
+        for (CompiledFunction &compiled : results) {
+            dump_phases(&dump, compiled.dumps);
+        }
+
+        dump_end(&dump);
+    }
+
+    // concatenated in source order, labels only have to be unique within a function
+    i64 instruction_count = 0;
+    for (CompiledFunction &compiled : results) {
+        stats_add_function(stats, &compiled.stats);
+        instruction_count += compiled.code.len;
+    }
+
+    stats->asm_instructions = instruction_count;
+
+    // a streamed listing goes out function by function, the module is only put in one piece for the
+    // targets and the dump that need it
+    bool streamed = target == CT_Asm && context->asm_file;
+
+    slice<AsmInstruction> code = {};
+    if (!streamed || (options->emit & (1u << EK_Asm))) {
+        DynamicArray<AsmInstruction> module_code = dynamic_array_create<AsmInstruction>(arena, instruction_count + 1);
+        for (CompiledFunction &compiled : results) {
+            for (AsmInstruction &instruction : compiled.code) {
+                append(&module_code, instruction);
+            }
+        }
+
+        code = to_slice(&module_code);
+    }
+
+    if (dump_begin(arena, options, EK_Asm, &dump)) {
+        asm_write(&dump, code);
+        dump_end(&dump);
+    }
+
+    PhaseTimer output_timer = stats_begin(stats, SP_Output);
+
+    switch (target) {
+        case CT_Asm: {
+            if (streamed) {
+                Writer writer = writer_create(arena, context->asm_file);
+
+                asm_write_header(&writer);
+                for (CompiledFunction &compiled : results) {
+                    asm_write_code(&writer, compiled.code);
+                }
+                asm_write_footer(&writer);
+
+                writer_flush(&writer);
+                stats->output_bytes = writer.written;
+
+                break;
+            }
+
+            // the listing is only built when it is the output, --emit=asm streams its own copy
+            result->output = asm_to_string(arena, code);
+        } break;
+        case CT_Object: {
+            MachineCode machine_code = encode(arena, code, {});
+            result->output = elf_write_object(arena, &machine_code);
+        } break;
+        case CT_Jit: {
+            // the first function of the module is the entry point, it may not have been parsed
+            string entry = cached ? spans[0].name : ast_symbol(ast, ast_function(ast, functions[0])->name);
+
+            if (!jit_compile(arena, code, entry, &context->jit)) {
+                return false;
+            }
+
+            result->function = context->jit.function;
+        } break;
+        default:
+            Unreachable("unsupported target in compiler_compile");
+    }
+
+    stats_end(stats, output_timer);
+
+    if (!streamed) {
+        stats->output_bytes = target == CT_Jit ? (i64) context->jit.size : result->output.len;
+    }
+
+    return true;
+}
+
+// @watch
+// --watch stays resident and keeps every function of the module with its listing. when the file changes
+// the old and new source are compared from both ends, the edit is widened to the functions it touches
+// and only that region is lexed, parsed and compiled again. the listing is then stitched back together
+// from the per function text, comparing and writing the file are the only passes over all of it.
+// a change that does not compile is reported and dropped, the last source and listing that did are kept
+const i32 WATCH_POLL_MILLISECONDS = 50;
+const i64 WATCH_COMPARE_BLOCK = 4096;
+
+// replaced listings are only copied away once they outweigh the live ones and this
+const i64 WATCH_COMPACT_SIZE = MB(1);
+
+struct WatchFunction {
+    // byte range in the current source, only whitespace lies between functions
+    i64 start;
+    i64 end;
+
+    // this function's part of the listing
+    string text;
+};
+
+struct WatchState {
+    Options *options;
+
+    // arena holds the functions and their listings, spare is where watch_compact copies the live ones
+    // before the two swap, so the listings an edit replaces are not kept forever
+    Arena arenas[2];
+    Arena *arena;
+    Arena *spare;
+    i64 live_bytes;
+    i64 dead_bytes;
+
+    // the region's tokens, ast and listings before they are kept, reset on every change
+    Arena scratch;
+
+    // reset after every region, nothing it holds is needed once the listing is made
+    CompileWorker worker;
+
+    // the last source that compiled, read_entire_file's buffer owned by the watcher
+    string source;
+    DynamicArray<WatchFunction> functions;
+
+    // the writer and the function texts in order for one vectored write, neither grows after the first
+    Arena output_arena;
+    Writer output;
+    DynamicArray<string> pieces;
+};
+
+i32 watch_run(Options *options, const char *path, const char *output_path);
+bool watch_update(WatchState *state, string source, i64 *recompiled);
+bool watch_compile_region(WatchState *state, string source, i64 start, i64 end, DynamicArray<WatchFunction> *functions);
+void watch_compact(WatchState *state);
+bool watch_write(WatchState *state, const char *output_path);
+u64 watch_file_time(const char *path);
+
+i32 watch_run(Options *options, const char *path, const char *output_path) {
+    WatchState state = {
+        .options = options,
+        .arenas = {arena_create(GB(1)), arena_create(GB(1))},
+        .scratch = arena_create(GB(1)),
+        .worker = compile_worker_create(),
+        .output_arena = arena_create(MB(64)),
+    };
+
+    state.arena = &state.arenas[0];
+    state.spare = &state.arenas[1];
+
+    state.functions = dynamic_array_create<WatchFunction>(state.arena, 64);
+    state.output = writer_create(&state.output_arena, NULL);
+    state.pieces = dynamic_array_create<string>(&state.output_arena, 64);
+
+    u64 file_time = watch_file_time(path);
+    bool first = true;
+
+    while (true) {
+        u64 time = watch_file_time(path);
+
+        if (first || time != file_time) {
+            file_time = time;
+
+            // an editor may have the file truncated or moved away for a moment while it saves
+            string source = read_entire_file(path);
+            string old = state.source;
+
+            if (source.len > 0) {
+                i64 recompiled = -1;
+
+                u64 start = time_now_nanoseconds();
+                bool ok = watch_update(&state, source, &recompiled);
+                u64 compiled = time_now_nanoseconds();
+
+                if (!ok) {
+                    printf("watch, the change did not compile, keeping the last listing\n");
+                    fflush(stdout);
+                } else if (recompiled >= 0) {
+                    if (!watch_write(&state, output_path)) {
+                        return 1;
+                    }
+
+                    u64 written = time_now_nanoseconds();
+
+                    printf("watch, %lld of %lld functions recompiled in %.3f ms, listing written in %.3f ms\n",
+                        (long long) recompiled, (long long) state.functions.len,
+                        (f64) (compiled - start) / 1e6, (f64) (written - compiled) / 1e6);
+                    fflush(stdout);
+                }
+
+                first = false;
+            }
+
+            // whichever of the two buffers the watcher did not keep
+            free((void *) (state.source.ptr == source.ptr ? old.ptr : source.ptr));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MILLISECONDS));
+    }
+}
+
+// false when source does not compile, the state is then left as it was. recompiled is how many functions
+// were compiled, -1 when the source did not change
+bool watch_update(WatchState *state, string source, i64 *recompiled) {
+    string old = state->source;
+    slice<WatchFunction> functions = to_slice(&state->functions);
+
+    // the functions in [a, b] are replaced by what source[region_start, region_end) compiles to
+    i64 a = 0;
+    i64 b = -1;
+    i64 region_start = 0;
+    i64 region_end = source.len;
+    i64 delta = 0;
+
+    if (old.len > 0 || functions.len > 0) {
+        i64 shorter = old.len < source.len ? old.len : source.len;
+
+        // whole blocks first, the bytes of the block that differs after
+        i64 prefix = 0;
+        while (prefix + WATCH_COMPARE_BLOCK <= shorter && memcmp(old.ptr + prefix, source.ptr + prefix, WATCH_COMPARE_BLOCK) == 0) {
+            prefix += WATCH_COMPARE_BLOCK;
+        }
+
+        while (prefix < shorter && old[prefix] == source[prefix]) {
+            prefix += 1;
+        }
+
+        if (prefix == old.len && prefix == source.len) {
+            *recompiled = -1;
+            return true;
+        }
+
+        i64 suffix = 0;
+        while (suffix + WATCH_COMPARE_BLOCK <= shorter - prefix
+            && memcmp(old.ptr + old.len - suffix - WATCH_COMPARE_BLOCK, source.ptr + source.len - suffix - WATCH_COMPARE_BLOCK, WATCH_COMPARE_BLOCK) == 0) {
+            suffix += WATCH_COMPARE_BLOCK;
+        }
+
+        while (suffix < shorter - prefix && old[old.len - 1 - suffix] == source[source.len - 1 - suffix]) {
+            suffix += 1;
+        }
+
+        i64 changed_end = old.len - suffix;
+        delta = source.len - old.len;
+
+        // functions that touch the edit at either end are redone too, text typed right against one can
+        // join its first or last token. a and b may cross when the edit is only in whitespace between two
+        while (a < functions.len && functions[a].end < prefix) {
+            a += 1;
+        }
+
+        b = functions.len - 1;
+        while (b >= 0 && functions[b].start > changed_end) {
+            b -= 1;
+        }
+
+        // the region runs from the end of the function before to the start of the one after, both stay
+        // token boundaries as every function ends in a brace and the bytes around the edit are unchanged
+        region_start = a > 0 ? functions[a - 1].end : 0;
+        region_end = b + 1 < functions.len ? functions[b + 1].start + delta : source.len;
+    }
+
+    arena_reset(&state->scratch);
+
+    DynamicArray<WatchFunction> region = dynamic_array_create<WatchFunction>(&state->scratch, 16);
+    if (!watch_compile_region(state, source, region_start, region_end, &region)) {
+        return false;
+    }
+
+    state->source = source;
+    *recompiled = region.len;
+
+    // the region's listings are kept from here, the ones they replace are dead until the next compaction
+    for (WatchFunction &function : region) {
+        function.text = slice_clone(state->arena, function.text);
+        state->live_bytes += function.text.len;
+    }
+
+    for (i64 i = a; i <= b; i++) {
+        state->live_bytes -= functions[i].text.len;
+        state->dead_bytes += functions[i].text.len;
+    }
+
+    for (i64 i = b + 1; i < functions.len; i++) {
+        functions[i].start += delta;
+        functions[i].end += delta;
+    }
+
+    i64 replaced = b - a + 1;
+
+    // the usual edit is inside one function, which is swapped in place
+    if (replaced == region.len) {
+        for (i64 i = 0; i < region.len; i++) {
+            functions[a + i] = region[i];
+        }
+    } else {
+        DynamicArray<WatchFunction> rebuilt = dynamic_array_create<WatchFunction>(state->arena, functions.len - replaced + region.len + 16);
+
+        for (i64 i = 0; i < a; i++) {
+            append(&rebuilt, functions[i]);
+        }
+
+        for (WatchFunction &function : region) {
+            append(&rebuilt, function);
+        }
+
+        for (i64 i = b + 1; i < functions.len; i++) {
+            append(&rebuilt, functions[i]);
+        }
+
+        state->functions = rebuilt;
+        state->dead_bytes += functions.len * (i64) sizeof(WatchFunction);
+    }
+
+    if (state->dead_bytes > state->live_bytes && state->dead_bytes > WATCH_COMPACT_SIZE) {
+        watch_compact(state);
+    }
+
+    arena_reset(&state->scratch);
+
+    return true;
+}
+
+// lexes, parses and compiles the functions in source[start, end) and appends them in order, their listings
+// are in the scratch arena. false after reporting the first error, functions is then incomplete
+bool watch_compile_region(WatchState *state, string source, i64 start, i64 end, DynamicArray<WatchFunction> *functions) {
+    Arena *arena = &state->scratch;
+    CompileWorker *worker = &state->worker;
+
+    TokenStream *tokens = arena_alloc<TokenStream>(arena);
+    *tokens = lex(arena, slice_range(source, start, end));
+
+    if (tokens->kinds.len == 0) {
+        return true;
+    }
+
+    // positions in the whole source, so errors name the right line and functions know where they are
+    for (u32 &token_start : tokens->starts) {
+        token_start += (u32) start;
+    }
+
+    tokens->source = source;
+
+    slice<FunctionSpan> spans = {};
+    AST *ast = arena_alloc<AST>(arena);
+
+    if (!module_split(arena, tokens, &spans) || !parse_spans(arena, tokens, spans, ast)) {
+        return false;
+    }
+
+    slice<NodeIndex> nodes = ast_range(ast, ast->module);
+
+    arena_reset(&worker->arena);
+    worker->slots = ir_symbol_table_create(&worker->arena, symbol_count(ast->interner));
+
+    CompileJob job = {
+        .ast = ast,
+        .options = state->options,
+        .target = &target_win64,
+        .dump_ir = false,
+        .functions = nodes,
+        .workers = slice<CompileWorker>(worker, 1),
+        .results = {},
+    };
+
+    bool ok = true;
+
+    for (i64 i = 0; i < nodes.len; i++) {
+        CompiledFunction compiled = compile_function(&job, worker, nodes[i]);
+        if (compiled.error) {
+            compile_report(ast, nodes[i], compiled.error);
+            ok = false;
+            break;
+        }
+
+        Writer writer = writer_create(arena, NULL);
+        asm_write_code(&writer, compiled.code);
+
+        FunctionSpan span = spans[i];
+        u32 last = span.token_end - 1;
+
+        WatchFunction function = {
+            .start = tokens->starts[span.token_start],
+            .end = tokens->starts[last] + tokens->lengths[last],
+            .text = writer_to_string(&writer),
+        };
+
+        append(functions, function);
+    }
+
+    arena_reset(&worker->arena);
+
+    return ok;
+}
+
+// copies the functions and their live listings into the spare arena and swaps the two
+void watch_compact(WatchState *state) {
+    arena_reset(state->spare);
+
+    DynamicArray<WatchFunction> functions = dynamic_array_create<WatchFunction>(state->spare, state->functions.len + 16);
+    for (WatchFunction function : state->functions) {
+        function.text = slice_clone(state->spare, function.text);
+        append(&functions, function);
+    }
+
+    Arena *arena = state->arena;
+    state->arena = state->spare;
+    state->spare = arena;
+
+    state->functions = functions;
+    state->dead_bytes = 0;
+}
+
+bool watch_write(WatchState *state, const char *output_path) {
+    FILE *file = fopen(output_path, "wb");
+    if (!file) {
+        Err("Failed to create output file");
+        return false;
+    }
+
+    Writer *writer = &state->output;
+    writer->file = file;
+
+    reset(&state->pieces);
+    for (WatchFunction &function : state->functions) {
+        append(&state->pieces, function.text);
+    }
+
+    asm_write_header(writer);
+    bool ok = writer_write_pieces(writer, to_slice(&state->pieces));
+    asm_write_footer(writer);
+    writer_flush(writer);
+
+    writer->file = NULL;
+
+    ok = !ferror(file) && ok;
+    return fclose(file) == 0 && ok;
+}
+
+// last write time in whatever unit the platform keeps, only ever compared for equality
+u64 watch_file_time(const char *path) {
+#if defined(OS_LINUX)
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return 0;
+    }
+
+    return (u64) info.st_mtim.tv_sec * 1000000000ull + (u64) info.st_mtim.tv_nsec + (u64) info.st_size;
+#elif defined(OS_WINDOWS)
+    return platform_file_time(path);
+#else
+    return 0;
+#endif
+}
+
+// @pipeline
+// --pipeline never holds more than one function. the source is read in blocks and cut after the brace
+// that closes each function, which needs no lexing as braces only ever come from function and if bodies.
+// that function is lexed, parsed and compiled on its own, its listing goes out through the writer and
+// the arena it used is reset, so peak memory follows the largest function and not the file
+const i64 PIPELINE_READ_SIZE = 64 * 1024;
+
+struct PipelineReader {
+    FILE *file;
+    bool end_of_file;
+
+    // unconsumed source, bytes before scan have been looked at for the current function already
+    DynamicArray<u8> buffer;
+    i64 consumed;
+    i64 scan;
+
+    i32 depth;
+    bool opened;
+};
+
+bool pipeline_run(Options *options, const char *path, const char *output_path, CompileStats *stats);
+bool pipeline_next_function(PipelineReader *reader, string *text);
+
+bool pipeline_run(Options *options, const char *path, const char *output_path, CompileStats *stats) {
+    FILE *input = fopen(path, "rb");
+    if (!input) {
+        Err("Failed to open source file");
+        return false;
+    }
+
+    FILE *output = fopen(output_path, "wb");
+    if (!output) {
+        fclose(input);
+        Err("Failed to create output file");
+        return false;
+    }
+
+    // the reader and the writer live for the whole run, everything a function needs is in the worker
+    Arena arena = arena_create(GB(1));
+    CompileWorker worker = compile_worker_create();
+
+    PipelineReader reader = {
+        .file = input,
+        .buffer = dynamic_array_create<u8>(&arena, PIPELINE_READ_SIZE * 2),
+    };
+
+    Writer writer = writer_create(&arena, output);
+    asm_write_header(&writer);
+
+    stats->thread_count = 1;
+
+    string text = {};
+
+    // the first function that does not compile ends the run, the listing is left unfinished
+    bool compiled_all = true;
+
+    PhaseTimer functions_timer = stats_begin(stats, SP_Functions);
+
+    while (pipeline_next_function(&reader, &text)) {
+        arena_reset(&worker.arena);
+
+        TokenStream tokens = lex(&worker.arena, text);
+
+        AST ast = {};
+        if (!parse(&worker.arena, &tokens, &ast)) {
+            compiled_all = false;
+            break;
+        }
+
+        slice<NodeIndex> nodes = ast_range(&ast, ast.module);
+        Assertf(nodes.len == 1, "pipeline_next_function cut out more than one function");
+
+        worker.slots = ir_symbol_table_create(&worker.arena, symbol_count(ast.interner));
+
+        CompileJob job = {
+            .ast = &ast,
+            .options = options,
+            .target = &target_win64,
+            .dump_ir = false,
+            .functions = nodes,
+            .workers = slice<CompileWorker>(&worker, 1),
+            .results = {},
+        };
+
+        CompiledFunction compiled = compile_function(&job, &worker, nodes[0]);
+        if (compiled.error) {
+            compile_report(&ast, nodes[0], compiled.error);
+            compiled_all = false;
+            break;
+        }
+
+        asm_write_code(&writer, compiled.code);
+
+        stats_add_function(stats, &compiled.stats);
+
+        stats->source_bytes += text.len;
+        stats->tokens += tokens.kinds.len;
+        stats->ast_nodes += ast.nodes.len;
+        stats->asm_instructions += compiled.code.len;
+    }
+
+    stats_end(stats, functions_timer);
+
+    PhaseTimer output_timer = stats_begin(stats, SP_Output);
+
+    asm_write_footer(&writer);
+    writer_flush(&writer);
+
+    stats->output_bytes = ftell(output);
+
+    bool ok = fclose(output) == 0;
+    fclose(input);
+
+    stats_end(stats, output_timer);
+
+    compile_worker_destroy(&worker);
+    arena_destroy(&arena);
+
+    if (!ok) {
+        Err("Failed to write asm output file");
+    }
+
+    return ok && compiled_all;
+}
+
+// the next function with any whitespace in front of it, false once only whitespace is left
+bool pipeline_next_function(PipelineReader *reader, string *text) {
+    DynamicArray<u8> *buffer = &reader->buffer;
+
+    // the last function is done with, what was read past it moves to the front
+    if (reader->consumed > 0) {
+        i64 remaining = buffer->len - reader->consumed;
+        memmove(buffer->ptr, buffer->ptr + reader->consumed, remaining);
+
+        buffer->len = remaining;
+        reader->scan -= reader->consumed;
+        reader->consumed = 0;
+    }
+
+    while (true) {
+        for (; reader->scan < buffer->len; reader->scan++) {
+            u8 c = (*buffer)[reader->scan];
+
+            if (c == '{') {
+                reader->depth += 1;
+                reader->opened = true;
+            } else if (c == '}') {
+                reader->depth -= 1;
+
+                if (reader->opened && reader->depth == 0) {
+                    reader->scan += 1;
+                    reader->consumed = reader->scan;
+                    reader->opened = false;
+
+                    *text = slice_range(to_slice(buffer), 0, reader->consumed);
+                    return true;
+                }
+            }
+        }
+
+        if (reader->end_of_file) {
+            break;
+        }
+
+        u8 block[PIPELINE_READ_SIZE];
+        u64 read = fread(block, 1, sizeof(block), reader->file);
+
+        if (read < sizeof(block)) {
+            reader->end_of_file = true;
+        }
+
+        for (u64 i = 0; i < read; i++) {
+            append(buffer, block[i]);
+        }
+    }
+
+    for (u8 c : *buffer) {
+        Assertf(char_table.classes[c] == CC_Whitespace, "unterminated function at the end of the source");
+    }
+
+    return false;
+}
+
+// @main
+bool parse_options(Options *options, i32 argc, char **argv);
+bool option_has_prefix(string option, string prefix);
+bool parse_run_arguments(const char *cursor, array<u64, 4> *arguments);
+
+i32 batch_run(CompilerContext *context, CompileTarget target);
+bool batch_use_result(CompilerContext *context, CompileTarget target, CompileResult *result, const char *path);
+CompileTarget options_target(Options *options);
+
+bool parse_options(Options *options, i32 argc, char **argv) {
+    *options = {
+        .lex_mode = LM_Batch,
+        .ir = IK_Stack,
+        .regalloc = RA_Stack,
+        .isel = SM_Stack,
+        .optimisation_level = 0,
+        .run = false,
+        .run_arguments = {100, 200, 300, 400},
+        .object_path = NULL,
+        .vm = false,
+        .vm_benchmark_iterations = 0,
+        .lex_benchmark_megabytes = 0,
+        .parallel_lex_megabytes = 32,
+        .thread_count = pool_default_thread_count(),
+        .stats = SF_None,
+        .emit = 0,
+        .dump_directory = NULL,
+        .cache_directory = NULL,
+        .batch = false,
+        .batch_manifest = NULL,
+        .watch = false,
+        .pipeline = false,
+    };
+
+    for (i32 i = 1; i < argc; i++) {
+        string option = string(argv[i]);
+
+        if (option_has_prefix(option, "--ir=")) {
+            string value = slice_range(option, 5, option.len);
+
+            if (slice_memcmp(value, string("stack"))) {
+                options->ir = IK_Stack;
+            } else if (slice_memcmp(value, string("ssa"))) {
+                options->ir = IK_SSA;
+            } else {
+                Err("--ir expects 'stack' or 'ssa'");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--lexer=")) {
+            string value = slice_range(option, 8, option.len);
+
+            if (slice_memcmp(value, string("batch"))) {
+                options->lex_mode = LM_Batch;
+            } else if (slice_memcmp(value, string("stream"))) {
+                options->lex_mode = LM_Stream;
+            } else {
+                Err("--lexer expects 'batch' or 'stream'");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--run"))) {
+            options->run = true;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--run=")) {
+            options->run = true;
+
+            if (!parse_run_arguments(argv[i] + 6, &options->run_arguments)) {
+                Err("--run expects four comma separated integers");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--vm"))) {
+            options->vm = true;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--vm=")) {
+            options->vm = true;
+
+            if (!parse_run_arguments(argv[i] + 5, &options->run_arguments)) {
+                Err("--vm expects four comma separated integers");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--bench-vm"))) {
+            options->vm_benchmark_iterations = 1000000;
+            continue;
+        }
 
-        switch (instruction.type) {
-            case IT_StartFunction: {
-                fmt(&bytes, "StartFunction '{}'\n", instruction.string);
-            } break;
-            case IT_EndFunction: {
-                fmt(&bytes, "EndFunction '{}'\n", instruction.string);
-            } break;
-            case IT_Push: {
-                fmt(&bytes, "Push {}\n", instruction.value);
-            } break;
-            case IT_Add: {
-                fmt(&bytes, "Add\n");
-            } break;
-            case IT_Local: {
-                fmt(&bytes, "Local {}\n", instruction.value);
-            } break;
-            case IT_Return: {
-                fmt(&bytes, "Return\n");
-            } break;
-            case IT_IfZero: {
-                fmt(&bytes, "IfZero '{}'\n", instruction.string);
-            } break;
-            case IT_Label: {
-                fmt(&bytes, "Label '{}'\n", instruction.string);
-            } break;
-            case IT_CompareEqual: {
-                fmt(&bytes, "CompareEqual\n");
-            } break;
-            case IT_Print: {
-                fmt(&bytes, "Print\n");
-            } break;
-            default:
-                Unreachable("unsupported instruction type in ir_to_string");
+        if (option_has_prefix(option, "--bench-vm=")) {
+            options->vm_benchmark_iterations = atoi(argv[i] + 11);
+
+            if (options->vm_benchmark_iterations <= 0) {
+                Err("--bench-vm expects a positive iteration count");
+                return false;
+            }
+
+            continue;
         }
-    }
 
-    return to_slice(&bytes);
-}
+        if (slice_memcmp(option, string("--object"))) {
+            options->object_path = "program/output.o";
+            continue;
+        }
 
-// @asm
-string asmgen(Arena *arena, IR *ir);
+        if (option_has_prefix(option, "--object=")) {
+            options->object_path = argv[i] + 9;
+            continue;
+        }
 
-string asmgen(Arena *arena, IR *ir) {
-    DynamicArray<u8> bytes = dynamic_array_create<u8>(arena, 1024);
+        if (slice_memcmp(option, string("--bench-lex"))) {
+            options->lex_benchmark_megabytes = 64;
+            continue;
+        }
 
-    slice<Instruction> instructions = to_slice(&ir->instructions);
+        if (option_has_prefix(option, "--bench-lex=")) {
+            options->lex_benchmark_megabytes = atoi(argv[i] + 12);
 
-    fmt(&bytes, "EXTERN putchar:PROC\n");
-    fmt(&bytes, ".code\n");
+            if (options->lex_benchmark_megabytes <= 0) {
+                Err("--bench-lex expects a positive size in megabytes");
+                return false;
+            }
 
-    for (i32 i = 0; i < instructions.len; i++) {
-        Instruction instruction = instructions[i];
+            continue;
+        }
 
-        fmt(&bytes, "\n; [{}]\n", i);
+        if (option_has_prefix(option, "--parallel-lex=")) {
+            options->parallel_lex_megabytes = atoi(argv[i] + 15);
 
-        switch (instruction.type) {
-            case IT_StartFunction: {
-                fmt(&bytes, "{} proc\n", instruction.string);
-                fmt(&bytes, "    push rbp\n");
-                fmt(&bytes, "    mov rbp, rsp\n");
-            } break;
-            case IT_EndFunction: {
-                fmt(&bytes, "{} endp\n", instruction.string);
-            } break;
-            case IT_Push: {
-                fmt(&bytes, "    push {}\n", instruction.value);
-            } break;
-            case IT_Add: {
-                fmt(&bytes, "    pop rbx\n");
-                fmt(&bytes, "    pop rax\n");
-                fmt(&bytes, "    add rax, rbx\n");
-                fmt(&bytes, "    push rax\n");
-            } break;
-            case IT_Local: {
-                if (instruction.value == 0) {
-                    fmt(&bytes, "    push rcx\n");
-                } else if (instruction.value == 1) {
-                    fmt(&bytes, "    push rdx\n");
-                } else if (instruction.value == 2) {
-                    fmt(&bytes, "    push r8\n");
-                } else if (instruction.value == 3) {
-                    fmt(&bytes, "    push r9\n");
+            if (options->parallel_lex_megabytes < 0) {
+                Err("--parallel-lex expects a size in megabytes, or 0 to turn it off");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--stats"))) {
+            options->stats = SF_Human;
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--stats=json"))) {
+            options->stats = SF_Json;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--emit=")) {
+            string list = slice_range(option, 7, option.len);
+
+            while (list.len > 0) {
+                i64 end = 0;
+                while (end < list.len && list[end] != ',') {
+                    end += 1;
                 }
-            } break;
-            case IT_Return: {
-                fmt(&bytes, "    pop rax\n");
-                fmt(&bytes, "    pop rbp\n");
-                fmt(&bytes, "    ret\n");
-            } break;
-            case IT_IfZero: {
-                fmt(&bytes, "    pop rbx\n");
-                fmt(&bytes, "    cmp rbx, 0\n");
-                fmt(&bytes, "    je {}\n", instruction.string);
-            } break;
-            case IT_Label: {
-                fmt(&bytes, "{}:\n", instruction.string);
-            } break;
-            case IT_CompareEqual: {
-                fmt(&bytes, "    pop rax\n");
-                fmt(&bytes, "    pop rbx\n");
-                fmt(&bytes, "    cmp rax, rbx\n");
-                fmt(&bytes, "    mov rax, 0\n");
-                fmt(&bytes, "    setz al\n");
-                fmt(&bytes, "    push rax\n");
-            } break;
-            case IT_Print: {
-                fmt(&bytes, "    pop rcx\n");
-                fmt(&bytes, "    call putchar\n");
-                fmt(&bytes, "    mov rcx, 10\n");
-                fmt(&bytes, "    call putchar\n");
-            } break;
-            default:
-                Unreachable("unsupported instruction type in asmgen");
+
+                string name = slice_range(list, 0, end);
+                list = slice_range(list, end < list.len ? end + 1 : end, list.len);
+
+                bool found = false;
+                for (i32 k = 0; k < EK_Count; k++) {
+                    if (slice_memcmp(name, emit_kind_to_string((EmitKind) k))) {
+                        options->emit |= 1u << k;
+                        found = true;
+                    }
+                }
+
+                if (!found) {
+                    Err("--emit expects a comma separated list of tokens, ast, ir and asm");
+                    return false;
+                }
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--dump-to=")) {
+            options->dump_directory = argv[i] + 10;
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--batch"))) {
+            options->batch = true;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--batch=")) {
+            options->batch = true;
+            options->batch_manifest = argv[i] + 8;
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--pipeline"))) {
+            options->pipeline = true;
+            continue;
+        }
+
+        if (slice_memcmp(option, string("--watch"))) {
+            options->watch = true;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--cache=")) {
+            options->cache_directory = argv[i] + 8;
+            continue;
+        }
+
+        if (option_has_prefix(option, "--threads=")) {
+            options->thread_count = atoi(argv[i] + 10);
+
+            if (options->thread_count < 1 || options->thread_count > POOL_MAX_THREADS) {
+                Err("--threads expects a count between 1 and 64");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "-O")) {
+            string value = slice_range(option, 2, option.len);
+
+            if (slice_memcmp(value, string("0"))) {
+                options->optimisation_level = 0;
+            } else if (slice_memcmp(value, string("1"))) {
+                options->optimisation_level = 1;
+            } else if (slice_memcmp(value, string("2"))) {
+                options->optimisation_level = 2;
+            } else {
+                Err("-O expects a level of 0, 1 or 2");
+                return false;
+            }
+
+            continue;
         }
+
+        if (option_has_prefix(option, "--regalloc=")) {
+            string value = slice_range(option, 11, option.len);
+
+            if (slice_memcmp(value, string("stack"))) {
+                options->regalloc = RA_Stack;
+            } else if (slice_memcmp(value, string("linear"))) {
+                options->regalloc = RA_Linear;
+            } else {
+                Err("--regalloc expects 'stack' or 'linear'");
+                return false;
+            }
+
+            continue;
+        }
+
+        if (option_has_prefix(option, "--isel=")) {
+            string value = slice_range(option, 7, option.len);
+
+            if (slice_memcmp(value, string("stack"))) {
+                options->isel = SM_Stack;
+            } else if (slice_memcmp(value, string("tree"))) {
+                options->isel = SM_Tree;
+            } else {
+                Err("--isel expects 'stack' or 'tree'");
+                return false;
+            }
+
+            continue;
+        }
+
+        printf("Option: '%s'\n", argv[i]);
+        Err("Unknown option");
+        return false;
     }
 
-    fmt(&bytes, "end\n");
+    if ((options->vm || options->vm_benchmark_iterations) && options->ir != IK_Stack) {
+        Err("the vm only runs the stack ir");
+        return false;
+    }
 
-    return to_slice(&bytes);
+    if (options->isel == SM_Tree && (options->ir != IK_Stack || options->regalloc != RA_Stack)) {
+        Err("--isel=tree only selects for the stack ir without a register allocator");
+        return false;
+    }
+
+    if (options->watch && (options->run || options->vm || options->vm_benchmark_iterations || options->object_path || options->batch || options->cache_directory || options->emit)) {
+        Err("--watch only writes the asm listing");
+        return false;
+    }
+
+    if (options->pipeline && (options->watch || options->run || options->vm || options->vm_benchmark_iterations || options->object_path || options->batch || options->cache_directory || options->emit)) {
+        Err("--pipeline only writes the asm listing");
+        return false;
+    }
+
+    return true;
 }
 
-// @main
-i32 main() {
-    log_set_options(false, false);
+bool option_has_prefix(string option, string prefix) {
+    if (option.len < prefix.len) {
+        return false;
+    }
 
+    return slice_memcmp(slice_range(option, 0, prefix.len), prefix);
+}
+
+bool parse_run_arguments(const char *cursor, array<u64, 4> *arguments) {
+    for (i32 k = 0; k < (i32) arguments->size(); k++) {
+        char *end = NULL;
+        (*arguments)[k] = strtoull(cursor, &end, 10);
+
+        bool last = k == (i32) arguments->size() - 1;
+        if (end == cursor || (!last && *end != ',') || (last && *end != '\0')) {
+            return false;
+        }
+
+        cursor = end + 1;
+    }
+
+    return true;
+}
+
+CompileTarget options_target(Options *options) {
+    if (options->vm || options->vm_benchmark_iterations) {
+        return CT_Bytecode;
+    }
+
+    if (options->run) {
+        return CT_Jit;
+    }
+
+    return options->object_path ? CT_Object : CT_Asm;
+}
+
+// sources come from a manifest of paths, one per line, or from stdin separated by lines holding just %%
+i32 batch_run(CompilerContext *context, CompileTarget target) {
+    Options *options = &context->options;
+
+    // the inputs outlive every compilation so they cannot go in the context's arena
     Arena arena = arena_create(GB(1));
 
-    string source = read_entire_file("program/code.code");
+    DynamicArray<string> sources = dynamic_array_create<string>(&arena, 64);
+    DynamicArray<const char *> paths = dynamic_array_create<const char *>(&arena, 64);
+
+    if (options->batch_manifest) {
+        string manifest = read_entire_file(options->batch_manifest);
+
+        for (i64 start = 0; start < manifest.len;) {
+            i64 end = start;
+            while (end < manifest.len && manifest[end] != '\n' && manifest[end] != '\r') {
+                end += 1;
+            }
+
+            if (end > start) {
+                DynamicArray<u8> path = dynamic_array_create<u8>(&arena, end - start + 1);
+                for (i64 i = start; i < end; i++) {
+                    append(&path, manifest[i]);
+                }
+
+                append(&path, (u8) 0);
+                append(&paths, (const char *) path.ptr);
+            }
+
+            start = end + 1;
+        }
+    } else {
+        DynamicArray<u8> input = dynamic_array_create<u8>(&arena, 64 * 1024);
+
+        u8 block[4096];
+        for (u64 read = 0; (read = fread(block, 1, sizeof(block), stdin)) > 0;) {
+            for (u64 i = 0; i < read; i++) {
+                append(&input, block[i]);
+            }
+        }
+
+        string text = to_slice(&input);
+        i64 source_start = 0;
+
+        for (i64 start = 0; start <= text.len;) {
+            i64 end = start;
+            while (end < text.len && text[end] != '\n') {
+                end += 1;
+            }
 
-    {
-        Log("=== SOURCE ===");
-        Log(source);
+            string line = slice_range(text, start, end);
+            if (line.len > 0 && line[line.len - 1] == '\r') {
+                line.len -= 1;
+            }
+
+            bool separator = slice_memcmp(line, string("%%"));
+
+            if (separator || end == text.len) {
+                string source = slice_range(text, source_start, separator ? start : end);
+
+                // blank lines around a separator are not a source of their own
+                if (lex_skip_whitespace(source, 0) < source.len) {
+                    append(&sources, source);
+                }
+
+                source_start = end + 1;
+            }
+
+            start = end + 1;
+        }
     }
 
-    slice<Token> tokens = lex(&arena, source);
+    i64 count = options->batch_manifest ? paths.len : sources.len;
+    i64 failed = 0;
+
+    u64 start_time = time_now_nanoseconds();
+
+    for (i64 i = 0; i < count; i++) {
+        const char *path = options->batch_manifest ? paths[i] : NULL;
+        string source = path ? read_entire_file(path) : sources[i];
+
+        if (source.len == 0) {
+            printf("Source: '%s'\n", path ? path : "stdin");
+            Err("Empty or unreadable batch source");
 
-    {
-        Arena temp_arena = arena_create(MB(5));
+            failed += 1;
+            continue;
+        }
 
-        string tokens_string = tokens_to_string(&temp_arena, tokens);
-        Log("=== TOKENS ===");
-        Log(tokens_string);
+        CompileResult result = {};
 
-        arena_destroy(&temp_arena);
+        if (!compiler_compile(context, source, target, &result) || !batch_use_result(context, target, &result, path)) {
+            failed += 1;
+        }
     }
 
-    AST ast = parse(&arena, tokens);
+    u64 elapsed = time_now_nanoseconds() - start_time;
+    f64 seconds = (f64) elapsed / 1e9;
+
+    printf("batch, %lld sources, %lld failed, %.2f ms, %.0f compiles/s\n", (long long) count, (long long) failed,
+        seconds * 1e3, (f64) count / (seconds > 0 ? seconds : 1e-9));
 
-    {
-        Arena temp_arena = arena_create(MB(5));
+    arena_destroy(&arena);
 
-        string ast_string = ast_to_string(&temp_arena, &ast);
-        Log("=== AST ===");
-        Log(ast_string);
+    return failed ? 1 : 0;
+}
+
+// runs or writes one compilation, the asm and objects of stdin sources are dropped as there is nowhere
+// to put them
+bool batch_use_result(CompilerContext *context, CompileTarget target, CompileResult *result, const char *path) {
+    array<u64, 4> a = context->options.run_arguments;
+
+    switch (target) {
+        case CT_Jit: {
+            printf("OUTPUT=%llu\n", (unsigned long long) result->function(a[0], a[1], a[2], a[3]));
+        } break;
+        case CT_Bytecode: {
+            printf("OUTPUT=%llu\n", (unsigned long long) vm_run(&result->bytecode, a, false));
+        } break;
+        case CT_Asm:
+        case CT_Object: {
+            if (!path) {
+                break;
+            }
+
+            DynamicArray<u8> output_path = dynamic_array_create<u8>(&context->arena, 256);
+            fmt(&output_path, "{}{}", string(path), string(target == CT_Asm ? ".asm" : ".o"));
+            append(&output_path, (u8) 0);
+
+            File file = new_file((const char *) output_path.ptr);
 
-        arena_destroy(&temp_arena);
+            if (!create_file(&file) || !write_file(&file, result->output)) {
+                printf("Output: '%s'\n", (const char *) output_path.ptr);
+                Err("Failed to write batch output file");
+                return false;
+            }
+        } break;
+        default:
+            Unreachable("unsupported target in batch_use_result");
     }
 
-    IR ir = ir_gen(&arena, &ast);
+    if (result->stats.enabled) {
+        stats_print(&result->stats, context->options.stats);
+    }
 
-    {
-        Arena temp_arena = arena_create(MB(5));
+    return true;
+}
 
-        string ir_string = ir_to_string(&temp_arena, &ir);
-        Log("=== IR ===");
-        Log(ir_string);
+// the benchmark includes this file for the phases and brings its own main
+#if !defined(COMPILER_NO_MAIN)
+i32 main(i32 argc, char **argv) {
+    log_set_options(false, false);
 
-        arena_destroy(&temp_arena);
+    Options options;
+    if (!parse_options(&options, argc, argv)) {
+        return 1;
     }
 
-    string assembly = asmgen(&arena, &ir);
+    if (options.lex_benchmark_megabytes) {
+        string source = read_entire_file("program/code.code");
+        lex_benchmark(source, options.lex_benchmark_megabytes, options.thread_count);
+
+        return 0;
+    }
 
-    {
-        Log("=== ASSEMBLY ===");
-        Log(assembly);
+    if (options.watch) {
+        return watch_run(&options, "program/code.code", "program/output.asm");
     }
 
-    File output_file = new_file("program/output.asm");
+    if (options.pipeline) {
+        CompileStats stats = {.enabled = options.stats != SF_None};
 
-    bool ok = create_file(&output_file);
-    if (!ok) {
-        Err("Failed to create output file");
-        return 1;
+        if (!pipeline_run(&options, "program/code.code", "program/output.asm", &stats)) {
+            return 1;
+        }
+
+        if (stats.enabled) {
+            stats_print(&stats, options.stats);
+        }
+
+        return 0;
     }
 
-    ok = write_file(&output_file, assembly);
-    if (!ok) {
-        Err("Failed to write asm output file");
-        return 1;
+    CompilerContext context = compiler_create(&options);
+    CompileTarget target = options_target(&options);
+
+    if (options.batch) {
+        i32 status = batch_run(&context, target);
+        compiler_destroy(&context);
+
+        return status;
     }
-}
 
+    string source = read_entire_file("program/code.code");
 
+    // the listing is streamed while compiling, so it goes to a temporary that only replaces the
+    // output once the module compiled. a failed compile leaves the last listing as it was
+    const char *asm_temporary = "program/output.asm.tmp";
 
+    if (target == CT_Asm) {
+        context.asm_file = fopen(asm_temporary, "wb");
 
+        if (!context.asm_file) {
+            Err("Failed to create output file");
+            return 1;
+        }
+    }
 
+    CompileResult result = {};
+    if (!compiler_compile(&context, source, target, &result)) {
+        if (context.asm_file) {
+            fclose(context.asm_file);
+            remove(asm_temporary);
+        }
 
+        compiler_destroy(&context);
+        return 1;
+    }
 
+    switch (target) {
+        case CT_Bytecode: {
+            if (options.vm_benchmark_iterations) {
+                vm_benchmark(&context.arena, &result.ir, options.run_arguments, options.vm_benchmark_iterations);
+                return 0;
+            }
 
+            u64 output = vm_run(&result.bytecode, options.run_arguments, false);
+            printf("OUTPUT=%llu\n", (unsigned long long) output);
+        } break;
+        case CT_Jit: {
+            array<u64, 4> a = options.run_arguments;
+            u64 output = result.function(a[0], a[1], a[2], a[3]);
 
+            printf("OUTPUT=%llu\n", (unsigned long long) output);
+        } break;
+        case CT_Object: {
+            File object_file = new_file(options.object_path);
 
+            if (!create_file(&object_file)) {
+                Err("Failed to create object file");
+                return 1;
+            }
 
+            if (!write_file(&object_file, result.output)) {
+                Err("Failed to write object file");
+                return 1;
+            }
+        } break;
+        case CT_Asm: {
+            // streamed while compiling, only the close and the rename can still fail
+            bool ok = !ferror(context.asm_file);
+            ok = fclose(context.asm_file) == 0 && ok;
+            ok = ok && replace_file(asm_temporary, "program/output.asm");
+
+            if (!ok) {
+                remove(asm_temporary);
+                Err("Failed to write asm output file");
+                return 1;
+            }
+        } break;
+        default:
+            Unreachable("unsupported target in main");
+    }
 
+    if (result.stats.enabled) {
+        stats_print(&result.stats, options.stats);
+    }
 
+    compiler_destroy(&context);
+}
+#endif
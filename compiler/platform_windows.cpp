@@ -0,0 +1,94 @@
+// the windows calls the compiler makes, kept out of compiler.cpp so windows.h never meets its names.
+// winnt.h declares TokenType among others, which collides with the lexer's enum of the same name.
+// everything here crosses over as plain c types through the prototypes at the top of compiler.cpp
+
+#if defined(OS_WINDOWS)
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+
+#include <stdint.h>
+
+#pragma comment(lib, "psapi.lib")
+
+extern "C" uint64_t platform_resident_bytes() {
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+
+    return (uint64_t) counters.WorkingSetSize;
+}
+
+extern "C" uint64_t platform_peak_bytes() {
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+
+    return (uint64_t) counters.PeakWorkingSetSize;
+}
+
+// NULL when the file is missing or empty, otherwise a read only view released with platform_unmap_file
+extern "C" const uint8_t *platform_map_file(const char *path, uint64_t *size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+
+    if (!mapping) {
+        return NULL;
+    }
+
+    // the view keeps the mapping alive on its own
+    void *memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    if (!memory) {
+        return NULL;
+    }
+
+    *size = (uint64_t) file_size.QuadPart;
+    return (const uint8_t *) memory;
+}
+
+extern "C" void platform_unmap_file(const uint8_t *memory) {
+    UnmapViewOfFile(memory);
+}
+
+// true when the directory exists afterwards
+extern "C" bool platform_create_directory(const char *path) {
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// MoveFileExA replaces an existing target only when asked to, rename never does
+extern "C" bool platform_replace_file(const char *from, const char *to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+// last write time plus size, 0 when the file cannot be read
+extern "C" uint64_t platform_file_time(const char *path) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &info)) {
+        return 0;
+    }
+
+    return ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime) + info.nFileSizeLow;
+}
+
+#endif
@@ -38,6 +38,16 @@ project "compiler"
 
     files {
         "compiler/compiler.cpp",
+        "compiler/platform_windows.cpp",
+    }
+
+project "benchmark"
+    kind "ConsoleApp"
+    location "build/%{prj.name}"
+
+    files {
+        "benchmark/benchmark.cpp",
+        "compiler/platform_windows.cpp",
     }
 
 project "program"
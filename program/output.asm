@@ -5,21 +5,28 @@ EXTERN putchar:PROC
 FUNC proc
     push rbp
     mov rbp, rsp
+    push rcx
+    push rdx
+    push r8
+    push r9
 
 ; [1]
     push 32
 
 ; [2]
     pop rcx
+    sub rsp, 32
     call putchar
     mov rcx, 10
     call putchar
+    add rsp, 32
 
 ; [3]
     push 100
 
 ; [4]
     pop rax
+    mov rsp, rbp
     pop rbp
     ret
 